@@ -16,6 +16,8 @@ class SampleServer final : public sonicpp::ServerInterface<MessageType>
 public:
   SampleServer(uint16_t nPort) : sonicpp::ServerInterface<MessageType>(nPort)
   {
+    // answer the clients' clock exchanges
+    SetClockSync({.bEnabled = true});
   }
 
 protected:
@@ -33,8 +35,6 @@ protected:
     {
       case MessageType::ServerPing:
       {
-        std::chrono::system_clock::time_point timeThen;        
-
         // Bounce message back
         MessageClient(client, msg); 
       }
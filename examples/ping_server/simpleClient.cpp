@@ -21,6 +21,8 @@ class SampleClient final : public sonicpp::ClientIntefrace<MessageType>
 {
 public:
   SampleClient(){
+    // running estimate of the round trip next to the one measured by hand
+    SetClockSync({.bEnabled = true, .interval = 500ms});
     if(!Connect("127.0.0.1", 60'000))
       exit(1);
 
@@ -45,12 +47,15 @@ public:
           {
             case MessageType::ServerPing:
             {
-              std::chrono::system_clock::time_point timeNow = std::chrono::system_clock::now();
-              std::chrono::system_clock::time_point timeThen;
+              // steady clock, a wall clock adjustment would show up as latency
+              std::chrono::steady_clock::time_point timeNow = std::chrono::steady_clock::now();
+              std::chrono::steady_clock::time_point timeThen;
               *msg >> timeThen;
 
-              std::cout << "Timepoint received: " << std::chrono::system_clock::to_time_t(timeThen) << std::endl;
-              std::cout << "Ping: " << std::chrono::duration<double>(timeNow - timeThen).count() << "ms" << std::endl;
+              auto clock = GetClock();
+              std::cout << "Ping: " << std::chrono::duration<double, std::milli>(timeNow - timeThen).count() << "ms"
+                        << " (smoothed " << std::chrono::duration<double, std::milli>(clock.rtt).count() << "ms"
+                        << ", jitter " << std::chrono::duration<double, std::milli>(clock.jitter).count() << "ms)" << std::endl;
             }
             break;
             default:
@@ -73,11 +78,8 @@ public:
     sonicpp::Message<MessageType> msg;
     msg.header.id = MessageType::ServerPing;
 
-    std::chrono::system_clock::time_point timeNow = std::chrono::system_clock::now();
-    msg << timeNow;
+    msg << std::chrono::steady_clock::now();
     Send(msg);   
-    msg >> timeNow;
-    std::cout << "Timepoint sent: " << std::chrono::system_clock::to_time_t(timeNow) << std::endl; 
   }
 };
 
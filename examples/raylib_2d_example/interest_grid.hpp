@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "multiplayer_common.hpp"
+
+// Uniform spatial hash over the world used for interest management
+// Every player sees a rectangle of cells around the cell it stands in,
+// visibility is symmetric, if A sees B then B sees A.
+// Cells are TILE_SIZE wide and cover the same area as the background grid.
+class InterestGrid
+{
+public:
+  // viewer and subject are player ids
+  using Event = std::function<void(idT viewer, idT subject)>;
+
+  static constexpr int CELLS = 2 * (int)GRID_SIZE;
+
+  // view extents in cells from the viewer cell in each direction
+  InterestGrid(int viewCellsX, int viewCellsY)
+  : m_viewX(viewCellsX), m_viewY(viewCellsY), m_cells(CELLS * CELLS)
+  {}
+
+  // Place a new player or move an existing one
+  // onEnter/onLeave are called for every pair that started/stopped seeing each other
+  void Update(idT id, Vector2 pos, const Event& onEnter, const Event& onLeave)
+  {
+    const Cell cell = CellOf(pos);
+    auto it = m_entities.find(id);
+    if(it == m_entities.end())
+    {
+      Insert(id, cell);
+      ForEachInView(cell, [&](idT other)
+      {
+        if(other == id) return;
+        onEnter(other, id);
+        onEnter(id, other);
+      });
+      return;
+    }
+
+    const Cell old = it->second;
+    if(old == cell)
+      return;
+
+    Erase(id, old);
+    Insert(id, cell);
+
+    // players only in the old view lost sight, players only in the new one gained it
+    ForEachInView(old, [&](idT other)
+    {
+      if(other == id || InView(cell, m_entities[other])) return;
+      onLeave(other, id);
+      onLeave(id, other);
+    });
+    ForEachInView(cell, [&](idT other)
+    {
+      if(other == id || InView(old, m_entities[other])) return;
+      onEnter(other, id);
+      onEnter(id, other);
+    });
+  }
+
+  void Remove(idT id, const Event& onLeave)
+  {
+    auto it = m_entities.find(id);
+    if(it == m_entities.end())
+      return;
+
+    const Cell cell = it->second;
+    Erase(id, cell);
+    m_entities.erase(it);
+    ForEachInView(cell, [&](idT other){ onLeave(other, id); });
+  }
+
+  // Call fn for every player that can see subject, subject excluded
+  template<typename Fn>
+  void ForEachViewer(idT subject, Fn fn) const
+  {
+    auto it = m_entities.find(subject);
+    if(it == m_entities.end())
+      return;
+    ForEachInView(it->second, [&](idT other){ if(other != subject) fn(other); });
+  }
+
+private:
+  struct Cell
+  {
+    int x, y;
+    friend bool operator==(const Cell& a, const Cell& b){ return a.x == b.x && a.y == b.y; }
+  };
+
+  Cell CellOf(Vector2 pos) const
+  {
+    // grid is centered on the world origin, positions outside are clamped to the border cells
+    auto toCell = [](float v){ return std::clamp((int)std::floor(v / TILE_SIZE) + CELLS/2, 0, CELLS - 1); };
+    return {toCell(pos.x), toCell(pos.y)};
+  }
+
+  bool InView(Cell a, Cell b) const
+  {
+    return std::abs(a.x - b.x) <= m_viewX && std::abs(a.y - b.y) <= m_viewY;
+  }
+
+  std::vector<idT>& At(Cell cell) { return m_cells[cell.y * CELLS + cell.x]; }
+  const std::vector<idT>& At(Cell cell) const { return m_cells[cell.y * CELLS + cell.x]; }
+
+  void Insert(idT id, Cell cell)
+  {
+    At(cell).push_back(id);
+    m_entities[id] = cell;
+  }
+
+  void Erase(idT id, Cell cell)
+  {
+    auto& ids = At(cell);
+    // order inside a cell doesn't matter, swap with the last one
+    auto it = std::find(ids.begin(), ids.end(), id);
+    if(it != ids.end())
+    {
+      *it = ids.back();
+      ids.pop_back();
+    }
+  }
+
+  template<typename Fn>
+  void ForEachInView(Cell center, Fn fn) const
+  {
+    for(int y = std::max(center.y - m_viewY, 0); y <= std::min(center.y + m_viewY, CELLS - 1); ++y)
+      for(int x = std::max(center.x - m_viewX, 0); x <= std::min(center.x + m_viewX, CELLS - 1); ++x)
+        for(idT id : At({x, y}))
+          fn(id);
+  }
+
+private:
+  const int m_viewX;
+  const int m_viewY;
+  // dense cell array, each cell holds ids of the players inside
+  std::vector<std::vector<idT>> m_cells;
+  // cell every player currently occupies
+  std::unordered_map<idT, Cell> m_entities;
+};
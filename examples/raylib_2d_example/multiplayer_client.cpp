@@ -12,6 +12,8 @@
 
 #include "../../library/client.h"
 #include "../../library/message.h"
+#include "../../library/interpolation.h"
+#include "../../library/prediction.h"
 #include "multiplayer_common.hpp"
 
 
@@ -25,6 +27,13 @@ private:
   raylib::Camera2D mainCamera{};
   
   std::unordered_map<idT, PlayerDescription> players{};
+  // other players are drawn slightly in the past, in between the states received,
+  // only the ones in view have states and are shown
+  std::unordered_map<idT, sonicpp::interpolation_buffer<PlayerDescription::PlayerPhysDesc>> remoteStates{};
+  // updates come every frame (~16ms), this covers a couple of late ones
+  const sonicpp::InterpolationConfig interpolation{.delay = 60ms, .maxExtrapolation = 50ms};
+  // our own player moves by our inputs right away, the server corrects it
+  sonicpp::predictor<PlayerInput, PlayerDescription::PlayerPhysDesc> prediction{ApplyPlayerInput};
   idT thisPlayerID{0};
   PlayerDescription descPlayer{};
   bool bWaitingForConnection{true};
@@ -36,12 +45,19 @@ private:
 
 public:
   Game(std::string& ip, uint16_t port)
-  : mainCamera(screenSize/2.f, {0,0}, 0.f, 1.0f)
+  : sonicpp::ClientIntefrace<GameMsg>(sonicpp::ClientMode::Poll),
+    mainCamera(screenSize/2.f, {0,0}, 0.f, 1.0f)
   {
     SetConfigFlags(FLAG_WINDOW_RESIZABLE);
     SetConfigFlags(FLAG_VSYNC_HINT);
     InitWindow(screenSize.x, screenSize.y, "Game");
     SetTargetFPS(60);
+
+    // the server's result of our inputs
+    On<GameMsg::Game_PlayerState>([this](sonicpp::acked_state<PlayerDescription::PlayerPhysDesc> state)
+    {
+      prediction.reconcile(state);
+    });
     
 
     // Game logic related
@@ -51,6 +67,8 @@ public:
     while (!WindowShouldClose())
     {
         Update(GetFrameTime());
+        // sends this frame's input right away and handles what arrived, on this thread
+        Poll();
         BeginDrawing();
           DrawScreen();
           DrawFPS(10, 10);
@@ -98,111 +116,117 @@ private:
     return false;
   }
   
-  void Update(float deltaTime)
+  // Called by Poll() for every message from the server
+  void OnMessage(Message& msg) override
   {
-    // Check for incoming messages
-    if(IsConnected())
+    switch(msg.GetType())
     {
-      while(auto msg = NextMessage())
+      // We have been accepted as a client
+      // we can't yet interact though
+      case GameMsg::Client_Accepted:
+      {
+          std::cout << "Server Accepted you!" << std::endl;
+          Message msgSend;
+          msgSend.header.id = GameMsg::Client_RegisterWithServer;
+
+          descPlayer = PlayerDescription({GetRenderWidth()/2.f, GetRenderHeight()/2.f});
+          msgSend << descPlayer;
+        
+          Send(msgSend);
+      }
+      break;
+      // Server assigned an ClientID for us
+      case GameMsg::Client_AssignID:
+      {
+          msg >> thisPlayerID;
+          std::cout << "Server provided your id: " << thisPlayerID << std::endl;
+      }
+      break;
+      // Server added a new player, that could be us
+      case GameMsg::Game_AddPlayer:
       {
+        PlayerDescription desc;
+        msg >> desc;
+        players[desc.uUniqueID] = desc; 
 
-        switch(msg->GetType())
+        std::cout << "Server added player: " << desc.uUniqueID << std::endl;
+        // Thats us, we have been finally added to game by the server
+        if(desc.uUniqueID == thisPlayerID)
         {
-          // We have been accepted as a client
-          // we can't yet interact though
-          case GameMsg::Client_Accepted:
-          {
-              std::cout << "Server Accepted you!" << std::endl;
-              Message msgSend;
-              msgSend.header.id = GameMsg::Client_RegisterWithServer;
-
-              descPlayer = PlayerDescription({GetRenderWidth()/2.f, GetRenderHeight()/2.f});
-              msgSend << descPlayer;
-            
-              Send(msgSend);
-          }
-          break;
-          // Server assigned an ClientID for us
-          case GameMsg::Client_AssignID:
-          {
-              *msg >> thisPlayerID;
-              std::cout << "Server provided your id: " << thisPlayerID << std::endl;
-          }
-          break;
-          // Server added a new player, that could be us
-          case GameMsg::Game_AddPlayer:
-          {
-            PlayerDescription desc;
-            *msg >> desc;
-            players[desc.uUniqueID] = desc; 
-
-            std::cout << "Server added player: " << desc.uUniqueID << std::endl;
-            // Thats us, we have been finally added to game by the server
-            if(desc.uUniqueID == thisPlayerID)
-            {
-                // now we can play
-                bWaitingForConnection = false;
-            }
-          }
-          break;
-          // Server removed a player
-          case GameMsg::Game_RemovePlayer:
-          {
-            idT removeId;
-            *msg >> removeId;
-            players.erase(removeId);              
-          }
-          break;
-          // Update some player object, could be us
-          case GameMsg::Game_UpdatePlayer:
-          {
-            idT id;
-            PlayerDescription::PlayerPhysDesc physDesc;
-            *msg >> physDesc >> id;
-            
-            // desc.vel = players[desc.uUniqueID].vel;
-            players[id].phys = physDesc;
-
-            // Check collisions with other objects
-            for(auto& object : players)
-              UpdatePlayerCollisions(players[id].phys, object.second.phys);
-          }
-          break;
-          case GameMsg::Game_UpdatePlayerLook:
-          {
-            // PlayerDescription::PlayerLookDesc newLook;
-            idT id;
-            PlayerDescription::PlayerLookDesc newLook;
-            *msg >> newLook >> id;
-            players[id].look = newLook;              
-          }
-          break;
-          default:
-          break;
+            // now we can play
+            bWaitingForConnection = false;
+            prediction.reset(desc.phys);
         }
       }
+      break;
+      // Server removed a player
+      case GameMsg::Game_RemovePlayer:
+      {
+        idT removeId;
+        msg >> removeId;
+        players.erase(removeId);              
+        remoteStates.erase(removeId);
+      }
+      break;
+      // Player went out of view, hidden until the server sends it again
+      case GameMsg::Game_PlayerLeftView:
+      {
+        idT id;
+        msg >> id;
+        remoteStates.erase(id);
+      }
+      break;
+      // Update some player object, could be us
+      case GameMsg::Game_UpdatePlayer:
+      {
+        idT id;
+        PlayerDescription::PlayerPhysDesc physDesc;
+        msg >> physDesc >> id;
+        
+        // we are predicted and corrected by Game_PlayerState, others are buffered and shown by Update
+        if(id != thisPlayerID)
+          remoteStates.try_emplace(id, interpolation).first->second.push(physDesc);
+      }
+      break;
+      case GameMsg::Game_UpdatePlayerLook:
+      {
+        // PlayerDescription::PlayerLookDesc newLook;
+        idT id;
+        PlayerDescription::PlayerLookDesc newLook;
+        msg >> newLook >> id;
+        players[id].look = newLook;              
+      }
+      break;
+      default:
+      break;
     }
+  }
+
+  // Out of view players keep their description but aren't shown
+  bool InView(idT id) const
+  {
+    return id == thisPlayerID || remoteStates.count(id);
+  }
 
+  void Update(float deltaTime)
+  {
     const raylib::Vector2 screenCenter = {GetRenderWidth()/2.f, GetRenderHeight()/2.f};
     
     if(bWaitingForConnection)
        return;
     
-    auto& playerPhys = players[thisPlayerID].phys;
-
-    raylib::Vector2 mouseDir = (raylib::Mouse::GetPosition() - screenCenter).Normalize();
-    playerPhys.handsDir = mouseDir;
-    
-    raylib::Vector2 delta_v = {0,0};
+    PlayerInput input{};
+    input.handsDir = (raylib::Mouse::GetPosition() - screenCenter).Normalize();
+    input.deltaTime = deltaTime;
     
     if(IsKeyDown(KEY_UP) || IsKeyDown(KEY_W))
-      delta_v += Vector2{0,-1};
+      input.direction += Vector2{0,-1};
     if(IsKeyDown(KEY_DOWN) || IsKeyDown(KEY_S))
-      delta_v += Vector2{0,1};
+      input.direction += Vector2{0,1};
     if(IsKeyDown(KEY_LEFT) || IsKeyDown(KEY_A))
-      delta_v += Vector2{-1,0};
+      input.direction += Vector2{-1,0};
     if(IsKeyDown(KEY_RIGHT) || IsKeyDown(KEY_D))
-      delta_v += Vector2{1,0};
+      input.direction += Vector2{1,0};
     
     if(IsKeyPressed(KEY_E))
     {
@@ -214,25 +238,27 @@ private:
       }
       lookChangeMenu = !lookChangeMenu;
     }
-    delta_v = delta_v.Normalize() * playerPhys.acc * deltaTime;
-      
-    playerPhys.Update(deltaTime, delta_v);
 
-    // Send myPlayer data to server
-    Message msg{};
-    msg.header.id = GameMsg::Game_UpdatePlayer;
-    msg << thisPlayerID << players[thisPlayerID].phys;
+    // Move right away and send the input, the server answers with where we really are
+    Message msg{GameMsg::Game_PlayerInput};
+    msg << prediction.apply(input);
     Send(msg);
+    players[thisPlayerID].phys = prediction.state();
+
+    // Other players move smoothly through their buffered states
+    for(auto& [id, states] : remoteStates)
+      if(auto phys = states.sample())
+        players[id].phys = *phys;
 
-    // Collision on client side
+    // Collision on client side, only shown, the server doesn't collide players
     for(auto& d1 : players)
     {
       auto& p1 = d1.second;
-      p1.phys.Update(deltaTime);
+      if(!InView(d1.first)) continue;
       for(auto& d2 : players)
       {
         auto& p2 = d2.second;
-        if(p1 == p2) continue;
+        if(p1 == p2 || !InView(d2.first)) continue;
         UpdatePlayerCollisions(p1.phys, p2.phys);
       }
     }
@@ -336,6 +362,7 @@ private:
     {
       idT id = object.first;
       auto& p = object.second;
+      if(!InView(id)) continue;
 
 
       // DrawPlayer Bodu
@@ -363,6 +390,8 @@ public:
   {
     
     // players.insert(std::make_pair(0, Player(Vector2{GetScreenWidth()/2.f,GetScreenHeight()/2.f})));
+    // other players' positions come over UDP when the network lets them
+    SetUdp({.bEnabled = true});
     if(Connect(ip, port))
     {
       return true;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <functional>
 #include <limits>
@@ -27,7 +28,14 @@ enum class GameMsg : uint32_t
   Game_AddPlayer,
   Game_RemovePlayer,
   Game_UpdatePlayer,
-  Game_UpdatePlayerLook
+  Game_UpdatePlayerLook,
+
+  // server authoritative movement, the client sends inputs,
+  // the server answers with its state and the last input applied
+  Game_PlayerInput,
+  Game_PlayerState,
+  // the player went out of the receiver's view, no updates until it's back
+  Game_PlayerLeftView
 };
 
 using idT = uint32_t;
@@ -75,6 +83,16 @@ typedef struct PlayerDescription
       vel = raylib::Vector2{0,0};    
       return false;
     }
+
+    // in between two states received from the server, used by the client's interpolation buffers
+    friend PlayerPhysDesc lerp(const PlayerPhysDesc& a, const PlayerPhysDesc& b, float t)
+    {
+      PlayerPhysDesc out;
+      out.pos = a.pos + (b.pos - a.pos) * t;
+      out.vel = a.vel + (b.vel - a.vel) * t;
+      out.handsDir = (a.handsDir + (b.handsDir - a.handsDir) * t).Normalize();
+      return out;
+    }
   } phys;
   
   PlayerDescription() = default;
@@ -89,6 +107,25 @@ typedef struct PlayerDescription
 } Player;
 
 
+// One frame of a player's controls
+struct PlayerInput
+{
+  // pressed direction, normalized by whoever applies it
+  raylib::Vector2 direction = {0,0};
+  raylib::Vector2 handsDir = {0,1};
+  float deltaTime = 0;
+};
+
+// Movement of one frame, the client predicts with it and the server decides with it
+inline void ApplyPlayerInput(PlayerDescription::PlayerPhysDesc& phys, const PlayerInput& input)
+{
+  // don't let a client speed itself up with long frames
+  const float deltaTime = std::clamp(input.deltaTime, 0.f, 0.1f);
+  phys.handsDir = input.handsDir.Normalize();
+  phys.Update(deltaTime, input.direction.Normalize() * phys.acc * deltaTime);
+}
+
+
 inline bool UpdatePlayerCollisions(
   PlayerDescription::PlayerPhysDesc& playerA,
   PlayerDescription::PlayerPhysDesc& playerB, 
@@ -1,8 +1,38 @@
 #include <unordered_map>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
 
 #include "../../library/server.h"
+#include "../../library/prediction.h"
 #include "multiplayer_common.hpp"
+#include "interest_grid.hpp"
+
+// Half of the client screen (1200x800) in cells, plus one cell
+// because the viewer can stand anywhere inside its own cell
+#define VIEW_CELLS_X 3
+#define VIEW_CELLS_Y 3
+
+// Real time a player's inputs may still simulate, frames claiming more are cut
+// short, so sending more or longer frames doesn't make a player faster
+struct InputClock
+{
+  // idle time a late burst of inputs can catch up on
+  static constexpr float MAX_BUDGET = 0.25f;
+
+  std::chrono::steady_clock::time_point tpLast = std::chrono::steady_clock::now();
+  float fBudget = 0;
+
+  float take(float deltaTime)
+  {
+    const auto now = std::chrono::steady_clock::now();
+    fBudget = std::min(fBudget + std::chrono::duration<float>(now - tpLast).count(), MAX_BUDGET);
+    tpLast = now;
+    const float fTaken = std::clamp(deltaTime, 0.f, fBudget);
+    fBudget -= fTaken;
+    return fTaken;
+  }
+};
 
 
 class GameServer : public sonicpp::ServerInterface<GameMsg>
@@ -10,17 +40,43 @@ class GameServer : public sonicpp::ServerInterface<GameMsg>
 public:
   GameServer(uint16_t port):sonicpp::ServerInterface<GameMsg>(port)
   {
+    // every message type has its own handler, the rest is ignored
+    On<GameMsg::Client_RegisterWithServer>([this](std::shared_ptr<Connection> client, PlayerDescription desc)
+    {
+      RegisterPlayer(client, desc);
+    });
+    On<GameMsg::Game_UpdatePlayerLook>([this](std::shared_ptr<Connection> client, Message& msg)
+    {
+      MessageAllClients(msg, client);
+    });
+    On<GameMsg::Game_PlayerInput>([this](std::shared_ptr<Connection> client, sonicpp::sequenced_input<PlayerInput> input)
+    {
+      ApplyInput(client, input);
+    });
+
+    // positions are sent all the time, a lost or late one is just skipped
+    SetUdp({.bEnabled = true});
+    SetUnreliable(GameMsg::Game_UpdatePlayer);
+
     Start();
 
     while(1)
     {
       Update(-1, true);
+      RemoveGarbage();
     }
     
   }  
 
   std::unordered_map<uint32_t, PlayerDescription> clientRoster;
+  std::unordered_map<uint32_t, std::shared_ptr<Connection>> clientConnections;
+  // last input applied per player, acknowledged with the state
+  std::unordered_map<uint32_t, sonicpp::input_sequence> clientInputs;
+  std::unordered_map<uint32_t, InputClock> clientClocks;
   std::vector<uint32_t> GarbageIDs;
+
+  // Only players in view of each other exchange updates
+  InterestGrid interest{VIEW_CELLS_X, VIEW_CELLS_Y};
   
 protected:
   bool OnClientConnect(std::shared_ptr<Connection> client)
@@ -52,95 +108,138 @@ protected:
       {
         auto& pd = clientRoster[client->GetID()];
         std::cout << "[UNGRECEFULL REMOVAL]: " << pd.uUniqueID << std::endl;
+        interest.Remove(client->GetID(), [](idT, idT){});
         clientRoster.erase(client->GetID());
+        clientConnections.erase(client->GetID());
+        clientInputs.erase(client->GetID());
+        clientClocks.erase(client->GetID());
         GarbageIDs.push_back(client->GetID());
       }
     }
   }
 
-  void OnMessage(std::shared_ptr<Connection> client, Message& msg) 
-  override
+  // If there are some clients that had disconnected
+  // remind all clients that a client had disconnected
+  void RemoveGarbage()
   {
-    // If there are some clients that had disconnected
-    // remind all clients that a client had disconnected
-    if(!GarbageIDs.empty())
+    for(auto pid : GarbageIDs)
     {
-      for(auto pid : GarbageIDs)
-      {
-        Message m;
-        m.header.id = GameMsg::Game_RemovePlayer;
-        m << pid;
-        std:: cout << "Removing: " << pid << std::endl;
-        MessageAllClients(m);
-      }
-      GarbageIDs.clear();        
+      Message m;
+      m.header.id = GameMsg::Game_RemovePlayer;
+      m << pid;
+      std:: cout << "Removing: " << pid << std::endl;
+      MessageAllClients(m);
     }
+    GarbageIDs.clear();        
+  }
+
+  void RegisterPlayer(std::shared_ptr<Connection> client, PlayerDescription& desc)
+  {
+    // Receive player data
+    desc.uUniqueID = client->GetID();
+    clientRoster[desc.uUniqueID] = desc;
+    clientConnections[desc.uUniqueID] = client;
+    clientClocks[desc.uUniqueID] = InputClock{};
     
-    switch(msg.GetType())
+    // Now send to playar its ID
     {
-      case GameMsg::Client_RegisterWithServer:
-      {
-          // Receive player data
-          PlayerDescription desc;
-          {
-          msg >> desc;
-          desc.uUniqueID = client->GetID();
-          clientRoster[desc.uUniqueID] = desc;
-          }
-          
-          // Now send to playar its ID
-          {
-          Message msgSendID;
-          msgSendID.header.id = GameMsg::Client_AssignID;
-          msgSendID << desc.uUniqueID;
-          MessageClient(client, msgSendID);
-          }
-          {
-          // Inform players that a new player has joined
-          Message msgAddPlayer;
-          msgAddPlayer.header.id = GameMsg::Game_AddPlayer;
-          msgAddPlayer << desc;
-          MessageAllClients(msgAddPlayer, client);
-          }
-
-          // send all other client informations to the client that just joined
-          for(const auto& player : clientRoster)
-          {
-            Message msgAddOtherPlayers{};
-            msgAddOtherPlayers.header.id = GameMsg::Game_AddPlayer;
-            msgAddOtherPlayers << player.second;
-            MessageClient(client, msgAddOtherPlayers);
-          }
-      }
-      break;
-      case GameMsg::Client_UnregisterWithServer:
-      {
-          
-      }
-      break;
-      case GameMsg::Game_UpdatePlayer:
-      {
-          // @FOR_NOW check collisions every time a packet is received
-          // UpdatePlayerCollisions(playerRoster[client->GetID()], playerRoster,
-          //   [&](idT affected){
-          //     message collision;
-          //     collision.header.id = GameMsg::Game_UpdatePlayer;
-          //     collision << playerRoster[affected];
-          //     MessageAllClients(collision,client);
-          //   });
-          // and compose a new message
-
-          
-          // send to all other players except the sender
-          MessageAllClients(msg, client);
-      }
-      break;
-      case GameMsg::Game_UpdatePlayerLook:
-        MessageAllClients(msg, client);
-      break;
-      default:
-      break;
+    Message msgSendID;
+    msgSendID.header.id = GameMsg::Client_AssignID;
+    msgSendID << desc.uUniqueID;
+    MessageClient(client, msgSendID);
+    }
+    {
+    // Inform players that a new player has joined
+    Message msgAddPlayer;
+    msgAddPlayer.header.id = GameMsg::Game_AddPlayer;
+    msgAddPlayer << desc;
+    MessageAllClients(msgAddPlayer, client);
     }
+
+    // send all other client informations to the client that just joined
+    for(const auto& player : clientRoster)
+    {
+      Message msgAddOtherPlayers{};
+      msgAddOtherPlayers.header.id = GameMsg::Game_AddPlayer;
+      msgAddOtherPlayers << player.second;
+      MessageClient(client, msgAddOtherPlayers);
+    }
+
+    UpdateInterest(desc.uUniqueID, desc.phys.pos);
+  }
+
+  // Move the player by its input, the sender gets the result with an acknowledgement,
+  // the players around see it as a regular update
+  void ApplyInput(std::shared_ptr<Connection> client, const sonicpp::sequenced_input<PlayerInput>& input)
+  {
+    auto player = clientRoster.find(client->GetID());
+    if(player == clientRoster.end())
+      return;
+
+    auto& inputs = clientInputs[client->GetID()];
+    if(!inputs.accept(input.nSequence))
+      return;
+    // the client's frame time is only trusted up to the time that passed here
+    PlayerInput frame = input.input;
+    frame.deltaTime = clientClocks[client->GetID()].take(frame.deltaTime);
+    ApplyPlayerInput(player->second.phys, frame);
+
+    Message state{GameMsg::Game_PlayerState};
+    state << inputs.ack(player->second.phys);
+    MessageClient(client, state);
+
+    Message update{GameMsg::Game_UpdatePlayer};
+    update << player->first << player->second.phys;
+    ForwardToViewers(client, player->second, update);
+  }
+
+  void ForwardToViewers(std::shared_ptr<Connection> client, const PlayerDescription& player, Message& msg)
+  {
+    UpdateInterest(client->GetID(), player.phys.pos);
+    
+    // send only to the players that can see the sender
+    std::vector<std::shared_ptr<Connection>> viewers;
+    interest.ForEachViewer(client->GetID(), [&](idT viewer)
+    {
+      auto conn = clientConnections.find(viewer);
+      if(conn != clientConnections.end())
+        viewers.push_back(conn->second);
+    });
+    FanOut(viewers.begin(), viewers.end(), msg, client);
+  }
+
+  // Players that just came into view get the current state of each other,
+  // the ones that went out of view are hidden by the viewer until they're back
+  void UpdateInterest(idT id, Vector2 pos)
+  {
+    interest.Update(id, pos,
+      [this](idT viewer, idT subject){ SendPlayerState(viewer, subject); },
+      [this](idT viewer, idT subject){ SendPlayerLeftView(viewer, subject); });
+  }
+
+  void SendPlayerLeftView(idT viewer, idT subject)
+  {
+    auto conn = clientConnections.find(viewer);
+    if(conn == clientConnections.end())
+      return;
+
+    Message msg{GameMsg::Game_PlayerLeftView};
+    msg << subject;
+    MessageClient(conn->second, msg);
+  }
+
+  // Send the current physical state of subject to viewer
+  void SendPlayerState(idT viewer, idT subject)
+  {
+    auto conn = clientConnections.find(viewer);
+    auto player = clientRoster.find(subject);
+    if(conn == clientConnections.end() || player == clientRoster.end())
+      return;
+
+    Message msg;
+    msg.header.id = GameMsg::Game_UpdatePlayer;
+    msg << subject << player->second.phys;
+    MessageClient(conn->second, msg);
   }
 
 };
@@ -56,7 +56,8 @@ protected:
     if(symbols_left.empty()){
       std::cout << "[SERVER] GAME STARTED!!!" << std::endl;
       // notify all clients about thier symbols
-      for(auto& client : m_deqConnections){
+      auto connections = m_connections.snapshot();
+      for(auto& client : *connections){
         Message msg{MessageType::ServerAccept};
         msg << players[client->GetID()];
         MessageClient(client, msg);
@@ -1,17 +1,40 @@
 #pragma once
 
 #include "queue.h"
+#include "timing_wheel.h"
+#include "heartbeat.h"
+#include "socket_options.h"
+#include "session.h"
+#include "clock_sync.h"
+#include "udp.h"
+#include "reliability.h"
+#include "shm.h"
+#include "metrics.h"
+#include "log.h"
+#include "dispatcher.h"
 #include "connection.h"
 #include "message.h"
 
 #include <asio/ip/address.hpp>
 #include <memory>
+#include <random>
 
 #include <asio.hpp>
 #include <optional>
 
 namespace sonicpp{
 
+  template<typename T>
+  class ServerInterface;
+
+  enum class ClientMode
+  {
+    // the client runs its context on a thread of its own
+    Threaded,
+    // no thread, the owner drives the client by calling Poll() e.g. once per frame
+    Poll
+  };
+
   template<typename T>
   class ClientIntefrace
   {
@@ -20,19 +43,63 @@ namespace sonicpp{
     using Message = sonicpp::Message<T>;
 
   private:
-    // context for handling data transfer
-    asio::io_context m_context;
-    // thread for the context to execute in separately from other stuff
+    // What the connection refers to, it holds on to this so a connection still
+    // finishing its handlers on a shared context doesn't outlive any of it
+    struct shared_state
+    {
+      MetricsRegistry metrics{};
+      tsqueue<owned_message<T>> qMessagesIn;
+      udp_routes<T> udpRoutes;
+      ReconnectConfig reconnect{};
+      asio::ip::tcp::resolver::results_type endpoints;
+      SocketOptions socketOptions{};
+      std::minstd_rand rngBackoff{std::random_device{}()};
+    };
+    std::shared_ptr<shared_state> m_pShared = std::make_shared<shared_state>();
+
+    // traffic counters of the connection, outlives it
+    MetricsRegistry& m_metrics = m_pShared->metrics;
+    // context for handling data transfer, owned unless one was given
+    std::unique_ptr<asio::io_context> m_pOwnedContext;
+    asio::io_context& m_context;
+    // thread for the owned context to execute in separately from other stuff
     std::thread thrContext;
+    ClientMode m_mode = ClientMode::Threaded;
     // hardware socket that is connected to the interface
     asio::ip::tcp::socket m_socket;
+    // drives heartbeats and idle timeouts, shared by all clients of the context
+    timing_wheel& m_wheel;
+    HeartbeatConfig m_heartbeat{};
+    ClockSyncConfig m_clockSync{};
+    // datagram channel offered by the server, and the types always sent over it
+    UdpConfig m_udp{};
+    udp_routes<T>& m_udpRoutes = m_pShared->udpRoutes;
+    SharedMemoryConfig m_shm{};
     // instance of connection object, whitch handles data trasfer
-    std::unique_ptr<Connection<T>> m_connection;
+    std::shared_ptr<Connection<T>> m_connection;
     // This is the thread safe queue of incoming messages from the server
-    tsqueue<owned_message<T>> m_qMessagesIn;
+    tsqueue<owned_message<T>>& m_qMessagesIn = m_pShared->qMessagesIn;
+    // applied to the socket once connected
+    SocketOptions& m_socketOptions = m_pShared->socketOptions;
+    // typed handlers used by HandleMessages
+    Dispatcher<T> m_dispatcher{&m_metrics.malformed};
+    // reconnection policy and where to reconnect to
+    ReconnectConfig& m_reconnect = m_pShared->reconnect;
+    asio::ip::tcp::resolver::results_type& m_endpoints = m_pShared->endpoints;
     
   public:
-    ClientIntefrace() : m_socket(m_context)
+    explicit ClientIntefrace(ClientMode mode = ClientMode::Threaded) 
+      : m_pOwnedContext(std::make_unique<asio::io_context>()), m_context(*m_pOwnedContext),
+        m_mode(mode), m_socket(m_context), m_wheel(asio::use_service<timing_wheel_service>(m_context).wheel())
+    {
+
+    }
+
+    // Run on a context owned and run by the caller, any number of clients can
+    // share it and it can be run by any number of threads, each connection
+    // is serialized by its own strand. The client starts no thread.
+    explicit ClientIntefrace(asio::io_context& context) 
+      : m_context(context), m_socket(m_context), m_wheel(asio::use_service<timing_wheel_service>(m_context).wheel())
     {
 
     }
@@ -50,39 +117,182 @@ namespace sonicpp{
 
         // Resolve hostname/ip-address accordingly
         asio::ip::tcp::resolver resolver(m_context);
-        asio::ip::tcp::resolver::results_type endpoints = 
-          resolver.resolve(host, std::to_string(port));
+        m_endpoints = resolver.resolve(host, std::to_string(port));
 
         // create connection
-        m_connection = std::make_unique<Connection<T>>(
+        m_connection = std::make_shared<Connection<T>>(
             Connection<T>::Owner::Client,
-            m_context,
-            asio::ip::tcp::socket(m_context), 
+            asio::ip::tcp::socket(asio::make_strand(m_context)), 
             m_qMessagesIn
           );  
+        m_connection->m_pWheel = &m_wheel;
+        m_connection->m_heartbeat = m_heartbeat;
+        m_connection->m_clockSync = m_clockSync;
+        m_connection->m_udp = m_udp;
+        m_connection->m_pRoutes = &m_udpRoutes;
+        m_connection->m_pMetrics = &m_metrics;
+        m_connection->m_pOwnerState = m_pShared;
+        // the connection holds the callback, it can refer to itself
+        if(m_reconnect.bEnabled)
+          m_connection->m_onDropped = [pShared = m_pShared, pConnection = m_connection.get()]()
+          {
+            ScheduleReconnect(pShared, *pConnection);
+          };
         
         // Tell the connection object to connect to server
-        m_connection->ConnectToServer(endpoints);
+        m_connection->ConnectToServer(m_endpoints, m_socketOptions);
 
         // Start Context Thread
-        thrContext = std::thread([this](){m_context.run();});
+        if(m_pOwnedContext && m_mode == ClientMode::Threaded)
+          thrContext = std::thread([this](){m_context.run();});
       }
       catch(std::exception& e)
       {  
-        std::cout << "Client Expection: " << e.what() << std::endl;
+        SONICPP_LOG_ERROR("Client Expection: " << e.what());
+        return false;
+      }
+      return IsConnected();
+    }
+
+    // Connect to a server running in the same process, e.g. the host's own client.
+    // Messages are handed straight to the other side's queue, no socket, handshake
+    // or io thread is involved and everything arrives in order. UDP routes,
+    // heartbeats, sessions and reconnecting don't apply. The server doesn't need Start()
+    bool ConnectLocal(ServerInterface<T>& server)
+    {
+      m_connection = std::make_shared<Connection<T>>(
+          Connection<T>::Owner::Client,
+          asio::ip::tcp::socket(m_context),
+          m_qMessagesIn
+        );
+      m_connection->m_pMetrics = &m_metrics;
+      m_connection->m_pOwnerState = m_pShared;
+      if(!server.AcceptLocal(m_connection))
+        m_connection.reset();
+      return IsConnected();
+    }
+
+    // Connect to a server on the same host through shared memory, sPath is the
+    // unix socket of its SharedMemoryConfig. Messages go through rings in a
+    // memory region shared by both processes, see SetSharedMemory. UDP routes,
+    // heartbeats, sessions and reconnecting don't apply
+    bool ConnectShared(const std::string& sPath)
+    {
+      try
+      {
+        auto strand = asio::make_strand(m_context);
+        asio::local::stream_protocol::socket socket(strand);
+        socket.connect(asio::local::stream_protocol::endpoint(sPath));
+        auto pRegion = shm_region::create(m_shm.nRingSize);
+        pRegion->send(socket.native_handle());
+
+        // the server answers with our id, or closes the socket to deny us
+        uint32_t nId = 0;
+        asio::read(socket, asio::buffer(&nId, sizeof(nId)));
+
+        m_connection = std::make_shared<Connection<T>>(
+            Connection<T>::Owner::Client,
+            asio::ip::tcp::socket(strand),
+            m_qMessagesIn
+          );
+        m_connection->id = nId;
+        m_connection->m_pMetrics = &m_metrics;
+        m_connection->m_pOwnerState = m_pShared;
+        m_connection->OpenShared(std::move(pRegion), std::move(socket), m_shm.spin);
+
+        if(m_pOwnedContext && m_mode == ClientMode::Threaded)
+          thrContext = std::thread([this](){m_context.run();});
+      }
+      catch(std::exception& e)
+      {
+        SONICPP_LOG_ERROR("Client Expection: " << e.what());
         return false;
       }
       return IsConnected();
     }
 
+    // Ring size and polling of ConnectShared, has to be set before it
+    void SetSharedMemory(const SharedMemoryConfig& config)
+    {
+      m_shm = config;
+    }
+
+    // Has to be set before Connect()
+    void SetSocketOptions(const SocketOptions& options)
+    {
+      m_socketOptions = options;
+    }
+
+    // Heartbeats and idle timeouts, has to be set before Connect()
+    void SetHeartbeat(const HeartbeatConfig& config)
+    {
+      m_heartbeat = config;
+    }
+
+    // Estimate round trip, jitter and the server's clock, has to be set before Connect()
+    void SetClockSync(const ClockSyncConfig& config)
+    {
+      m_clockSync = config;
+    }
+
+    // Accept the server's UDP channel, only bEnabled and the client fields
+    // matter here, has to be set before Connect()
+    void SetUdp(const UdpConfig& config)
+    {
+      m_udp = config;
+    }
+
+    // Always send messages of this type unreliably, has to be set before Connect()
+    void SetUnreliable(T id)
+    {
+      m_udpRoutes.set(id, {Delivery::Unreliable});
+    }
+
+    // Send messages of this type over UDP the given way, has to be set before Connect()
+    void SetChannel(T id, UdpChannel channel)
+    {
+      m_udpRoutes.set(id, channel);
+    }
+
+    // Every message type not set otherwise goes over UDP the given way,
+    // has to be set before Connect()
+    void SetDefaultChannel(UdpChannel channel)
+    {
+      m_udpRoutes.set_default(channel);
+    }
+
+    // Reconnect automatically when the connection drops, has to be set before Connect()
+    // The server resumes the session when it has SetSessionResume enabled
+    void SetReconnect(const ReconnectConfig& config)
+    {
+      m_reconnect = config;
+    }
+
     // Disconnect socket
+    // With a shared context this returns right away, the connection closes and
+    // finishes its pending handlers whenever the context runs them
     void Disconnect()
     {
+      if(!m_pOwnedContext)
+      {
+        if(m_connection)
+          m_connection->Disconnect();
+        m_connection.reset();
+        return;
+      }
+
       if(IsConnected())
       {
         m_connection->Disconnect();
       }
 
+      // nobody else runs the context, let the close and the aborted operations finish
+      if(m_mode == ClientMode::Poll)
+      {
+        m_context.restart();
+        m_context.poll();
+      }
+
       // stop context
       m_context.stop();
 
@@ -91,10 +301,10 @@ namespace sonicpp{
         thrContext.join();
 
       // Destroy connection
-      m_connection.release();      
+      m_connection.reset();
     }
     
-    // Check if client is still connected
+    // Check if client is still connected, also true while reconnecting
     bool IsConnected() const 
     {
       if(m_connection)
@@ -103,21 +313,184 @@ namespace sonicpp{
         return false; 
     }
 
+    // The connection dropped and reconnection attempts are in progress
+    bool IsReconnecting() const
+    {
+      return m_connection && m_connection->m_bSuspended;
+    }
+
+    // The last reconnect got the previous session back, messages missed meanwhile
+    // were replayed and the server didn't treat the client as new
+    bool WasResumed() const
+    {
+      return m_connection && m_connection->m_bResumed;
+    }
+
+    // Smoothed round trip, jitter and offset of the server's steady clock,
+    // empty until the first exchange, see SetClockSync. Safe from any thread
+    ClockStats GetClock() const
+    {
+      return m_connection ? m_connection->GetClock() : ClockStats{};
+    }
+
+    // Now on the server's steady clock, for stamps the server compares with its own
+    std::chrono::steady_clock::time_point ServerTime() const
+    {
+      auto now = std::chrono::steady_clock::now();
+      return m_connection ? m_connection->GetClockEstimator().to_remote(now) : now;
+    }
+
+    // Safe to call from any thread
+    MetricsSnapshot GetMetrics()
+    {
+      MetricsSnapshot snap = MetricsSnapshot::From(m_metrics);
+      snap.nQueuedIn = m_qMessagesIn.count();
+      if(m_connection)
+        snap.AddConnection(m_connection->GetID(), m_connection->GetMetrics());
+      return snap;
+    }
+
+#ifdef SONICPP_TRACE
+    // Per stage and per message type latency percentiles, needs SONICPP_TRACE
+    // the handler stage is up to the user, the client doesn't dispatch messages
+    std::string GetTraceReport() const
+    {
+      return m_metrics.tracer.Report();
+    }
+#endif
+
     Message AwaitNextMessage(){
+      if(m_mode == ClientMode::Poll)
+      {
+        // nobody would fill the queue while we wait, do the work here
+        RestartIfIdle();
+        while(m_qMessagesIn.is_empty() && m_context.run_one()) {}
+      }
       m_qMessagesIn.wait();
-      return m_qMessagesIn.pop_front().msg;
+      return Unwrap(m_qMessagesIn.pop_front());
     }
     
     std::optional<Message> NextMessage()
     {
       return (m_qMessagesIn.is_empty())?
         std::nullopt :
-        std::make_optional(m_qMessagesIn.pop_front().msg);
+        std::make_optional(Unwrap(m_qMessagesIn.pop_front()));
     }
 
     void Send(Message& msg)
     {
       m_connection->Send(msg);
     }
+
+    // Over UDP once the channel is bound, may be lost or reordered, see SetUdp
+    void SendUnreliable(Message& msg)
+    {
+      m_connection->SendUdp(msg, {Delivery::Unreliable});
+    }
+
+    // Over UDP the given way once the channel is bound, over TCP until then.
+    // Order is only kept among messages that went the same way
+    void SendUdp(Message& msg, UdpChannel channel)
+    {
+      m_connection->SendUdp(msg, channel);
+    }
+
+    // Messages routed to UDP go over it now, until then they take TCP
+    bool IsUdpBound() const
+    {
+      return m_connection && m_connection->IsUdpBound();
+    }
+
+    // Packets, retransmissions and round trip of the UDP channel, safe from any thread
+    UdpStats GetUdpStats() const
+    {
+      return m_connection ? m_connection->GetUdpStats() : UdpStats{};
+    }
+
+    // Handle messages with id ID by fn, see Dispatcher
+    template<T ID, typename F>
+    void On(F&& fn)
+    {
+      m_dispatcher.template On<ID>(std::forward<F>(fn));
+    }
+
+    // Pass queued messages to their handlers registered with On(),
+    // the rest to OnMessage, returns the number of messages handled
+    size_t HandleMessages(size_t nMaxMessages = std::numeric_limits<size_t>::max())
+    {
+      size_t nMessageCount = 0;
+      while(nMessageCount < nMaxMessages && !m_qMessagesIn.is_empty())
+      {
+        Message msg = Unwrap(m_qMessagesIn.pop_front());
+        if(!m_dispatcher.Dispatch(nullptr, msg))
+          OnMessage(msg);
+        nMessageCount++;
+      }
+      return nMessageCount;
+    }
+
+    // Poll mode: do all network work that is ready without blocking, run the
+    // handlers of the messages received, then push out what they sent.
+    // Messages sent before the call leave the socket within it, so calling it
+    // right after sending the frame's input saves up to a frame of latency.
+    // Returns the number of messages handled
+    size_t Poll(size_t nMaxMessages = std::numeric_limits<size_t>::max())
+    {
+      RestartIfIdle();
+      m_context.poll();
+      size_t nMessageCount = HandleMessages(nMaxMessages);
+      if(nMessageCount)
+        m_context.poll();
+      return nMessageCount;
+    }
+
+  protected:
+    // Called by HandleMessages for messages without a registered handler
+    virtual void OnMessage(Message&)
+    {}
+
+  private:
+    // Called on the context thread when the connection dropped, the client may
+    // be gone already on a shared context
+    static void ScheduleReconnect(const std::shared_ptr<shared_state>& pShared, Connection<T>& conn)
+    {
+      const ReconnectConfig& reconnect = pShared->reconnect;
+      if(reconnect.nMaxAttempts && conn.m_nReconnectAttempts >= reconnect.nMaxAttempts)
+      {
+        SONICPP_LOG_WARNING("[" << conn.GetID() << "] Giving up reconnecting");
+        conn.m_bSuspended = false;
+        return;
+      }
+
+      // exponential backoff, randomized so clients dropped together don't come back together
+      std::chrono::milliseconds delay = reconnect.initialDelay * (1 << std::min<size_t>(conn.m_nReconnectAttempts, 16));
+      delay = std::min(delay, reconnect.maxDelay);
+      delay = delay / 2 + std::chrono::milliseconds(pShared->rngBackoff() % (delay.count() / 2 + 1));
+      conn.m_nReconnectAttempts++;
+
+      SONICPP_LOG_INFO("[" << conn.GetID() << "] Reconnecting in " << delay.count() << "ms");
+      // dropped if Disconnect() comes first
+      conn.Schedule(delay, [pShared](Connection<T>& connection)
+      {
+        connection.Reopen();
+        connection.ConnectToServer(pShared->endpoints, pShared->socketOptions);
+      });
+    }
+
+    // an owned context stops once it runs out of work, e.g. before Connect()
+    void RestartIfIdle()
+    {
+      if(m_context.stopped())
+        m_context.restart();
+    }
+
+    Message Unwrap(owned_message<T>&& owned)
+    {
+#ifdef SONICPP_TRACE
+      m_metrics.tracer.record(TraceStage::Queue, MetricsRegistry::type_slot(owned.msg.GetType()),
+        std::chrono::steady_clock::now() - owned.trace.tpQueued);
+#endif
+      return std::move(owned.msg);
+    }
   };
 }
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+
+
+namespace sonicpp
+{
+
+  // Periodic clock exchange of a connection
+  // Both sides have to enable it, otherwise clock messages are ignored. A zero
+  // interval only answers, only the side that asks gets estimates
+  struct ClockSyncConfig
+  {
+    bool bEnabled = false;
+    std::chrono::milliseconds interval{0};
+    // the offset is taken from the fastest exchange among the last nWindow
+    size_t nWindow = 8;
+  };
+
+  struct ClockStats
+  {
+    // smoothed round trip time and its mean deviation
+    std::chrono::nanoseconds rtt{0};
+    std::chrono::nanoseconds jitter{0};
+    // remote steady clock minus the local one
+    std::chrono::nanoseconds offset{0};
+    uint64_t nSamples = 0;
+  };
+
+  // Round trip and clock offset estimation from timestamp exchanges (NTP style)
+  // t0 request sent and t3 answer received are local times, t1 request received
+  // and t2 answer sent are remote ones, all of steady clocks so wall clock jumps
+  // don't leak in. A queued exchange looks slow and lopsided, so the offset comes
+  // from the exchange with the lowest delay in a window, which throws the outliers
+  // out. RTT and jitter are smoothed like TCP's. Updated by the connection's
+  // thread, readable from any.
+  class clock_estimator
+  {
+  public:
+    using clock = std::chrono::steady_clock;
+
+  protected:
+    struct exchange
+    {
+      int64_t nDelay;
+      int64_t nOffset;
+    };
+
+    std::deque<exchange> m_qWindow;
+    size_t m_nWindow = 8;
+
+    std::atomic<int64_t> m_nRtt{0};
+    std::atomic<int64_t> m_nJitter{0};
+    std::atomic<int64_t> m_nOffset{0};
+    std::atomic<uint64_t> m_nSamples{0};
+
+  public:
+    void set_window(size_t nWindow)
+    {
+      m_nWindow = std::max<size_t>(1, nWindow);
+    }
+
+    static int64_t stamp(clock::time_point tp = clock::now())
+    {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(tp.time_since_epoch()).count();
+    }
+
+    void add(int64_t t0, int64_t t1, int64_t t2, int64_t t3)
+    {
+      // time spent on the wire, without the time the remote side held the request
+      int64_t nDelay = std::max<int64_t>(0, (t3 - t0) - (t2 - t1));
+      int64_t nOffset = ((t1 - t0) + (t2 - t3)) / 2;
+
+      uint64_t nSamples = m_nSamples.load(std::memory_order_relaxed);
+      int64_t nRtt = m_nRtt.load(std::memory_order_relaxed);
+      int64_t nJitter = m_nJitter.load(std::memory_order_relaxed);
+      if(nSamples == 0)
+      {
+        nRtt = nDelay;
+        nJitter = nDelay / 2;
+      }
+      else
+      {
+        // RFC 6298 gains, 1/4 for the deviation and 1/8 for the mean
+        nJitter += (std::abs(nRtt - nDelay) - nJitter) / 4;
+        nRtt += (nDelay - nRtt) / 8;
+      }
+
+      m_qWindow.push_back({nDelay, nOffset});
+      if(m_qWindow.size() > m_nWindow)
+        m_qWindow.pop_front();
+      auto best = std::min_element(m_qWindow.begin(), m_qWindow.end(),
+        [](const exchange& a, const exchange& b){ return a.nDelay < b.nDelay; });
+
+      // move towards the best sample, the offset drifts slowly and shouldn't jump
+      int64_t nCurrent = m_nOffset.load(std::memory_order_relaxed);
+      m_nOffset.store(nSamples == 0 ? best->nOffset : nCurrent + (best->nOffset - nCurrent) / 4, std::memory_order_relaxed);
+      m_nRtt.store(nRtt, std::memory_order_relaxed);
+      m_nJitter.store(nJitter, std::memory_order_relaxed);
+      m_nSamples.store(nSamples + 1, std::memory_order_release);
+    }
+
+    ClockStats stats() const
+    {
+      ClockStats s;
+      s.nSamples = m_nSamples.load(std::memory_order_acquire);
+      s.rtt = std::chrono::nanoseconds(m_nRtt.load(std::memory_order_relaxed));
+      s.jitter = std::chrono::nanoseconds(m_nJitter.load(std::memory_order_relaxed));
+      s.offset = std::chrono::nanoseconds(m_nOffset.load(std::memory_order_relaxed));
+      return s;
+    }
+
+    // A local steady time as the remote side's steady clock shows it
+    clock::time_point to_remote(clock::time_point tp) const
+    {
+      return tp + std::chrono::nanoseconds(m_nOffset.load(std::memory_order_relaxed));
+    }
+  };
+
+}
@@ -4,13 +4,30 @@
 #include "message.h"
 #include "queue.h"
 #include "server.h"
+#include "socket_options.h"
+#include "timing_wheel.h"
+#include "heartbeat.h"
+#include "rate_limit.h"
+#include "session.h"
+#include "clock_sync.h"
+#include "udp.h"
+#include "reliability.h"
+#include "shm.h"
+#include "metrics.h"
+#include "log.h"
+#include <chrono>
+#include <deque>
+#include <functional>
 #include <iterator>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
 #include <system_error>
+#include <vector>
 
 #include <asio.hpp>
 
-#define DEBUG
 
 namespace sonicpp{
 
@@ -33,29 +50,115 @@ namespace sonicpp{
       Client
     };
 
-    Connection(Owner parent, asio::io_context& asioContext, asio::ip::tcp::socket socket, tsqueue<owned_message<T>>& qIn);
+    // The connection runs on the socket's executor
+    Connection(Owner parent, asio::ip::tcp::socket socket, tsqueue<owned_message<T>>& qIn);
     
     virtual ~Connection(){}
 
     uint32_t GetID() const {return id;}
+    const ConnectionMetrics& GetMetrics() const {return m_metrics;}
+    // Round trip, jitter and clock offset to the remote side, needs ClockSyncConfig
+    ClockStats GetClock() const {return m_clock.stats();}
+    const clock_estimator& GetClockEstimator() const {return m_clock;}
+    // Messages routed to UDP go over it, until then they take TCP, see UdpConfig
+    bool IsUdpBound() const {return m_bUdpBound;}
+    // Packets, retransmissions and round trip of the UDP channel
+    UdpStats GetUdpStats() const {return m_reliable.stats();}
     
   private:
     void ConnectToClient(sonicpp::ServerInterface<T>* server, uint32_t uid = 0);
-    void ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints);
+    void ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints, const SocketOptions& options = {});
     void Disconnect();
     bool IsConnected() const;
     void Send(const Message<T>& msg);
+    // Must be called on the connection's context, payload can be shared by many connections
+    void QueueOutgoing(std::shared_ptr<const Message<T>> payload);
+    // Same as above for many messages, they all go out in a single write
+    void QueueOutgoing(const std::vector<std::shared_ptr<const Message<T>>>& payloads);
+    // Over UDP when bound and small enough, over TCP otherwise
+    void SendUdp(const Message<T>& msg, UdpChannel channel);
+    void QueueUdp(std::shared_ptr<const Message<T>> payload, UdpChannel channel);
+    // In process connection, the two ends hand messages to each other's queue,
+    // see ClientIntefrace::ConnectLocal
+    static void PairLocal(const std::shared_ptr<Connection>& client, const std::shared_ptr<Connection>& server);
+    // Safe to call from any thread
+    void DeliverLocal(Message<T> msg);
+    void CloseLocal();
+    // Shared memory connection to another process, see SharedMemoryConfig
+    void OpenShared(std::unique_ptr<shm_region> pRegion, asio::local::stream_protocol::socket socket, std::chrono::microseconds spin);
+    // Safe to call from any thread, payload is kept when the ring is full
+    void WriteShared(const Message<T>& msg, std::shared_ptr<const Message<T>> payload = nullptr);
+    // Caller holds m_muxShmOut
+    void FlushShared();
+    // Drain the incoming ring, then sleep on the eventfd
+    void ReadShared();
+    void DrainShared();
+    void WatchShared();
+    void CloseShared();
     
   private:
     // @ASYNC - Prime context ready to read a message header
     bool ReadHeader();
+    // Apply inbound rate limits to the message whose header was just read
+    void AdmitMessage();
+    // Charges that message to the buckets, sets m_bDiscardIn, or m_bReadPaused
+    // with how long to wait. False once the connection got kicked
+    bool ChargeRateLimit(std::chrono::steady_clock::duration& wait);
     // @ASYNC
     void ReadBody();
-    // @ASYNC
-    void WriteHeader();
-    // @ASYNC
-    void WriteBody();
+    // @ASYNC - Write all queued messages in a single gathered write
+    void WriteMessages();
     void AddToIncomingMessageQueue();
+    // Metrics bookkeeping
+    void CountIn(size_t nBytes);
+    void CountWritten(size_t nBytes);
+    // Heartbeats and idle timeouts, checked periodically on the timing wheel
+    void StartIdleChecks();
+    void CheckIdle();
+    // Clock exchanges, sent periodically on the timing wheel and answered on arrival
+    void StartClockSync();
+    void SyncClock();
+    void ReadClock();
+    // A library message has to carry exactly nSize bytes, the connection is kicked otherwise
+    bool CheckSystemBody(size_t nSize);
+    // How a message type travels over UDP, empty for TCP
+    std::optional<UdpChannel> Route(T id) const;
+    // Datagram channel, false when the message has to go over TCP instead,
+    // without bFlush reliable messages wait for the next FlushDatagrams()
+    bool SendDatagram(const Message<T>& msg, UdpChannel channel, bool bFlush = true);
+    // Write what the reliability layer has to send and keep its timer running
+    void FlushDatagrams(bool bAckDue);
+    void WriteDatagrams();
+    void ArmDatagramTimer();
+    // Server: a datagram carrying this connection's token arrived on the server's socket
+    void ReadDatagram(const asio::ip::udp::endpoint& sender, const std::vector<uint8_t>& vPacket);
+    void ReadPacket(const uint8_t* pData, size_t nLength);
+    // Client: the server's offer or confirmation, and the receive loop of the own socket
+    void ReadUdpBind();
+    void SendBindRequest();
+    void ReceiveDatagrams();
+    void AddDatagramToIncomingQueue(Message<T>& msg);
+    // Run fn on the connection's executor after delay, unless the socket died
+    // or was replaced meanwhile
+    template<typename F>
+    void Schedule(std::chrono::steady_clock::duration delay, F fn);
+    // Close the socket and let the owner know right away,
+    // a server connection with a session is suspended instead
+    void Drop();
+    // Drop forced by a policy, ends a session instead of suspending it
+    void Kick();
+    // Server: handshake passed, start a session and start reading
+    void Validated(ServerInterface<T>* server);
+    // Server: count the message and remember it for replay
+    void KeepForReplay(const std::shared_ptr<const Message<T>>& payload);
+    void SendSession(bool bResumed, uint64_t nSequence);
+    // Server: continue a suspended session on the socket released by a new connection,
+    // false leaves the socket to the caller
+    bool Resume(asio::ip::tcp::socket::protocol_type protocol, asio::ip::tcp::socket::native_handle_type handle, uint64_t nReceived);
+    // Client: fresh socket for the next connection attempt
+    void Reopen();
+    // Client: read the session message sent by the server
+    void ReadSession();
     // Encrypt data
     uint64_t scramble(uint64_t nInput);
     void WriteValidation();
@@ -65,12 +168,21 @@ namespace sonicpp{
     // Each connection has a unique socket to a remote 
     asio::ip::tcp::socket m_socket;
 
-    // This context is shared with the while asio instance
-    asio::io_context& m_asioContext;
+    // Every handler of this connection runs on this executor, the socket's,
+    // a strand when the context is run by many threads
+    asio::ip::tcp::socket::executor_type m_executor;
 
     // This queue holds all messages to be sent to the remote side
-    // of this connection
-    tsqueue<Message<T>> m_qMessagesOut;
+    // of this connection, broadcasts share a single payload between connections
+    // Only touched from the connection's context
+    std::deque<std::shared_ptr<const Message<T>>> m_qMessagesOut;
+    // Headers and bodies of the messages currently being written
+    std::vector<asio::const_buffer> m_vWriteBuffers;
+    size_t m_nMessagesWriting = 0;
+#ifdef SONICPP_TRACE
+    // when each message of m_qMessagesOut was queued
+    std::deque<std::chrono::steady_clock::time_point> m_qTraceOut;
+#endif
 
 
     // This queue holds all messages that have been recieved from
@@ -81,11 +193,112 @@ namespace sonicpp{
     // The owner decides how some of hte connection behaves
     const Owner m_nOwnerType = Owner::Server;
     uint32_t id = 0;
+    // Index of the server io thread this connection lives on
+    size_t m_nWorker = 0;
+
+    // Inbound rate limiting, buckets are only touched from the connection's context
+    RateLimitConfig m_rateLimit{};
+    token_bucket m_msgBucket{};
+    token_bucket m_byteBucket{};
+    // current message is read but not queued
+    bool m_bDiscardIn = false;
+    // reading stopped until the buckets refill
+    bool m_bReadPaused = false;
+
+    // Set once the connection reported its own death
+    bool m_bDropped = false;
+    // Client: the handshake reply is out, anything written earlier would be
+    // read by the server as part of it
+    bool m_bHandshakeSent = false;
+
+    // Idle tracking, all driven by the shared timing wheel of the io thread
+    timing_wheel* m_pWheel = nullptr;
+    HeartbeatConfig m_heartbeat{};
+    std::chrono::steady_clock::time_point m_tpLastRead{};
+    std::chrono::steady_clock::time_point m_tpLastWrite{};
+    std::chrono::steady_clock::time_point m_tpWriteStarted{};
+
+    // Clock synchronization, see ClockSyncConfig
+    ClockSyncConfig m_clockSync{};
+    clock_estimator m_clock{};
+
+    // Datagram channel, see UdpConfig
+    UdpConfig m_udp{};
+    // message types sent over UDP, owned by the server or client
+    const udp_routes<T>* m_pRoutes = nullptr;
+    // server: the server's socket shared by all its connections
+    asio::ip::udp::socket* m_pUdpServer = nullptr;
+    // server: where the client's datagrams last came from
+    asio::ip::udp::endpoint m_udpPeer{};
+    // client: own socket connected to the server's datagram port
+    asio::ip::udp::socket m_udpSocket;
+    datagram_batch m_datagramsIn;
+    uint64_t m_nUdpToken = 0;
+    size_t m_nBindAttempts = 0;
+    std::atomic<bool> m_bUdpBound = false;
+
+    // sequencing, acks and retransmission of the datagrams
+    reliable_endpoint<T> m_reliable;
+    packet_batch m_packetsOut;
+    // drives retransmissions and delayed acks, finer than the timing wheel
+    asio::steady_timer m_udpTimer;
+    bool m_bUdpTimerArmed = false;
+
+    // In process connection, no socket, set before the connection is published
+    bool m_bLocal = false;
+    std::weak_ptr<Connection> m_localPeer;
+    std::atomic<bool> m_bLocalOpen = false;
+
+    // Shared memory connection, set before the connection is published
+    std::unique_ptr<shm_region> m_pShm;
+    shm_ring m_shmIn;
+    shm_ring m_shmOut;
+    std::chrono::microseconds m_shmSpin{0};
+    asio::posix::stream_descriptor m_shmWake;
+    // only watched for the other process going away
+    asio::local::stream_protocol::socket m_shmSocket;
+    std::atomic<bool> m_bShmOpen = false;
+    // any thread may write, the ring takes a single producer; what doesn't fit
+    // waits in m_qMessagesOut with m_nShmWritten bytes of the front one written
+    std::mutex m_muxShmOut;
+    size_t m_nShmWritten = 0;
+    // the header of m_msgTemporaryIn is read, m_nShmBodyRead bytes of its body too
+    bool m_bShmBody = false;
+    size_t m_nShmBodyRead = 0;
+    // that message got through the rate limits
+    bool m_bShmAdmitted = false;
+
+    // Traffic counters, the registry is shared with the owner and its other connections
+    MetricsRegistry* m_pMetrics = nullptr;
+    // client: what m_qMessagesIn, m_pMetrics and m_pRoutes point into, held so
+    // handlers still running after the client went away don't outlive it
+    std::shared_ptr<void> m_pOwnerState;
+    ConnectionMetrics m_metrics{};
+
+    // Session resume, see SessionConfig
+    SessionConfig m_session{};
+    uint64_t m_nSessionToken = 0;
+    // server: non-system messages queued so far, the newest ones kept for replay
+    // client: non-system messages received so far
+    uint64_t m_nSequence = 0;
+    std::deque<std::shared_ptr<const Message<T>>> m_qReplay;
+    // waiting for the remote side to come back, counts as connected
+    std::atomic<bool> m_bSuspended = false;
+    // client: the last handshake resumed the previous session
+    std::atomic<bool> m_bResumed = false;
+    // closed on purpose, never suspended
+    bool m_bClosing = false;
+    // bumped whenever the socket dies or comes back, stale timers compare it
+    uint32_t m_nGeneration = 0;
+    // client: called on the connection's context when it died, drives reconnects
+    std::function<void()> m_onDropped;
+    size_t m_nReconnectAttempts = 0;
 
     // Handshake validation
     uint64_t m_nHandshakeOut = 0;
     uint64_t m_nHandshakeIn = 0;
     uint64_t m_nHandshakeCheck = 0;
+    handshake_reply m_handshakeReply{};
   };
 
   // -------------------
@@ -93,11 +306,15 @@ namespace sonicpp{
   // -------------------
   
   template<typename T>
-  Connection<T>::Connection(Owner parent, asio::io_context& asioContext, asio::ip::tcp::socket socket, tsqueue<owned_message<T>>& qIn)
+  Connection<T>::Connection(Owner parent, asio::ip::tcp::socket socket, tsqueue<owned_message<T>>& qIn)
     : m_socket(std::move(socket)), 
-      m_asioContext(asioContext), 
+      m_executor(m_socket.get_executor()), 
       m_qMessagesIn(qIn),
-      m_nOwnerType(parent)
+      m_nOwnerType(parent),
+      m_udpSocket(m_executor),
+      m_udpTimer(m_executor),
+      m_shmWake(m_executor),
+      m_shmSocket(m_executor)
   {
     if(m_nOwnerType == Owner::Server)
     {
@@ -116,46 +333,69 @@ namespace sonicpp{
   template<typename T>
   void Connection<T>::ReadValidation(ServerInterface<T>* server)
   {
-    asio::async_read(m_socket, asio::buffer(&m_nHandshakeIn, sizeof(m_nHandshakeIn)),
-      [this, server](std::error_code ec, std::size_t length)
+    // the server reads the client's reply, the client reads the server's challenge
+    auto buffer = m_nOwnerType == Owner::Server ?
+      asio::buffer(&m_handshakeReply, sizeof(m_handshakeReply)) :
+      asio::buffer(&m_nHandshakeIn, sizeof(m_nHandshakeIn));
+
+    asio::async_read(m_socket, buffer,
+      [this, self = this->shared_from_this(), server](std::error_code ec, std::size_t length)
       {
         if(!ec)
         {
           if(m_nOwnerType == Owner::Server)
           {
             // If client send correct anwser
-            if(m_nHandshakeIn == m_nHandshakeCheck)
+            if(m_handshakeReply.nAnswer == m_nHandshakeCheck)
             {
-              // Client has provided validation solution
-              std::cout << "[SERVER] Client Validated" << std::endl;
-              server->OnClientValidated(this->shared_from_this());
+              // a known session takes this socket over, this connection goes away
+              if(m_handshakeReply.nToken && server->ResumeSession(this->shared_from_this(), m_handshakeReply.nToken, m_handshakeReply.nReceived))
+                return;
 
-              // now prime the Read
-              if(!ReadHeader())
-                server->KickClient(this->shared_from_this());
+              Validated(server);
             }
             else
             {
-              std::cout << "Client Disconnected (Fail Validation)" << std::endl;
+              if(m_pMetrics) m_pMetrics->handshakeFailures.add();
+              SONICPP_LOG_WARNING("Client Disconnected (Fail Validation)");
               server->KickClient(this->shared_from_this());
             }
           }
           else // if client
           {
-            // Decode a the validation message
-            m_nHandshakeOut = scramble(m_nHandshakeIn);
+            // Decode a the validation message, ask to resume the session if there is one
+            m_handshakeReply.nAnswer = scramble(m_nHandshakeIn);
+            m_handshakeReply.nToken = m_nSessionToken;
+            m_handshakeReply.nReceived = m_nSequence;
             // Send the result 
             WriteValidation();
           }
         }
         else
         {
-          std::cerr << "Client Disconnected (ReadValidation)" << std::endl; 
-          m_socket.close();
+          if(m_pMetrics) m_pMetrics->handshakeFailures.add();
+          SONICPP_LOG_WARNING("Client Disconnected (ReadValidation)");
+          Drop();
         }
       });
   }
 
+  template<typename T>
+  void Connection<T>::Validated(ServerInterface<T>* server)
+  {
+    // Client has provided validation solution
+    SONICPP_LOG_INFO("[SERVER] Client Validated");
+    server->BeginSession(this->shared_from_this());
+    server->BindDatagrams(this->shared_from_this());
+    server->OnClientValidated(this->shared_from_this());
+    StartIdleChecks();
+    StartClockSync();
+
+    // now prime the Read
+    if(!ReadHeader())
+      server->KickClient(this->shared_from_this());
+  }
+
     template<typename T>
     void Connection<T>::ConnectToClient(sonicpp::ServerInterface<T>* server, uint32_t uid)
     {
@@ -171,27 +411,31 @@ namespace sonicpp{
           ReadValidation(server);
         }
         else
-          std::cerr << "[SERVER] Couldn't connect to client" << std::endl;
+          SONICPP_LOG_ERROR("[SERVER] Couldn't connect to client");
         
       }
     }
     template<typename T>
-    void Connection<T>::ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints)
+    void Connection<T>::ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints, const SocketOptions& options)
     {
       // Only clients can connect to servers
       if(m_nOwnerType == Owner::Client)
       {
         asio::async_connect(m_socket, endpoints,
-          [this](std::error_code ec, asio::ip::tcp::endpoint endpoint)
+          [this, self = this->shared_from_this(), options](std::error_code ec, asio::ip::tcp::endpoint endpoint)
           {
             if(!ec)
             {
+              if(auto ecOptions = options.Apply(m_socket))
+                SONICPP_LOG_WARNING("[" << id << "] Socket Options Error: " << ecOptions.message());
+
               // Prime reading messages
               ReadValidation();
             }
             else
             {
-              std::cerr << "[" << id << "] Connection to server Failed!" << std::endl;
+              SONICPP_LOG_ERROR("[" << id << "] Connection to server Failed!");
+              Drop();
             }
           }
         );
@@ -201,79 +445,510 @@ namespace sonicpp{
     template<typename T>
     void Connection<T>::Disconnect()
     {
-      asio::post(m_asioContext,
-        [this]()
+      CloseLocal();
+      asio::post(m_executor,
+        [this, self = this->shared_from_this()]()
         {
+          m_bClosing = true;
+          // pending timers of this socket are stale now
+          m_nGeneration++;
+          m_bUdpBound = false;
           m_socket.close();  
+          asio::error_code ec;
+          m_udpSocket.close(ec);
+          m_udpTimer.cancel();
+          CloseShared();
         });
     }
     template<typename T>
     bool Connection<T>::IsConnected() const
     {
-      return m_socket.is_open();
+      return m_socket.is_open() || m_bSuspended || m_bLocalOpen || m_bShmOpen;
     }
 
   
     template<typename T>
     void Connection<T>::Send(const Message<T>& msg)
     {
-      asio::post(m_asioContext,
-        [this, msg]()
+      if(m_bLocal)
+        return DeliverLocal(msg);
+      if(m_pShm)
+        return WriteShared(msg);
+      asio::post(m_executor,
+        [this, self = this->shared_from_this(), payload = std::make_shared<const Message<T>>(msg)]()
         {
-          bool bWritingMessage = !m_qMessagesOut.is_empty();
-          m_qMessagesOut.push_back(msg);
-          // Call writeHeader only if no onter messsages are processed now
-          if(!bWritingMessage)
-          {
-            WriteHeader();
-          }
+          QueueOutgoing(payload);
         }  
       );  
     }
+
+    template<typename T>
+    void Connection<T>::QueueOutgoing(std::shared_ptr<const Message<T>> payload)
+    {
+      if(m_bLocal)
+        return DeliverLocal(*payload);
+      if(m_pShm)
+        return WriteShared(*payload, payload);
+      // messages sent over UDP aren't counted nor kept for the replay
+      if(auto channel = Route(payload->header.id))
+        if(SendDatagram(*payload, *channel))
+          return;
+      KeepForReplay(payload);
+      // a suspended session only keeps messages for the replay
+      if(m_bSuspended && m_nOwnerType == Owner::Server)
+        return;
+      m_qMessagesOut.push_back(std::move(payload));
+#ifdef SONICPP_TRACE
+      m_qTraceOut.push_back(std::chrono::steady_clock::now());
+#endif
+      m_metrics.nQueuedOut.store(m_qMessagesOut.size(), std::memory_order_relaxed);
+      // Start writing only if no onter messsages are processed now
+      if(m_nMessagesWriting == 0 && !m_bSuspended && (m_nOwnerType == Owner::Server || m_bHandshakeSent))
+        WriteMessages();
+    }
+
+    template<typename T>
+    void Connection<T>::QueueOutgoing(const std::vector<std::shared_ptr<const Message<T>>>& payloads)
+    {
+      if(m_bLocal)
+      {
+        for(const auto& payload : payloads)
+          DeliverLocal(*payload);
+        return;
+      }
+      if(m_pShm)
+      {
+        for(const auto& payload : payloads)
+          WriteShared(*payload, payload);
+        return;
+      }
+      size_t nQueued = 0;
+      size_t nDatagrams = 0;
+      for(const auto& payload : payloads)
+      {
+        // reliable ones are packed together below
+        if(auto channel = Route(payload->header.id))
+          if(SendDatagram(*payload, *channel, false))
+          {
+            nDatagrams++;
+            continue;
+          }
+        KeepForReplay(payload);
+        if(m_bSuspended && m_nOwnerType == Owner::Server)
+          continue;
+        m_qMessagesOut.push_back(payload);
+        nQueued++;
+      }
+#ifdef SONICPP_TRACE
+      m_qTraceOut.insert(m_qTraceOut.end(), nQueued, std::chrono::steady_clock::now());
+#endif
+      m_metrics.nQueuedOut.store(m_qMessagesOut.size(), std::memory_order_relaxed);
+      if(nQueued && m_nMessagesWriting == 0 && !m_bSuspended && (m_nOwnerType == Owner::Server || m_bHandshakeSent))
+        WriteMessages();
+      if(nDatagrams)
+        FlushDatagrams(false);
+    }
+
+    template<typename T>
+    void Connection<T>::SendUdp(const Message<T>& msg, UdpChannel channel)
+    {
+      // already reliable and ordered, whatever the channel asks for
+      if(m_bLocal)
+        return DeliverLocal(msg);
+      if(m_pShm)
+        return WriteShared(msg);
+      asio::post(m_executor,
+        [this, self = this->shared_from_this(), payload = std::make_shared<const Message<T>>(msg), channel]()
+        {
+          QueueUdp(payload, channel);
+        }
+      );
+    }
+
+    template<typename T>
+    void Connection<T>::QueueUdp(std::shared_ptr<const Message<T>> payload, UdpChannel channel)
+    {
+      if(!SendDatagram(*payload, channel))
+        QueueOutgoing(std::move(payload));
+    }
+    template<typename T>
+    void Connection<T>::PairLocal(const std::shared_ptr<Connection>& client, const std::shared_ptr<Connection>& server)
+    {
+      client->m_bLocal = server->m_bLocal = true;
+      client->m_localPeer = server;
+      server->m_localPeer = client;
+      client->id = server->id;
+      client->m_bLocalOpen = server->m_bLocalOpen = true;
+    }
+
+    template<typename T>
+    void Connection<T>::DeliverLocal(Message<T> msg)
+    {
+      auto peer = m_localPeer.lock();
+      if(!peer || !m_bLocalOpen)
+        return;
+
+      // any thread may send, the counters can't assume a single writer here
+      const size_t nBytes = sizeof(msg.header) + msg.body.size();
+      const size_t nSlot = MetricsRegistry::type_slot(msg.header.id);
+      m_metrics.nMessagesOut.fetch_add(1, std::memory_order_relaxed);
+      m_metrics.nBytesOut.fetch_add(nBytes, std::memory_order_relaxed);
+      peer->m_metrics.nMessagesIn.fetch_add(1, std::memory_order_relaxed);
+      peer->m_metrics.nBytesIn.fetch_add(nBytes, std::memory_order_relaxed);
+      if(m_pMetrics)
+      {
+        m_pMetrics->messagesOut.add();
+        m_pMetrics->bytesOut.add(nBytes);
+        m_pMetrics->messagesOutByType[nSlot].fetch_add(1, std::memory_order_relaxed);
+      }
+      if(peer->m_pMetrics)
+      {
+        peer->m_pMetrics->messagesIn.add();
+        peer->m_pMetrics->bytesIn.add(nBytes);
+        peer->m_pMetrics->messagesInByType[nSlot].fetch_add(1, std::memory_order_relaxed);
+      }
+
+      owned_message<T> owned{peer->m_nOwnerType == Owner::Server ? peer : nullptr, std::move(msg)};
+#ifdef SONICPP_TRACE
+      owned.trace.tpHeader = owned.trace.tpQueued = std::chrono::steady_clock::now();
+#endif
+      peer->m_qMessagesIn.push_back(std::move(owned));
+    }
+
+    template<typename T>
+    void Connection<T>::CloseLocal()
+    {
+      if(!m_bLocalOpen.exchange(false))
+        return;
+      auto peer = m_localPeer.lock();
+      if(!peer || !peer->m_bLocalOpen.exchange(false))
+        return;
+      // the server learns about it on its next Update, like about a dropped socket
+      if(peer->m_nOwnerType == Owner::Server)
+        peer->m_qMessagesIn.push_back({peer, Message<T>(system_id<T>(SystemMessage::Disconnected))});
+    }
+
+    template<typename T>
+    void Connection<T>::OpenShared(std::unique_ptr<shm_region> pRegion, asio::local::stream_protocol::socket socket, std::chrono::microseconds spin)
+    {
+      m_pShm = std::move(pRegion);
+      m_shmIn = m_pShm->in();
+      m_shmOut = m_pShm->out();
+      m_shmSpin = spin;
+      // both serialized by the connection's executor
+      m_shmSocket.assign(asio::local::stream_protocol(), socket.release());
+      m_shmWake.assign(::dup(m_pShm->wake_fd()));
+      m_bShmOpen = true;
+      asio::post(m_executor,
+        [this, self = this->shared_from_this()]()
+        {
+          WatchShared();
+          ReadShared();
+        });
+    }
+
+    template<typename T>
+    void Connection<T>::WriteShared(const Message<T>& msg, std::shared_ptr<const Message<T>> payload)
+    {
+      if(!m_bShmOpen)
+        return;
+
+      const size_t nTotal = sizeof(message_header<T>) + msg.body.size();
+      std::lock_guard<std::mutex> lock(m_muxShmOut);
+      ConnectionMetrics::bump(m_metrics.nMessagesOut, 1);
+      ConnectionMetrics::bump(m_metrics.nBytesOut, nTotal);
+      if(m_pMetrics)
+      {
+        m_pMetrics->messagesOut.add();
+        m_pMetrics->bytesOut.add(nTotal);
+        m_pMetrics->messagesOutByType[MetricsRegistry::type_slot(msg.header.id)].fetch_add(1, std::memory_order_relaxed);
+      }
+
+      // straight into the ring, copied only when it has to wait
+      size_t nWritten = 0;
+      if(m_qMessagesOut.empty())
+        nWritten = m_shmOut.write(0, &msg.header, sizeof(message_header<T>), msg.body.data(), msg.body.size());
+      if(nWritten < nTotal)
+      {
+        if(m_qMessagesOut.empty())
+          m_nShmWritten = nWritten;
+        m_qMessagesOut.push_back(payload ? std::move(payload) : std::make_shared<const Message<T>>(msg));
+        FlushShared();
+      }
+
+      if(m_shmOut.wake_consumer())
+        m_pShm->wake_peer();
+    }
+
+    template<typename T>
+    void Connection<T>::FlushShared()
+    {
+      while(!m_qMessagesOut.empty())
+      {
+        const Message<T>& msg = *m_qMessagesOut.front();
+        m_nShmWritten = m_shmOut.write(m_nShmWritten, &msg.header, sizeof(message_header<T>), msg.body.data(), msg.body.size());
+        if(m_nShmWritten < sizeof(message_header<T>) + msg.body.size())
+        {
+          // the other side wakes us once it made room, unless it did already
+          if(m_shmOut.block())
+            break;
+          continue;
+        }
+        m_qMessagesOut.pop_front();
+        m_nShmWritten = 0;
+      }
+      m_metrics.nQueuedOut.store(m_qMessagesOut.size(), std::memory_order_relaxed);
+    }
+
+    template<typename T>
+    void Connection<T>::ReadShared()
+    {
+      if(!m_bShmOpen)
+        return;
+
+      m_pShm->reset_wake();
+      DrainShared();
+
+      // woken up because there is room for our backlog
+      {
+        std::lock_guard<std::mutex> lock(m_muxShmOut);
+        if(!m_qMessagesOut.empty())
+        {
+          FlushShared();
+          if(m_shmOut.wake_consumer())
+            m_pShm->wake_peer();
+        }
+      }
+
+      // a wakeup costs more than a short poll, when configured
+      if(m_shmSpin.count())
+      {
+        auto tpStop = std::chrono::steady_clock::now() + m_shmSpin;
+        while(std::chrono::steady_clock::now() < tpStop && !m_bReadPaused && !m_bClosing)
+          if(m_shmIn.readable())
+          {
+            DrainShared();
+            tpStop = std::chrono::steady_clock::now() + m_shmSpin;
+          }
+      }
+
+      // rate limited or kicked, resumed by the timing wheel or not at all
+      if(m_bReadPaused || m_bClosing)
+        return;
+
+      // more came meanwhile, go again without starving the other handlers
+      if(!m_shmIn.sleep())
+      {
+        asio::post(m_executor, [this, self = this->shared_from_this()](){ ReadShared(); });
+        return;
+      }
+
+      m_shmWake.async_wait(asio::posix::stream_descriptor::wait_read,
+        [this, self = this->shared_from_this()](std::error_code ec)
+        {
+          if(!ec)
+            ReadShared();
+        });
+    }
+
+    template<typename T>
+    void Connection<T>::DrainShared()
+    {
+      constexpr size_t nHeader = sizeof(message_header<T>);
+      for(;;)
+      {
+        if(!m_bShmBody)
+        {
+          if(m_shmIn.readable() < nHeader)
+            break;
+          m_shmIn.read(&m_msgTemporaryIn.header, nHeader);
+          m_msgTemporaryIn.body.resize(m_msgTemporaryIn.header.size);
+          m_nShmBodyRead = 0;
+          m_bShmBody = true;
+          m_bShmAdmitted = false;
+        }
+
+        // same limits as over TCP, a paused connection leaves the rest in the
+        // ring and the sender waits for room
+        if(!m_bShmAdmitted)
+        {
+          std::chrono::steady_clock::duration wait;
+          if(!ChargeRateLimit(wait))
+            return;
+          if(m_bReadPaused)
+          {
+            Schedule(wait, [](Connection<T>& conn){ conn.ReadShared(); });
+            break;
+          }
+          m_bShmAdmitted = true;
+        }
+
+        auto& body = m_msgTemporaryIn.body;
+        m_nShmBodyRead += m_shmIn.read(body.data() + m_nShmBodyRead, body.size() - m_nShmBodyRead);
+        if(m_nShmBodyRead < body.size())
+          break;
+        m_bShmBody = false;
+
+        CountIn(nHeader + body.size());
+        // nothing of the library's own travels this way
+        if(is_system_id(m_msgTemporaryIn.header.id) || m_bDiscardIn)
+          continue;
+        ConnectionMetrics::bump(m_metrics.nMessagesIn, 1);
+        if(m_pMetrics)
+        {
+          m_pMetrics->messagesIn.add();
+          m_pMetrics->messagesInByType[MetricsRegistry::type_slot(m_msgTemporaryIn.header.id)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        owned_message<T> owned{m_nOwnerType == Owner::Server ? this->shared_from_this() : nullptr, std::move(m_msgTemporaryIn)};
+#ifdef SONICPP_TRACE
+        owned.trace.tpHeader = owned.trace.tpQueued = std::chrono::steady_clock::now();
+#endif
+        m_qMessagesIn.push_back(std::move(owned));
+      }
+
+      if(m_shmIn.wake_producer())
+        m_pShm->wake_peer();
+    }
+
+    template<typename T>
+    void Connection<T>::WatchShared()
+    {
+      // nothing is sent on the socket after the handshake, readable means closed
+      m_shmSocket.async_wait(asio::local::stream_protocol::socket::wait_read,
+        [this, self = this->shared_from_this()](std::error_code)
+        {
+          if(m_bShmOpen)
+            SONICPP_LOG_INFO("[" << id << "] Shared Memory Closed");
+          CloseShared();
+        });
+    }
+
+    template<typename T>
+    void Connection<T>::CloseShared()
+    {
+      if(!m_bShmOpen.exchange(false))
+        return;
+      asio::error_code ec;
+      m_shmSocket.close(ec);
+      m_shmWake.close(ec);
+      // the server learns about it on its next Update, like about a dropped socket
+      if(m_nOwnerType == Owner::Server)
+        m_qMessagesIn.push_back({this->shared_from_this(), Message<T>(system_id<T>(SystemMessage::Disconnected))});
+    }
+
     template<typename T>
     bool Connection<T>::ReadHeader()
     {
-      bool success{true};
+      // failures are reported asynchronously through Drop()
+      if(!m_socket.is_open())
+        return false;
+
       asio::async_read(m_socket, asio::buffer(&m_msgTemporaryIn.header, sizeof(message_header<T>)),
-        [this, &success](std::error_code ec, std::size_t length)
+        [this, self = this->shared_from_this(), nGeneration = m_nGeneration](std::error_code ec, std::size_t length)
         {
+          // completion of a socket that was replaced meanwhile
+          if(nGeneration != m_nGeneration)
+            return;
           if(!ec)
           {
-            if(m_msgTemporaryIn.header.size > 0)
-            {
-              m_msgTemporaryIn.body.resize(m_msgTemporaryIn.header.size);
-              ReadBody();
-            }
-            else
-            {
-              // if no body, just add it as complete
-              AddToIncomingMessageQueue();
-            }
+            m_tpLastRead = std::chrono::steady_clock::now();
+            CountIn(length);
+            AdmitMessage();
           }
           else
           {
-            std::cout << "[" << id << "] Read Header Fail." << std::endl;
-            Disconnect();
-            success = false;
+            SONICPP_LOG_INFO("[" << id << "] Read Header Fail.");
+            Drop();
           }
         });
-      return success;
+      return true;
     }
+    template<typename T>
+    void Connection<T>::AdmitMessage()
+    {
+      std::chrono::steady_clock::duration wait;
+      if(!ChargeRateLimit(wait))
+        return;
+      if(m_bReadPaused)
+      {
+        // no read is pending meanwhile, the kernel buffer fills up and
+        // TCP flow control pushes back on the sender
+        Schedule(wait, [](Connection<T>& conn){ conn.AdmitMessage(); });
+        return;
+      }
+
+      if(m_msgTemporaryIn.header.size > 0)
+      {
+        m_msgTemporaryIn.body.resize(m_msgTemporaryIn.header.size);
+        ReadBody();
+      }
+      else
+      {
+        // if no body, just add it as complete
+        AddToIncomingMessageQueue();
+      }
+    }
+
+    template<typename T>
+    bool Connection<T>::ChargeRateLimit(std::chrono::steady_clock::duration& wait)
+    {
+      const auto now = std::chrono::steady_clock::now();
+      const double fBytes = sizeof(message_header<T>) + m_msgTemporaryIn.header.size;
+      m_bDiscardIn = false;
+      m_bReadPaused = false;
+      wait = std::chrono::steady_clock::duration::zero();
+      if(m_msgBucket.unlimited() && m_byteBucket.unlimited())
+        return true;
+
+      auto need = std::max(m_msgBucket.wait_for(1, now), m_byteBucket.wait_for(fBytes, now));
+      if(need > std::chrono::steady_clock::duration::zero())
+      {
+        if(m_pMetrics) m_pMetrics->rateLimited.add();
+        switch(m_rateLimit.action)
+        {
+          case RateLimitConfig::Action::Pause:
+            if(!m_pWheel)
+              break;
+            m_bReadPaused = true;
+            wait = need;
+            return true;
+          case RateLimitConfig::Action::Kick:
+            SONICPP_LOG_WARNING("[" << id << "] Rate Limit Exceeded");
+            Kick();
+            return false;
+          case RateLimitConfig::Action::Drop:
+            m_bDiscardIn = true;
+            break;
+        }
+      }
+
+      if(!m_bDiscardIn)
+      {
+        m_msgBucket.consume(1, now);
+        m_byteBucket.consume(fBytes, now);
+      }
+      return true;
+    }
+
     template<typename T>
     void Connection<T>::ReadBody()
     {
       asio::async_read(m_socket, asio::buffer(m_msgTemporaryIn.body.data(), m_msgTemporaryIn.body.size()),
-        [this](std::error_code ec, std::size_t length)
+        [this, self = this->shared_from_this(), nGeneration = m_nGeneration](std::error_code ec, std::size_t length)
         {
+          if(nGeneration != m_nGeneration)
+            return;
           if(!ec)
           {
+            CountIn(length);
             // add to quue as complete read message
             AddToIncomingMessageQueue();
           }
           else
           {
-            std::cout << "[" << id << "] Read Body Fail!" << std::endl;
-            m_socket.close();
+            SONICPP_LOG_INFO("[" << id << "] Read Body Fail!");
+            Drop();
           }
         });
     }
@@ -281,66 +956,654 @@ namespace sonicpp{
     
     // @ASYNC
     template<typename T>
-    void Connection<T>::WriteHeader()
+    void Connection<T>::WriteMessages()
     {
-        asio::async_write(m_socket, asio::buffer(&m_qMessagesOut.front().header, sizeof(message_header<T>)),
-        [this](std::error_code ec, std::size_t length)
+      // everything queued until now goes out together, messages stay
+      // in the queue until written so the buffers remain valid
+      m_vWriteBuffers.clear();
+      m_nMessagesWriting = m_qMessagesOut.size();
+      m_tpWriteStarted = std::chrono::steady_clock::now();
+      for(const auto& msg : m_qMessagesOut)
+      {
+        m_vWriteBuffers.push_back(asio::buffer(&msg->header, sizeof(message_header<T>)));
+        if(!msg->body.empty())
+          m_vWriteBuffers.push_back(asio::buffer(msg->body.data(), msg->body.size()));
+      }
+#ifdef SONICPP_TRACE
+      if(m_pMetrics)
+        for(size_t i = 0; i < m_nMessagesWriting; ++i)
+          m_pMetrics->tracer.record(TraceStage::OutQueue, MetricsRegistry::type_slot(m_qMessagesOut[i]->header.id), m_tpWriteStarted - m_qTraceOut[i]);
+#endif
+
+      asio::async_write(m_socket, m_vWriteBuffers,
+        [this, self = this->shared_from_this(), nGeneration = m_nGeneration](std::error_code ec, std::size_t length)
         {
+          if(nGeneration != m_nGeneration)
+            return;
           if(!ec)
           {
-            if(m_qMessagesOut.front().body.size() > 0)
-            {
-              WriteBody();
-            }
-            else
-            {
-              m_qMessagesOut.pop_front(); 
+            m_tpLastWrite = std::chrono::steady_clock::now();
+            CountWritten(length);
+            m_qMessagesOut.erase(m_qMessagesOut.begin(), m_qMessagesOut.begin() + m_nMessagesWriting);
+#ifdef SONICPP_TRACE
+            m_qTraceOut.erase(m_qTraceOut.begin(), m_qTraceOut.begin() + m_nMessagesWriting);
+#endif
+            m_metrics.nQueuedOut.store(m_qMessagesOut.size(), std::memory_order_relaxed);
+            m_nMessagesWriting = 0;
 
-              if(!m_qMessagesOut.is_empty())
-                WriteHeader();
-            }
+            if(!m_qMessagesOut.empty())
+              WriteMessages();
           }
           else
           {
-            std::cout << "[" << id << "] Write Header Fail!" << std::endl;
-            m_socket.close();
+            SONICPP_LOG_INFO("[" << id << "] Write Fail!");
+            m_nMessagesWriting = 0;
+            Drop();
           }
         });
     }
 
-    // @ASYNC
     template<typename T>
-    void Connection<T>::WriteBody()
+    void Connection<T>::AddToIncomingMessageQueue()
+    {
+      // library messages are consumed here, heartbeats only refresh m_tpLastRead
+      if(is_system_id(m_msgTemporaryIn.header.id))
+      {
+        if(m_nOwnerType == Owner::Client && m_msgTemporaryIn.header.id == system_id<T>(SystemMessage::Session))
+          ReadSession();
+        else if(m_nOwnerType == Owner::Client && (m_msgTemporaryIn.header.id == system_id<T>(SystemMessage::UdpBind) ||
+                                                  m_msgTemporaryIn.header.id == system_id<T>(SystemMessage::UdpBound)))
+          ReadUdpBind();
+        else
+          ReadClock();
+        ReadHeader();
+        return;
+      }
+
+      // counted even when rate limited, the server's replay counts what it sent
+      if(m_nOwnerType == Owner::Client)
+        m_nSequence++;
+
+      // rate limited messages are thrown away
+      if(m_bDiscardIn)
+      {
+        ReadHeader();
+        return;
+      }
+
+      ConnectionMetrics::bump(m_metrics.nMessagesIn, 1);
+      if(m_pMetrics)
+      {
+        m_pMetrics->messagesIn.add();
+        m_pMetrics->messagesInByType[MetricsRegistry::type_slot(m_msgTemporaryIn.header.id)].fetch_add(1, std::memory_order_relaxed);
+      }
+
+      // clients have only one connection so dont specify connection
+      owned_message<T> owned{m_nOwnerType == Owner::Server ? this->shared_from_this() : nullptr, m_msgTemporaryIn};
+#ifdef SONICPP_TRACE
+      owned.trace.tpHeader = m_tpLastRead;
+      owned.trace.tpQueued = std::chrono::steady_clock::now();
+      if(m_pMetrics)
+        m_pMetrics->tracer.record(TraceStage::Read, MetricsRegistry::type_slot(owned.msg.header.id), owned.trace.tpQueued - m_tpLastRead);
+#endif
+      m_qMessagesIn.push_back(owned);
+
+      // prime to read another header
+      ReadHeader();
+    }
+
+    template<typename T>
+    void Connection<T>::CountIn(size_t nBytes)
+    {
+      ConnectionMetrics::bump(m_metrics.nBytesIn, nBytes);
+      if(m_pMetrics)
+        m_pMetrics->bytesIn.add(nBytes);
+    }
+
+    template<typename T>
+    void Connection<T>::CountWritten(size_t nBytes)
+    {
+      ConnectionMetrics::bump(m_metrics.nBytesOut, nBytes);
+      ConnectionMetrics::bump(m_metrics.nMessagesOut, m_nMessagesWriting);
+      if(!m_pMetrics)
+        return;
+      m_pMetrics->bytesOut.add(nBytes);
+      m_pMetrics->messagesOut.add(m_nMessagesWriting);
+      for(size_t i = 0; i < m_nMessagesWriting; ++i)
+      {
+        size_t nSlot = MetricsRegistry::type_slot(m_qMessagesOut[i]->header.id);
+        m_pMetrics->messagesOutByType[nSlot].fetch_add(1, std::memory_order_relaxed);
+#ifdef SONICPP_TRACE
+        m_pMetrics->tracer.record(TraceStage::Write, nSlot, m_tpLastWrite - m_tpWriteStarted);
+#endif
+      }
+      m_pMetrics->writeLatencyUs.record(
+        std::chrono::duration_cast<std::chrono::microseconds>(m_tpLastWrite - m_tpWriteStarted).count());
+    }
+
+    template<typename T>
+    void Connection<T>::StartIdleChecks()
+    {
+      m_tpLastRead = m_tpLastWrite = std::chrono::steady_clock::now();
+      if(!m_pWheel)
+        return;
+      if(m_heartbeat.interval.count() == 0 && m_heartbeat.readTimeout.count() == 0 && m_heartbeat.writeTimeout.count() == 0)
+        return;
+      CheckIdle();
+    }
+
+    template<typename T>
+    void Connection<T>::CheckIdle()
+    {
+      if(!m_socket.is_open() || m_bSuspended)
+        return;
+
+      const auto now = std::chrono::steady_clock::now();
+      // a connection paused by rate limiting isn't idle
+      if(m_heartbeat.readTimeout.count() && !m_bReadPaused && now - m_tpLastRead > m_heartbeat.readTimeout)
+      {
+        SONICPP_LOG_INFO("[" << id << "] Read Timeout");
+        Drop();
+        return;
+      }
+      if(m_heartbeat.writeTimeout.count() && m_nMessagesWriting > 0 && now - m_tpWriteStarted > m_heartbeat.writeTimeout)
+      {
+        SONICPP_LOG_INFO("[" << id << "] Write Timeout");
+        Drop();
+        return;
+      }
+      if(m_heartbeat.interval.count() && m_qMessagesOut.empty() && now - m_tpLastWrite >= m_heartbeat.interval)
+        QueueOutgoing(std::make_shared<const Message<T>>(system_id<T>(SystemMessage::Heartbeat)));
+
+      // check twice per the shortest period so nothing is detected later than half of it
+      std::chrono::milliseconds period = std::chrono::milliseconds::max();
+      for(auto p : {m_heartbeat.interval, m_heartbeat.readTimeout, m_heartbeat.writeTimeout})
+        if(p.count())
+          period = std::min(period, p);
+
+      // a newer chain is started when a session comes back
+      Schedule(period / 2, [](Connection<T>& conn){ conn.CheckIdle(); });
+    }
+
+    template<typename T>
+    void Connection<T>::StartClockSync()
     {
-        asio::async_write(m_socket, asio::buffer(m_qMessagesOut.front().body.data(), m_qMessagesOut.front().body.size()),
-        [this](std::error_code ec, std::size_t length)
+      m_clock.set_window(m_clockSync.nWindow);
+      if(m_pWheel && m_clockSync.bEnabled && m_clockSync.interval.count())
+        SyncClock();
+    }
+
+    template<typename T>
+    void Connection<T>::SyncClock()
+    {
+      if(!m_socket.is_open() || m_bSuspended)
+        return;
+
+      auto msg = std::make_shared<Message<T>>(system_id<T>(SystemMessage::ClockRequest));
+      *msg << clock_estimator::stamp();
+      QueueOutgoing(msg);
+
+      // a newer chain is started when a session comes back
+      Schedule(m_clockSync.interval, [](Connection<T>& conn){ conn.SyncClock(); });
+    }
+
+    template<typename T>
+    void Connection<T>::ReadClock()
+    {
+      if(!m_clockSync.bEnabled)
+        return;
+
+      // the header's arrival is the closest to when the remote side sent it
+      const int64_t nRead = clock_estimator::stamp(m_tpLastRead);
+      if(m_msgTemporaryIn.header.id == system_id<T>(SystemMessage::ClockRequest))
+      {
+        if(!CheckSystemBody(sizeof(int64_t)))
+          return;
+        int64_t t0;
+        m_msgTemporaryIn >> t0;
+        auto msg = std::make_shared<Message<T>>(system_id<T>(SystemMessage::ClockResponse));
+        *msg << t0 << nRead << clock_estimator::stamp();
+        QueueOutgoing(msg);
+      }
+      else if(m_msgTemporaryIn.header.id == system_id<T>(SystemMessage::ClockResponse))
+      {
+        if(!CheckSystemBody(3 * sizeof(int64_t)))
+          return;
+        int64_t t0, t1, t2;
+        m_msgTemporaryIn >> t2 >> t1 >> t0;
+        m_clock.add(t0, t1, t2, nRead);
+      }
+    }
+
+    template<typename T>
+    bool Connection<T>::CheckSystemBody(size_t nSize)
+    {
+      if(m_msgTemporaryIn.body.size() == nSize)
+        return true;
+      SONICPP_LOG_WARNING("[" << id << "] Malformed Library Message");
+      Kick();
+      return false;
+    }
+
+    template<typename T>
+    std::optional<UdpChannel> Connection<T>::Route(T id) const
+    {
+      if(!m_pRoutes)
+        return std::nullopt;
+      return m_pRoutes->find(id);
+    }
+
+    template<typename T>
+    bool Connection<T>::SendDatagram(const Message<T>& msg, UdpChannel channel, bool bFlush)
+    {
+      if(!m_bUdpBound)
+        return false;
+
+      if(channel.delivery == Delivery::Unreliable)
+      {
+        if(!m_reliable.fits(msg))
+          return false;
+        m_reliable.send_unreliable(msg, m_packetsOut);
+      }
+      else if(!m_reliable.send_reliable(msg, channel))
+        return false;
+
+      ConnectionMetrics::bump(m_metrics.nMessagesOut, 1);
+      if(m_pMetrics)
+      {
+        m_pMetrics->messagesOut.add();
+        m_pMetrics->messagesOutByType[MetricsRegistry::type_slot(msg.header.id)].fetch_add(1, std::memory_order_relaxed);
+      }
+      if(bFlush)
+        FlushDatagrams(false);
+      return true;
+    }
+
+    template<typename T>
+    void Connection<T>::FlushDatagrams(bool bAckDue)
+    {
+      // nowhere to send to, retransmissions go on once bound again
+      if(!m_bUdpBound)
+      {
+        m_packetsOut.clear();
+        return;
+      }
+      m_reliable.flush(m_packetsOut, bAckDue);
+      WriteDatagrams();
+      if(m_reliable.busy())
+        ArmDatagramTimer();
+    }
+
+    template<typename T>
+    void Connection<T>::WriteDatagrams()
+    {
+      if(m_packetsOut.empty())
+        return;
+
+      const bool bServer = m_nOwnerType == Owner::Server;
+      std::error_code ec;
+      size_t nBytes = bServer ?
+        send_datagrams(m_pUdpServer->native_handle(), &m_udpPeer, nullptr, m_packetsOut, ec) :
+        send_datagrams(m_udpSocket.native_handle(), nullptr, &m_nUdpToken, m_packetsOut, ec);
+      m_packetsOut.clear();
+      // a full socket buffer or an unreachable peer loses datagrams, as UDP would
+      // anyway, the reliable ones are sent again
+      if(ec)
+        SONICPP_LOG_DEBUG("[" << id << "] Datagrams Lost: " << ec.message());
+      if(nBytes == 0)
+        return;
+
+      m_tpLastWrite = std::chrono::steady_clock::now();
+      ConnectionMetrics::bump(m_metrics.nBytesOut, nBytes);
+      if(m_pMetrics)
+        m_pMetrics->bytesOut.add(nBytes);
+    }
+
+    template<typename T>
+    void Connection<T>::ArmDatagramTimer()
+    {
+      if(m_bUdpTimerArmed)
+        return;
+      m_bUdpTimerArmed = true;
+      m_udpTimer.expires_after(m_udp.tick);
+      m_udpTimer.async_wait([this, self = this->shared_from_this()](std::error_code ec)
+      {
+        m_bUdpTimerArmed = false;
+        // unbound meanwhile, binding again flushes and restarts the timer
+        if(!ec && m_bUdpBound)
+          FlushDatagrams(true);
+      });
+    }
+
+    template<typename T>
+    void Connection<T>::ReadDatagram(const asio::ip::udp::endpoint& sender, const std::vector<uint8_t>& vPacket)
+    {
+      // between two connections of a session datagrams have nowhere to go
+      if(!m_socket.is_open() || m_bSuspended)
+        return;
+
+      // the token vouches for the sender, a client whose address changed,
+      // e.g. a NAT rebinding, is followed to the new one
+      m_udpPeer = sender;
+      CountIn(sizeof(m_nUdpToken) + vPacket.size());
+      ReadPacket(vPacket.data(), vPacket.size());
+      if(!m_bUdpBound)
+      {
+        m_bUdpBound = true;
+        SONICPP_LOG_INFO("[" << id << "] UDP Bound: " << sender);
+        QueueOutgoing(std::make_shared<const Message<T>>(system_id<T>(SystemMessage::UdpBound)));
+      }
+      FlushDatagrams(false);
+    }
+
+    template<typename T>
+    void Connection<T>::ReadPacket(const uint8_t* pData, size_t nLength)
+    {
+      m_tpLastRead = std::chrono::steady_clock::now();
+      // library messages only bind the channel
+      m_reliable.receive(pData, nLength, [this](Message<T>&& msg)
+      {
+        if(!is_system_id(msg.header.id))
+          AddDatagramToIncomingQueue(msg);
+      });
+    }
+
+    template<typename T>
+    void Connection<T>::ReadUdpBind()
+    {
+      if(m_msgTemporaryIn.header.id == system_id<T>(SystemMessage::UdpBound))
+      {
+        if(!CheckSystemBody(0))
+          return;
+        m_bUdpBound = true;
+        FlushDatagrams(false);
+        return;
+      }
+
+      // server pushed token, port
+      if(!CheckSystemBody(sizeof(uint64_t) + sizeof(uint16_t)))
+        return;
+      uint16_t nPort;
+      uint64_t nToken;
+      m_msgTemporaryIn >> nPort >> nToken;
+      if(!m_udp.bEnabled)
+        return;
+
+      // the datagram port is on the address the stream is connected to
+      asio::error_code ec;
+      asio::ip::udp::endpoint server(m_socket.remote_endpoint(ec).address(), nPort);
+      if(!ec)
+      {
+        m_udpSocket.close(ec);
+        m_udpSocket.open(server.protocol(), ec);
+      }
+      if(!ec)
+        m_udpSocket.connect(server, ec);
+      if(ec)
+      {
+        SONICPP_LOG_WARNING("[" << id << "] UDP Error: " << ec.message());
+        return;
+      }
+
+      // a resumed session keeps its token and whatever is still in flight,
+      // a new one starts over like the server's side of it
+      if(nToken != m_nUdpToken)
+        m_reliable.configure(m_udp, sizeof(m_nUdpToken));
+      m_nUdpToken = nToken;
+      m_nBindAttempts = 0;
+      m_bUdpBound = false;
+      m_datagramsIn.resize(m_udp.nReceiveBatch);
+      ReceiveDatagrams();
+      SendBindRequest();
+    }
+
+    template<typename T>
+    void Connection<T>::SendBindRequest()
+    {
+      if(m_bUdpBound || !m_udpSocket.is_open())
+        return;
+      if(m_nBindAttempts++ >= m_udp.nBindAttempts)
+      {
+        SONICPP_LOG_WARNING("[" << id << "] UDP Unreachable, staying on TCP");
+        return;
+      }
+
+      m_reliable.send_unreliable(Message<T>(system_id<T>(SystemMessage::UdpBind)), m_packetsOut);
+      WriteDatagrams();
+      Schedule(m_udp.bindRetry, [](Connection<T>& conn){ conn.SendBindRequest(); });
+    }
+
+    template<typename T>
+    void Connection<T>::ReceiveDatagrams()
+    {
+      m_udpSocket.async_wait(asio::ip::udp::socket::wait_read,
+        [this, self = this->shared_from_this(), nGeneration = m_nGeneration](std::error_code ec)
         {
-          if(!ec)
-          {
-            m_qMessagesOut.pop_front(); 
+          // closed, a new loop starts when the server offers the channel again
+          if(ec || nGeneration != m_nGeneration)
+            return;
 
-            if(!m_qMessagesOut.is_empty())
-              WriteHeader();
-          }
-          else
+          // everything queued in as few system calls as possible
+          size_t nReceived;
+          do
           {
-            std::cout << "[" << id << "] Write Body Fail!" << std::endl;
-            m_socket.close();
+            nReceived = m_datagramsIn.receive(m_udpSocket.native_handle());
+            for(size_t i = 0; i < nReceived; ++i)
+            {
+              CountIn(m_datagramsIn.size(i));
+              ReadPacket(m_datagramsIn.data(i), m_datagramsIn.size(i));
+            }
           }
+          while(nReceived == m_datagramsIn.capacity());
+
+          FlushDatagrams(false);
+          ReceiveDatagrams();
         });
     }
 
     template<typename T>
-    void Connection<T>::AddToIncomingMessageQueue()
+    void Connection<T>::AddDatagramToIncomingQueue(Message<T>& msg)
     {
-      if(m_nOwnerType == Owner::Server)
-        m_qMessagesIn.push_back({this->shared_from_this(), m_msgTemporaryIn});
-      else // owner == client
-        // clients have only one connection so dont specify connection
-        m_qMessagesIn.push_back({nullptr, m_msgTemporaryIn}); 
+      // datagrams can't be paused, whatever is over the limit is thrown away
+      if(!m_msgBucket.unlimited() || !m_byteBucket.unlimited())
+      {
+        const auto now = std::chrono::steady_clock::now();
+        const double fBytes = sizeof(message_header<T>) + msg.body.size();
+        if(m_msgBucket.wait_for(1, now) > std::chrono::steady_clock::duration::zero() ||
+           m_byteBucket.wait_for(fBytes, now) > std::chrono::steady_clock::duration::zero())
+        {
+          if(m_pMetrics) m_pMetrics->rateLimited.add();
+          return;
+        }
+        m_msgBucket.consume(1, now);
+        m_byteBucket.consume(fBytes, now);
+      }
 
-      // prime to read another header
+      ConnectionMetrics::bump(m_metrics.nMessagesIn, 1);
+      if(m_pMetrics)
+      {
+        m_pMetrics->messagesIn.add();
+        m_pMetrics->messagesInByType[MetricsRegistry::type_slot(msg.header.id)].fetch_add(1, std::memory_order_relaxed);
+      }
+
+      owned_message<T> owned{m_nOwnerType == Owner::Server ? this->shared_from_this() : nullptr, std::move(msg)};
+#ifdef SONICPP_TRACE
+      owned.trace.tpHeader = owned.trace.tpQueued = std::chrono::steady_clock::now();
+#endif
+      m_qMessagesIn.push_back(owned);
+    }
+
+    template<typename T>
+    template<typename F>
+    void Connection<T>::Schedule(std::chrono::steady_clock::duration delay, F fn)
+    {
+      // the wheel may run on another thread than the connection's executor,
+      // it only holds the connection weakly
+      std::weak_ptr<Connection<T>> self = this->weak_from_this();
+      m_pWheel->schedule(delay, [self, nGeneration = m_nGeneration, fn = std::move(fn)]()
+      {
+        if(auto conn = self.lock())
+          asio::dispatch(conn->m_executor, [conn, nGeneration, fn]()
+          {
+            if(conn->m_nGeneration == nGeneration)
+              fn(*conn);
+          });
+      });
+    }
+
+    template<typename T>
+    void Connection<T>::Drop()
+    {
+      m_socket.close();
+      if(m_bDropped)
+        return;
+      m_bDropped = true;
+      m_nGeneration++;
+      m_nMessagesWriting = 0;
+      // bound again once the connection is back, meanwhile unreliable messages take TCP
+      m_bUdpBound = false;
+      if(m_nOwnerType == Owner::Client)
+      {
+        asio::error_code ec;
+        m_udpSocket.close(ec);
+      }
+
+      if(m_nOwnerType == Owner::Client)
+      {
+        // the owner decides whether and when to reconnect, nothing is lost meanwhile
+        if(!m_bClosing && m_onDropped)
+        {
+          m_bSuspended = true;
+          m_onDropped();
+        }
+        return;
+      }
+
+      // give the client a chance to come back before anybody notices
+      if(!m_bClosing && m_nSessionToken && m_session.resumeTimeout.count() && m_pWheel)
+      {
+        SONICPP_LOG_INFO("[" << id << "] Suspended");
+        m_bSuspended = true;
+        Schedule(m_session.resumeTimeout, [](Connection<T>& conn)
+        {
+          // kicked by the server meanwhile
+          if(!conn.m_bSuspended.exchange(false))
+            return;
+          conn.m_qReplay.clear();
+          conn.m_qMessagesIn.push_back({conn.shared_from_this(), Message<T>(system_id<T>(SystemMessage::Disconnected))});
+        });
+        return;
+      }
+
+      // dead clients shouldn't wait for the next broadcast to be noticed,
+      // wake up the server's Update so it kicks the client on its own thread
+      m_qMessagesIn.push_back({this->shared_from_this(), Message<T>(system_id<T>(SystemMessage::Disconnected))});
+    }
+
+    template<typename T>
+    void Connection<T>::Kick()
+    {
+      m_bClosing = true;
+      Drop();
+    }
+
+    template<typename T>
+    void Connection<T>::KeepForReplay(const std::shared_ptr<const Message<T>>& payload)
+    {
+      if(m_nOwnerType != Owner::Server || is_system_id(payload->header.id))
+        return;
+      m_nSequence++;
+      if(m_session.resumeTimeout.count() == 0 || m_session.nReplayMessages == 0)
+        return;
+      m_qReplay.push_back(payload);
+      if(m_qReplay.size() > m_session.nReplayMessages)
+        m_qReplay.pop_front();
+    }
+
+    template<typename T>
+    void Connection<T>::SendSession(bool bResumed, uint64_t nSequence)
+    {
+      // nSequence is the number of messages the client has before this one
+      auto msg = std::make_shared<Message<T>>(system_id<T>(SystemMessage::Session));
+      *msg << id << m_nSessionToken << nSequence << uint8_t(bResumed);
+      QueueOutgoing(msg);
+    }
+
+    template<typename T>
+    bool Connection<T>::Resume(asio::ip::tcp::socket::protocol_type protocol, asio::ip::tcp::socket::native_handle_type handle, uint64_t nReceived)
+    {
+      // the client has to continue where the replay still reaches
+      const uint64_t nFirst = m_nSequence - m_qReplay.size();
+      if(nReceived < nFirst || nReceived > m_nSequence)
+        return false;
+
+      // whoever clears the flag first wins, the expiry or a kick by the server
+      if(!m_bSuspended.exchange(false))
+        return false;
+
+      // take over the new socket, it was released on its own io thread
+      asio::error_code ec;
+      m_socket = asio::ip::tcp::socket(m_executor);
+      m_socket.assign(protocol, handle, ec);
+      if(ec)
+      {
+        // the session can't take the socket, end it now
+        SONICPP_LOG_WARNING("[" << id << "] Resume Failed: " << ec.message());
+        m_qReplay.clear();
+        m_qMessagesIn.push_back({this->shared_from_this(), Message<T>(system_id<T>(SystemMessage::Disconnected))});
+        return false;
+      }
+
+      m_bDropped = false;
+      m_bClosing = false;
+      m_bReadPaused = false;
+      m_nGeneration++;
+
+      // unsent messages are all in the replay, send what the client is missing
+      m_qMessagesOut.clear();
+#ifdef SONICPP_TRACE
+      m_qTraceOut.clear();
+#endif
+      SendSession(true, nReceived);
+      for(size_t i = nReceived - nFirst; i < m_qReplay.size(); ++i)
+      {
+        m_qMessagesOut.push_back(m_qReplay[i]);
+#ifdef SONICPP_TRACE
+        m_qTraceOut.push_back(std::chrono::steady_clock::now());
+#endif
+      }
+      m_metrics.nQueuedOut.store(m_qMessagesOut.size(), std::memory_order_relaxed);
+      SONICPP_LOG_INFO("[" << id << "] Resumed, replaying " << (m_nSequence - nReceived) << " messages");
+
+      StartIdleChecks();
+      StartClockSync();
       ReadHeader();
+      return true;
+    }
+
+    template<typename T>
+    void Connection<T>::Reopen()
+    {
+      m_socket = asio::ip::tcp::socket(m_executor);
+      m_bDropped = false;
+      m_bHandshakeSent = false;
+      m_nMessagesWriting = 0;
+      // without a session the server starts counting from zero again
+      if(m_nSessionToken == 0)
+        m_nSequence = 0;
+    }
+
+    template<typename T>
+    void Connection<T>::ReadSession()
+    {
+      // server pushed id, token, sequence, resumed
+      if(!CheckSystemBody(sizeof(id) + sizeof(m_nSessionToken) + sizeof(uint64_t) + sizeof(uint8_t)))
+        return;
+      uint8_t bResumed;
+      uint64_t nSequence;
+      m_msgTemporaryIn >> bResumed >> nSequence >> m_nSessionToken >> id;
+      m_nSequence = nSequence;
+      m_bResumed = bResumed;
     }
 
     // Encrypt data
@@ -355,19 +1618,35 @@ namespace sonicpp{
     template<typename T>
     void Connection<T>::WriteValidation()
     {
-      asio::async_write(m_socket, asio::buffer(&m_nHandshakeOut, sizeof(m_nHandshakeOut)),
-      [this](std::error_code ec, std::size_t length)
+      // the server sends the challenge, the client its reply
+      auto buffer = m_nOwnerType == Owner::Server ?
+        asio::buffer(&m_nHandshakeOut, sizeof(m_nHandshakeOut)) :
+        asio::buffer(&m_handshakeReply, sizeof(m_handshakeReply));
+
+      asio::async_write(m_socket, buffer,
+      [this, self = this->shared_from_this()](std::error_code ec, std::size_t length)
       {
           if(!ec)
           {
             // Validation sent, clients should sit and wait for a response, or a closure
             if(m_nOwnerType == Owner::Client)
+            {
+              m_nReconnectAttempts = 0;
+              m_bSuspended = false;
+              m_bHandshakeSent = true;
+              StartIdleChecks();
+              StartClockSync();
               ReadHeader();
+
+              // messages sent while connecting or reconnecting
+              if(m_nMessagesWriting == 0 && !m_qMessagesOut.empty())
+                WriteMessages();
+            }
           }
           else
           {
-            std::cout << "[" << id << "] Write Validation Fail!" << std::endl;
-            m_socket.close();
+            SONICPP_LOG_WARNING("[" << id << "] Write Validation Fail!");
+            Drop();
           }
       });
     }
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+namespace sonicpp
+{
+
+  // Copy-on-write list
+  // Readers grab an immutable snapshot without locking and can iterate it
+  // for as long as they hold it, writers copy the current version, modify
+  // the copy and publish it as the new version.
+  // Old versions are reclaimed when the last reader drops its snapshot.
+  template<typename T>
+  class cowlist
+  {
+  public:
+    using snapshot_type = std::shared_ptr<const std::vector<T>>;
+
+  protected:
+    // currently published version
+    std::atomic<snapshot_type> m_current{std::make_shared<const std::vector<T>>()};
+    // serializes writers, readers never touch it
+    std::mutex muxWriters{};
+
+  public:
+    cowlist() = default;
+    cowlist(const cowlist<T>&) = delete;
+
+    // Lock-free read of the current version
+    snapshot_type snapshot() const
+    {
+      return m_current.load(std::memory_order_acquire);
+    }
+
+    size_t count() const
+    {
+      return snapshot()->size();
+    }
+
+    bool is_empty() const
+    {
+      return snapshot()->empty();
+    }
+
+    void push_back(const T& item)
+    {
+      modify([&](std::vector<T>& vec){ vec.push_back(item); });
+    }
+
+    // Remove all occurrences of item, returns true if anything was removed
+    bool erase(const T& item)
+    {
+      bool bRemoved = false;
+      modify([&](std::vector<T>& vec)
+      {
+        auto it = std::remove(vec.begin(), vec.end(), item);
+        bRemoved = it != vec.end();
+        vec.erase(it, vec.end());
+      });
+      return bRemoved;
+    }
+
+    // Remove all items matching the predicate, returns number of removed items
+    template<typename Pred>
+    size_t erase_if(Pred pred)
+    {
+      size_t nRemoved = 0;
+      modify([&](std::vector<T>& vec)
+      {
+        nRemoved = std::erase_if(vec, pred);
+      });
+      return nRemoved;
+    }
+
+    void clear()
+    {
+      std::lock_guard<std::mutex> lock(muxWriters);
+      m_current.store(std::make_shared<const std::vector<T>>(), std::memory_order_release);
+    }
+
+  protected:
+    // Copy the current version, let fn modify it and publish the result
+    template<typename Fn>
+    void modify(Fn fn)
+    {
+      std::lock_guard<std::mutex> lock(muxWriters);
+      auto next = std::make_shared<std::vector<T>>(*m_current.load(std::memory_order_relaxed));
+      fn(*next);
+      m_current.store(std::move(next), std::memory_order_release);
+    }
+  };
+
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include "message.h"
+#include "metrics.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace sonicpp
+{
+
+  // Forward declare the connection
+  template<typename T>
+  class Connection;
+
+  namespace detail
+  {
+    // parameter list of a lambda, functor or function pointer
+    template<typename F>
+    struct callable_args : callable_args<decltype(&F::operator())> {};
+    template<typename R, typename... A>
+    struct callable_args<R(*)(A...)> { using type = std::tuple<A...>; };
+    template<typename C, typename R, typename... A>
+    struct callable_args<R(C::*)(A...)> { using type = std::tuple<A...>; };
+    template<typename C, typename R, typename... A>
+    struct callable_args<R(C::*)(A...) const> { using type = std::tuple<A...>; };
+
+    // Takes the bytes of one payload off the end of the nLeft bytes still unread,
+    // false if the body is too short for it
+    template<typename P>
+    struct payload_size
+    {
+      static bool consume(const uint8_t*, size_t& nLeft)
+      {
+        if(nLeft < sizeof(P))
+          return false;
+        nLeft -= sizeof(P);
+        return true;
+      }
+    };
+
+    // strings and vectors end with their element count
+    template<typename Type>
+    struct payload_size<std::vector<Type>>
+    {
+      static bool consume(const uint8_t* pBody, size_t& nLeft)
+      {
+        using size_type = typename std::vector<Type>::size_type;
+        if(nLeft < sizeof(size_type))
+          return false;
+        size_type nCount;
+        std::memcpy(&nCount, pBody + nLeft - sizeof(size_type), sizeof(size_type));
+        nLeft -= sizeof(size_type);
+        if(nCount > nLeft / sizeof(Type))
+          return false;
+        nLeft -= nCount * sizeof(Type);
+        return true;
+      }
+    };
+
+    template<>
+    struct payload_size<std::string> : payload_size<std::vector<char>> {};
+  }
+
+  // Table of message handlers indexed by the message id
+  // A handler is bound to an id at compile time and declares what it wants:
+  //   (client, Message<T>&)       - the raw message
+  //   (client, Payload, ...)      - payloads extracted in parameter order
+  //   (Payload, ...)              - same without the client
+  // Each entry is one function pointer with the extraction compiled in,
+  // dispatching is a single indexed call instead of a virtual call and a switch.
+  // A message whose body doesn't hold exactly the payloads is dropped and
+  // counted as malformed instead of reaching the handler.
+  // Ids must be smaller than COUNT.
+  template<typename T, size_t COUNT = 64>
+  class Dispatcher
+  {
+  public:
+    using ClientPtr = std::shared_ptr<Connection<T>>;
+
+  protected:
+    struct Entry
+    {
+      // false if the message was malformed
+      bool (*thunk)(void*, const ClientPtr&, Message<T>&) = nullptr;
+      // the handler object, owned type erased
+      std::shared_ptr<void> fn{};
+      // number of messages handled, per type hook for metrics
+      uint64_t nCalls = 0;
+      uint64_t nMalformed = 0;
+    };
+
+    std::array<Entry, COUNT> m_table{};
+    counter* m_pMalformed = nullptr;
+
+  public:
+    Dispatcher() = default;
+    // malformed messages are also added to pMalformed, e.g. of a MetricsRegistry
+    explicit Dispatcher(counter* pMalformed) : m_pMalformed(pMalformed) {}
+
+    template<T ID, typename F>
+    void On(F&& fn)
+    {
+      constexpr size_t nIndex = static_cast<size_t>(ID);
+      static_assert(nIndex < COUNT, "Message id is outside of the dispatch table, raise COUNT");
+
+      using Fn = std::decay_t<F>;
+      Entry& entry = m_table[nIndex];
+      entry.fn = std::make_shared<Fn>(std::forward<F>(fn));
+      entry.thunk = &Thunk<Fn>;
+      entry.nCalls = 0;
+      entry.nMalformed = 0;
+    }
+
+    template<T ID>
+    void Remove()
+    {
+      static_assert(static_cast<size_t>(ID) < COUNT, "Message id is outside of the dispatch table, raise COUNT");
+      m_table[static_cast<size_t>(ID)] = Entry{};
+    }
+
+    // Returns false if no handler is registered for the message's id,
+    // a malformed message counts as handled
+    bool Dispatch(const ClientPtr& client, Message<T>& msg)
+    {
+      size_t nIndex = static_cast<size_t>(msg.GetType());
+      if(nIndex >= COUNT || !m_table[nIndex].thunk)
+        return false;
+
+      Entry& entry = m_table[nIndex];
+      entry.nCalls++;
+      if(!entry.thunk(entry.fn.get(), client, msg))
+      {
+        entry.nMalformed++;
+        if(m_pMalformed)
+          m_pMalformed->add();
+      }
+      return true;
+    }
+
+    uint64_t Calls(T id) const
+    {
+      size_t nIndex = static_cast<size_t>(id);
+      return nIndex < COUNT ? m_table[nIndex].nCalls : 0;
+    }
+
+    uint64_t Malformed(T id) const
+    {
+      size_t nIndex = static_cast<size_t>(id);
+      return nIndex < COUNT ? m_table[nIndex].nMalformed : 0;
+    }
+
+  protected:
+    template<typename Fn>
+    static bool Thunk(void* pFn, const ClientPtr& client, Message<T>& msg)
+    {
+      return Invoke(*static_cast<Fn*>(pFn), client, msg, static_cast<typename detail::callable_args<Fn>::type*>(nullptr));
+    }
+
+    template<typename... A>
+    static constexpr bool is_raw()
+    {
+      if constexpr(sizeof...(A) == 2)
+        return std::is_same_v<std::tuple_element_t<1, std::tuple<A...>>, Message<T>&>;
+      return false;
+    }
+
+    template<typename... A>
+    static constexpr bool wants_client()
+    {
+      if constexpr(sizeof...(A) > 0)
+        return std::is_same_v<std::decay_t<std::tuple_element_t<0, std::tuple<A...>>>, ClientPtr>;
+      return false;
+    }
+
+    template<typename Fn, typename... A>
+    static bool Invoke(Fn& fn, const ClientPtr& client, Message<T>& msg, std::tuple<A...>*)
+    {
+      using Args = std::tuple<std::decay_t<A>...>;
+      if constexpr(is_raw<A...>())
+      {
+        fn(client, msg);
+        return true;
+      }
+      else if constexpr(wants_client<A...>())
+        return Extract<Args, 1>(msg, std::make_index_sequence<sizeof...(A) - 1>{}, [&](auto&... payload){ fn(client, payload...); });
+      else
+        return Extract<Args, 0>(msg, std::make_index_sequence<sizeof...(A)>{}, [&](auto&... payload){ fn(payload...); });
+    }
+
+    // payloads are the parameters of Args from OFFSET on, read in parameter order
+    // off the end of the body, which has to hold them exactly
+    template<typename Args, size_t OFFSET, size_t... I, typename Call>
+    static bool Extract(Message<T>& msg, std::index_sequence<I...>, Call&& call)
+    {
+      size_t nLeft = msg.body.size();
+      if(!(detail::payload_size<std::tuple_element_t<I + OFFSET, Args>>::consume(msg.body.data(), nLeft) && ...) || nLeft != 0)
+        return false;
+
+      std::tuple<std::tuple_element_t<I + OFFSET, Args>...> payload{};
+      std::apply([&](auto&... p){ (msg >> ... >> p); call(p...); }, payload);
+      return true;
+    }
+  };
+
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+
+namespace sonicpp
+{
+
+  // Slot in the low half, generation of the slot in the high half, so a
+  // handle kept past destroy() never reaches the group reusing its slot
+  using GroupID = uint64_t;
+
+  // Set of groups of items identified by a numeric key
+  // Members of every group are stored densely so iterating a group touches
+  // a single contiguous array, join and leave are O(1) using swap-remove.
+  // Not thread safe, the owner is expected to guard it.
+  template<typename T>
+  class groupset
+  {
+  protected:
+    struct Group
+    {
+      bool bAlive = false;
+      // bumped on destroy, zero is never handed out
+      uint32_t nGeneration = 1;
+      // dense members, iterated on every group broadcast
+      std::vector<T> vMembers{};
+      // member key -> position in vMembers
+      std::vector<uint32_t> vKeys{};
+      std::unordered_map<uint32_t, uint32_t> mapIndex{};
+    };
+
+    std::vector<Group> m_vGroups{};
+    // destroyed group slots ready for reuse
+    std::vector<uint32_t> m_vFreeSlots{};
+    // key -> groups it is a member of, used to leave all groups at once
+    std::unordered_map<uint32_t, std::vector<GroupID>> m_mapMemberships{};
+
+  public:
+    GroupID create()
+    {
+      uint32_t nSlot;
+      if(!m_vFreeSlots.empty())
+      {
+        nSlot = m_vFreeSlots.back();
+        m_vFreeSlots.pop_back();
+      }
+      else
+      {
+        nSlot = m_vGroups.size();
+        m_vGroups.emplace_back();
+      }
+      m_vGroups[nSlot].bAlive = true;
+      return make_id(nSlot, m_vGroups[nSlot].nGeneration);
+    }
+
+    void destroy(GroupID group)
+    {
+      if(!exists(group))
+        return;
+
+      Group& g = m_vGroups[slot(group)];
+      for(uint32_t key : g.vKeys)
+        forget(key, group);
+
+      const uint32_t nGeneration = g.nGeneration + 1;
+      g = Group{};
+      g.nGeneration = nGeneration ? nGeneration : 1;
+      m_vFreeSlots.push_back(slot(group));
+    }
+
+    // false for ids of destroyed groups, also once their slot is reused
+    bool exists(GroupID group) const
+    {
+      const uint32_t nSlot = slot(group);
+      return nSlot < m_vGroups.size() && m_vGroups[nSlot].bAlive && m_vGroups[nSlot].nGeneration == generation(group);
+    }
+
+    // returns false if the group doesn't exist or key already is a member
+    bool join(GroupID group, uint32_t key, const T& item)
+    {
+      if(!exists(group))
+        return false;
+
+      Group& g = m_vGroups[slot(group)];
+      if(!g.mapIndex.emplace(key, g.vMembers.size()).second)
+        return false;
+
+      g.vMembers.push_back(item);
+      g.vKeys.push_back(key);
+      m_mapMemberships[key].push_back(group);
+      return true;
+    }
+
+    bool leave(GroupID group, uint32_t key)
+    {
+      if(!exists(group) || !remove(m_vGroups[slot(group)], key))
+        return false;
+
+      forget(key, group);
+      return true;
+    }
+
+    // Leave every group key is a member of
+    void leave_all(uint32_t key)
+    {
+      auto it = m_mapMemberships.find(key);
+      if(it == m_mapMemberships.end())
+        return;
+
+      for(GroupID group : it->second)
+        remove(m_vGroups[slot(group)], key);
+      m_mapMemberships.erase(it);
+    }
+
+    const std::vector<T>& members(GroupID group) const
+    {
+      static const std::vector<T> empty{};
+      return exists(group) ? m_vGroups[slot(group)].vMembers : empty;
+    }
+
+  protected:
+    static GroupID make_id(uint32_t nSlot, uint32_t nGeneration)
+    {
+      return (GroupID(nGeneration) << 32) | nSlot;
+    }
+
+    static uint32_t slot(GroupID group)
+    {
+      return uint32_t(group);
+    }
+
+    static uint32_t generation(GroupID group)
+    {
+      return uint32_t(group >> 32);
+    }
+
+    // swap the member with the last one and pop it
+    static bool remove(Group& g, uint32_t key)
+    {
+      auto it = g.mapIndex.find(key);
+      if(it == g.mapIndex.end())
+        return false;
+
+      uint32_t nIndex = it->second;
+      g.mapIndex.erase(it);
+      if(nIndex != g.vMembers.size() - 1)
+      {
+        g.vMembers[nIndex] = std::move(g.vMembers.back());
+        g.vKeys[nIndex] = g.vKeys.back();
+        g.mapIndex[g.vKeys[nIndex]] = nIndex;
+      }
+      g.vMembers.pop_back();
+      g.vKeys.pop_back();
+      return true;
+    }
+
+    void forget(uint32_t key, GroupID group)
+    {
+      auto it = m_mapMemberships.find(key);
+      if(it == m_mapMemberships.end())
+        return;
+
+      auto& groups = it->second;
+      std::erase(groups, group);
+      if(groups.empty())
+        m_mapMemberships.erase(it);
+    }
+  };
+
+}
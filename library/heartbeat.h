@@ -0,0 +1,21 @@
+#pragma once
+
+#include <chrono>
+
+
+namespace sonicpp
+{
+
+  // Heartbeats and idle timeouts of a connection, zero disables the given check
+  // Both sides should send heartbeats more often than the other side's read timeout
+  struct HeartbeatConfig
+  {
+    // send a heartbeat when nothing was written for this long
+    std::chrono::milliseconds interval{0};
+    // disconnect when nothing was read for this long
+    std::chrono::milliseconds readTimeout{0};
+    // disconnect when a write doesn't complete in this time
+    std::chrono::milliseconds writeTimeout{0};
+  };
+
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <optional>
+#include <utility>
+
+
+namespace sonicpp
+{
+
+  struct InterpolationConfig
+  {
+    // states are shown this far in the past, should cover the update
+    // interval plus the jitter, larger is smoother but lags behind more
+    std::chrono::milliseconds delay{100};
+    // past the newest state the motion continues for at most this long, then stops
+    std::chrono::milliseconds maxExtrapolation{50};
+    // states kept, older ones are dropped when a burst arrives
+    size_t nCapacity = 32;
+  };
+
+  // Blends two states, uses lerp(a, b, t) found by ADL when State has one,
+  // a + (b - a) * t otherwise. t can exceed 1 when extrapolating.
+  struct linear_interpolation
+  {
+    template<typename State>
+    State operator()(const State& a, const State& b, float t) const
+    {
+      if constexpr(requires { lerp(a, b, t); })
+        return lerp(a, b, t);
+      else
+        return a + (b - a) * t;
+    }
+  };
+
+  // Jitter buffer of one entity's states
+  // States are stamped when they arrive and rendered delay later, in between
+  // two received states the state is interpolated, so an entity moves evenly
+  // however unevenly its updates arrive. When updates stop it is extrapolated
+  // from the last two states for a bounded time and then held.
+  template<typename State, typename Interpolate = linear_interpolation>
+  class interpolation_buffer
+  {
+  public:
+    using clock = std::chrono::steady_clock;
+
+  protected:
+    struct entry
+    {
+      clock::time_point tp;
+      State state;
+    };
+
+    InterpolationConfig m_config;
+    Interpolate m_interpolate;
+    std::deque<entry> m_qSamples;
+
+  public:
+    explicit interpolation_buffer(const InterpolationConfig& config = {}, Interpolate interpolate = {})
+      : m_config(config), m_interpolate(std::move(interpolate))
+    {}
+
+    // tp is when the state was valid, its arrival unless the sender stamps it
+    void push(const State& state, clock::time_point tp = clock::now())
+    {
+      // reordered or duplicate, the newer state already arrived
+      if(!m_qSamples.empty() && tp <= m_qSamples.back().tp)
+        return;
+      m_qSamples.push_back({tp, state});
+      if(m_qSamples.size() > std::max<size_t>(2, m_config.nCapacity))
+        m_qSamples.pop_front();
+    }
+
+    // State to render at now, empty until the first state arrived
+    std::optional<State> sample(clock::time_point now = clock::now())
+    {
+      if(m_qSamples.empty())
+        return std::nullopt;
+
+      clock::time_point tpRender = now - m_config.delay;
+
+      // only one state older than the render time is ever needed again
+      while(m_qSamples.size() > 2 && m_qSamples[1].tp <= tpRender)
+        m_qSamples.pop_front();
+
+      const entry& a = m_qSamples.front();
+      if(m_qSamples.size() == 1 || tpRender <= a.tp)
+        return a.state;
+
+      const entry& b = m_qSamples[1];
+      if(tpRender > b.tp)
+      {
+        // out of states, keep going the way the last two went
+        tpRender = std::min(tpRender, b.tp + std::chrono::duration_cast<clock::duration>(m_config.maxExtrapolation));
+      }
+      return m_interpolate(a.state, b.state, fraction(a.tp, b.tp, tpRender));
+    }
+
+    // The newest state received, e.g. for logic that mustn't lag behind
+    std::optional<State> latest() const
+    {
+      if(m_qSamples.empty())
+        return std::nullopt;
+      return m_qSamples.back().state;
+    }
+
+    size_t size() const { return m_qSamples.size(); }
+    void clear() { m_qSamples.clear(); }
+
+  protected:
+    static float fraction(clock::time_point a, clock::time_point b, clock::time_point t)
+    {
+      return std::chrono::duration<float>(t - a).count() / std::chrono::duration<float>(b - a).count();
+    }
+  };
+
+}
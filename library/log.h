@@ -0,0 +1,235 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string_view>
+#include <thread>
+
+// Levels below this are compiled out entirely:
+// 0 - trace, 1 - debug, 2 - info, 3 - warning, 4 - error, 5 - off
+#ifndef SONICPP_LOG_LEVEL
+#define SONICPP_LOG_LEVEL 2
+#endif
+
+
+namespace sonicpp
+{
+
+  enum class LogLevel : int
+  {
+    Trace,
+    Debug,
+    Info,
+    Warning,
+    Error,
+    Off
+  };
+
+  constexpr LogLevel LOG_COMPILED_LEVEL = static_cast<LogLevel>(SONICPP_LOG_LEVEL);
+
+  // Asynchronous logger
+  // Lines are formatted by the caller into a fixed size slot of a lock-free
+  // ring, a background thread writes them out, so io threads never wait on
+  // console or file I/O. When the ring is full the line is dropped and counted.
+  class logger
+  {
+  public:
+    static constexpr size_t CAPACITY = 1024;
+    static constexpr size_t LINE_LENGTH = 256 - sizeof(size_t) - sizeof(LogLevel) - sizeof(uint16_t);
+
+  protected:
+    struct slot
+    {
+      // bounded MPMC ring (D. Vyukov), the sequence tells whose turn the slot is
+      std::atomic<size_t> seq;
+      LogLevel level;
+      uint16_t nLength;
+      char text[LINE_LENGTH];
+    };
+
+    std::unique_ptr<slot[]> m_slots;
+    alignas(64) std::atomic<size_t> m_nHead{0};
+    // only the background thread moves the tail
+    alignas(64) std::atomic<size_t> m_nTail{0};
+    std::atomic<LogLevel> m_level{LOG_COMPILED_LEVEL};
+    std::atomic<uint64_t> m_nDropped{0};
+
+    std::atomic<bool> m_bSleeping{false};
+    std::atomic<uint32_t> m_nWake{0};
+    // set at exit, later lines are written right away
+    std::atomic<bool> m_bSynchronous{false};
+    std::atomic<std::FILE*> m_pOut{stdout};
+    std::atomic<std::FILE*> m_pErr{stderr};
+
+    logger() : m_slots(new slot[CAPACITY])
+    {
+      for(size_t i = 0; i < CAPACITY; ++i)
+        m_slots[i].seq.store(i, std::memory_order_relaxed);
+      std::thread([this](){ Run(); }).detach();
+      // never destroyed, servers logging from static destructors must not outlive it
+      std::atexit([](){ instance().exit(); });
+    }
+
+  public:
+    static logger& instance()
+    {
+      static logger* log = new logger();
+      return *log;
+    }
+
+    logger(const logger&) = delete;
+
+    // Runtime filter on top of SONICPP_LOG_LEVEL
+    void set_level(LogLevel level)
+    {
+      m_level.store(level, std::memory_order_relaxed);
+    }
+
+    bool enabled(LogLevel level) const
+    {
+      return level >= m_level.load(std::memory_order_relaxed);
+    }
+
+    // Redirect output, warnings and errors go to err
+    void set_output(std::FILE* out, std::FILE* err)
+    {
+      flush();
+      m_pOut.store(out);
+      m_pErr.store(err);
+    }
+
+    uint64_t dropped() const
+    {
+      return m_nDropped.load(std::memory_order_relaxed);
+    }
+
+    // Never blocks, lines longer than LINE_LENGTH are truncated
+    void write(LogLevel level, std::string_view text)
+    {
+      if(m_bSynchronous.load(std::memory_order_acquire))
+      {
+        Print(level, text);
+        return;
+      }
+
+      size_t nPos = m_nHead.load(std::memory_order_relaxed);
+      slot* s;
+      while(true)
+      {
+        s = &m_slots[nPos % CAPACITY];
+        size_t seq = s->seq.load(std::memory_order_acquire);
+        if(seq == nPos)
+        {
+          if(m_nHead.compare_exchange_weak(nPos, nPos + 1, std::memory_order_relaxed))
+            break;
+        }
+        else if(seq < nPos)
+        {
+          // consumer is a whole lap behind
+          m_nDropped.fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+        else
+          nPos = m_nHead.load(std::memory_order_relaxed);
+      }
+
+      s->level = level;
+      s->nLength = uint16_t(std::min(text.size(), LINE_LENGTH));
+      std::memcpy(s->text, text.data(), s->nLength);
+      s->seq.store(nPos + 1, std::memory_order_seq_cst);
+
+      // pairs with the check in Run(), the consumer can't fall asleep on this line
+      if(m_bSleeping.load(std::memory_order_seq_cst))
+      {
+        m_nWake.fetch_add(1, std::memory_order_release);
+        m_nWake.notify_one();
+      }
+    }
+
+    // Wait until everything logged so far is written
+    void flush()
+    {
+      size_t nTarget = m_nHead.load(std::memory_order_acquire);
+      while(m_nTail.load(std::memory_order_acquire) < nTarget)
+        std::this_thread::yield();
+    }
+
+  protected:
+    void exit()
+    {
+      flush();
+      m_bSynchronous.store(true, std::memory_order_release);
+      // lines that raced with the switch
+      flush();
+    }
+
+    bool Pending() const
+    {
+      size_t nTail = m_nTail.load(std::memory_order_relaxed);
+      return m_slots[nTail % CAPACITY].seq.load(std::memory_order_seq_cst) == nTail + 1;
+    }
+
+    void Print(LogLevel level, std::string_view text)
+    {
+      std::FILE* out = level >= LogLevel::Warning ? m_pErr.load() : m_pOut.load();
+      std::fwrite(text.data(), 1, text.size(), out);
+      std::fputc('\n', out);
+    }
+
+    void Run()
+    {
+      while(true)
+      {
+        size_t nTail = m_nTail.load(std::memory_order_relaxed);
+        slot& s = m_slots[nTail % CAPACITY];
+        if(s.seq.load(std::memory_order_acquire) == nTail + 1)
+        {
+          Print(s.level, std::string_view(s.text, s.nLength));
+          s.seq.store(nTail + CAPACITY, std::memory_order_release);
+          m_nTail.store(nTail + 1, std::memory_order_release);
+          continue;
+        }
+
+        // ring drained, one flush per burst instead of one per line
+        std::fflush(m_pOut.load());
+        std::fflush(m_pErr.load());
+
+        uint32_t nWake = m_nWake.load(std::memory_order_acquire);
+        m_bSleeping.store(true, std::memory_order_seq_cst);
+        if(!Pending())
+          m_nWake.wait(nWake, std::memory_order_acquire);
+        m_bSleeping.store(false, std::memory_order_relaxed);
+      }
+    }
+  };
+
+}
+
+// Usage: SONICPP_LOG(Info, "[" << id << "] Connected");
+// Statements below SONICPP_LOG_LEVEL are discarded at compile time,
+// the message expression is only evaluated when the level is enabled
+#define SONICPP_LOG(LEVEL, EXPR) \
+  do { \
+    if constexpr(::sonicpp::LogLevel::LEVEL >= ::sonicpp::LOG_COMPILED_LEVEL) \
+    { \
+      auto& sonicpp_logger = ::sonicpp::logger::instance(); \
+      if(sonicpp_logger.enabled(::sonicpp::LogLevel::LEVEL)) \
+      { \
+        std::ostringstream sonicpp_os; \
+        sonicpp_os << EXPR; \
+        sonicpp_logger.write(::sonicpp::LogLevel::LEVEL, sonicpp_os.view()); \
+      } \
+    } \
+  } while(0)
+
+#define SONICPP_LOG_TRACE(EXPR) SONICPP_LOG(Trace, EXPR)
+#define SONICPP_LOG_DEBUG(EXPR) SONICPP_LOG(Debug, EXPR)
+#define SONICPP_LOG_INFO(EXPR) SONICPP_LOG(Info, EXPR)
+#define SONICPP_LOG_WARNING(EXPR) SONICPP_LOG(Warning, EXPR)
+#define SONICPP_LOG_ERROR(EXPR) SONICPP_LOG(Error, EXPR)
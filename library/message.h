@@ -6,11 +6,46 @@
 #include <iostream>
 #include <asio.hpp>
 #include <chrono>
+#include <limits>
 #include <type_traits>
 
 
 namespace sonicpp
 {
+  // Message ids used internally by the library, they are counted down from
+  // the largest value of the user's id type and never reach OnMessage
+  enum class SystemMessage : uint32_t
+  {
+    Heartbeat,
+    // queued locally by a server connection that died, never sent
+    Disconnected,
+    // session token and id, sent by the server after validation
+    Session,
+    // clock exchange, request carries the sender's time, the answer adds the receiver's
+    ClockRequest,
+    ClockResponse,
+    // datagram channel, the server offers a token and port over TCP, the client
+    // sends the token back over UDP until the server confirms with UdpBound
+    UdpBind,
+    UdpBound,
+    // number of reserved ids, keep last
+    Reserved = 16
+  };
+
+  template<typename T>
+  constexpr T system_id(SystemMessage sys)
+  {
+    using U = std::underlying_type_t<T>;
+    return static_cast<T>(std::numeric_limits<U>::max() - static_cast<U>(sys));
+  }
+
+  template<typename T>
+  constexpr bool is_system_id(T id)
+  {
+    using U = std::underlying_type_t<T>;
+    return static_cast<U>(id) > std::numeric_limits<U>::max() - static_cast<U>(SystemMessage::Reserved);
+  }
+
   template <typename T>
   struct message_header
   {
@@ -183,11 +218,23 @@ namespace sonicpp
   template<typename T>
   class Connection;
   
+#ifdef SONICPP_TRACE
+  // Timestamps of a received message, see MessageTracer
+  struct message_trace
+  {
+    std::chrono::steady_clock::time_point tpHeader{};
+    std::chrono::steady_clock::time_point tpQueued{};
+  };
+#endif
+
   template<typename T>
   struct owned_message
   {
     std::shared_ptr<Connection<T>> remote = nullptr;
     Message<T> msg;
+#ifdef SONICPP_TRACE
+    message_trace trace{};
+#endif
     
     // overloaf print message
     friend std::ostream& operator<<(std::ostream& os, const owned_message<T>& msg)
@@ -0,0 +1,436 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <asio.hpp>
+
+
+namespace sonicpp
+{
+
+  // Counter sharded per thread, writers on different threads never share
+  // a cache line, reading sums all the shards
+  class counter
+  {
+  public:
+    static constexpr size_t SHARDS = 16;
+
+  protected:
+    struct alignas(64) shard
+    {
+      std::atomic<uint64_t> value{0};
+    };
+    std::array<shard, SHARDS> m_shards{};
+
+    static size_t thread_slot()
+    {
+      static std::atomic<size_t> nNext{0};
+      thread_local size_t nSlot = nNext.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+      return nSlot;
+    }
+
+  public:
+    void add(uint64_t n = 1)
+    {
+      m_shards[thread_slot()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t load() const
+    {
+      uint64_t nSum = 0;
+      for(const auto& s : m_shards)
+        nSum += s.value.load(std::memory_order_relaxed);
+      return nSum;
+    }
+  };
+
+  // HDR style histogram of integer values (microseconds for latencies)
+  // Values below 16 are exact, above that every power of two range is split
+  // into 16 linear buckets, so any recorded value is within ~6% of its bucket
+  class histogram
+  {
+  public:
+    static constexpr unsigned SUB_BITS = 4;
+    static constexpr size_t SUB_COUNT = size_t(1) << SUB_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+  protected:
+    std::array<std::atomic<uint64_t>, BUCKETS> m_buckets{};
+    std::atomic<uint64_t> m_nCount{0};
+    std::atomic<uint64_t> m_nMax{0};
+
+  public:
+    static size_t index_of(uint64_t v)
+    {
+      if(v < SUB_COUNT)
+        return v;
+      unsigned nShift = std::bit_width(v) - 1 - SUB_BITS;
+      return ((nShift + 1) << SUB_BITS) + ((v >> nShift) - SUB_COUNT);
+    }
+
+    // lowest value that falls into the bucket
+    static uint64_t value_of(size_t idx)
+    {
+      if(idx < SUB_COUNT)
+        return idx;
+      unsigned nShift = (idx >> SUB_BITS) - 1;
+      return ((idx & (SUB_COUNT - 1)) + SUB_COUNT) << nShift;
+    }
+
+    void record(uint64_t v)
+    {
+      m_buckets[index_of(v)].fetch_add(1, std::memory_order_relaxed);
+      m_nCount.fetch_add(1, std::memory_order_relaxed);
+      uint64_t nMax = m_nMax.load(std::memory_order_relaxed);
+      while(v > nMax && !m_nMax.compare_exchange_weak(nMax, v, std::memory_order_relaxed));
+    }
+
+    uint64_t count() const { return m_nCount.load(std::memory_order_relaxed); }
+    uint64_t max() const { return m_nMax.load(std::memory_order_relaxed); }
+
+    // p in [0, 1]
+    uint64_t percentile(double p) const
+    {
+      uint64_t nTotal = count();
+      if(nTotal == 0)
+        return 0;
+      uint64_t nRank = std::max<uint64_t>(1, uint64_t(p * nTotal + 0.5));
+      uint64_t nSeen = 0;
+      for(size_t i = 0; i < BUCKETS; ++i)
+      {
+        nSeen += m_buckets[i].load(std::memory_order_relaxed);
+        if(nSeen >= nRank)
+          return std::min(value_of(i), max());
+      }
+      return max();
+    }
+  };
+
+  // message types above this are counted together in the last slot
+  static constexpr size_t METRICS_MAX_TYPES = 64;
+
+#ifdef SONICPP_TRACE
+  // Stages of a message's life measured by the tracer
+  enum class TraceStage : size_t
+  {
+    // header read completed until the whole message is read, includes rate limit pauses
+    Read,
+    // waiting in the incoming queue for Update
+    Queue,
+    // inside OnMessage
+    Handler,
+    // waiting in the connection's outgoing queue
+    OutQueue,
+    // write started until the kernel took all of it
+    Write,
+    Count
+  };
+
+  // Latency histograms (microseconds) per stage, overall and per message type
+  // Only compiled with SONICPP_TRACE defined, otherwise nothing is stamped or stored
+  class MessageTracer
+  {
+  public:
+    static constexpr size_t STAGES = static_cast<size_t>(TraceStage::Count);
+
+  protected:
+    std::array<histogram, STAGES> m_stages{};
+    // allocated on first use, most types never show up in most stages
+    std::array<std::array<std::atomic<histogram*>, METRICS_MAX_TYPES>, STAGES> m_byType{};
+
+  public:
+    MessageTracer() = default;
+    MessageTracer(const MessageTracer&) = delete;
+
+    ~MessageTracer()
+    {
+      for(auto& stage : m_byType)
+        for(auto& h : stage)
+          delete h.load();
+    }
+
+    void record(TraceStage stage, size_t nTypeSlot, std::chrono::steady_clock::duration elapsed)
+    {
+      uint64_t nUs = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+      size_t s = static_cast<size_t>(stage);
+      m_stages[s].record(nUs);
+
+      auto& slot = m_byType[s][nTypeSlot];
+      histogram* h = slot.load(std::memory_order_acquire);
+      if(!h)
+      {
+        histogram* fresh = new histogram();
+        if(slot.compare_exchange_strong(h, fresh, std::memory_order_acq_rel))
+          h = fresh;
+        else
+          delete fresh;
+      }
+      h->record(nUs);
+    }
+
+    std::string Report() const
+    {
+      static const char* names[STAGES] = {"read", "queue", "handler", "out_queue", "write"};
+      std::ostringstream os;
+      auto line = [&os](const histogram& h)
+      {
+        os << " n=" << h.count() << " p50=" << h.percentile(0.50) << " p90=" << h.percentile(0.90)
+           << " p99=" << h.percentile(0.99) << " max=" << h.max() << "\n";
+      };
+      for(size_t s = 0; s < STAGES; ++s)
+      {
+        os << names[s] << "_us";
+        line(m_stages[s]);
+        for(size_t t = 0; t < METRICS_MAX_TYPES; ++t)
+          if(const histogram* h = m_byType[s][t].load(std::memory_order_acquire))
+          {
+            os << names[s] << "_us{type=" << t << "}";
+            line(*h);
+          }
+      }
+      return os.str();
+    }
+  };
+#endif
+
+  // Counters shared by all connections of a server or a client
+  struct MetricsRegistry
+  {
+    static constexpr size_t MAX_TYPES = METRICS_MAX_TYPES;
+
+    counter bytesIn{};
+    counter bytesOut{};
+    counter messagesIn{};
+    counter messagesOut{};
+    counter handshakeFailures{};
+    counter connectionsAccepted{};
+    counter connectionsDropped{};
+    counter rateLimited{};
+    // dropped by a Dispatcher, the body didn't hold the handler's payloads
+    counter malformed{};
+    std::array<std::atomic<uint64_t>, MAX_TYPES> messagesInByType{};
+    std::array<std::atomic<uint64_t>, MAX_TYPES> messagesOutByType{};
+    // time from starting a write until the kernel took all of it
+    histogram writeLatencyUs{};
+#ifdef SONICPP_TRACE
+    MessageTracer tracer{};
+#endif
+
+    template<typename T>
+    static size_t type_slot(T id)
+    {
+      return std::min<size_t>(static_cast<size_t>(id), MAX_TYPES - 1);
+    }
+  };
+
+  // Counters of a single connection, written only from its io thread
+  struct ConnectionMetrics
+  {
+    std::atomic<uint64_t> nBytesIn{0};
+    std::atomic<uint64_t> nBytesOut{0};
+    std::atomic<uint64_t> nMessagesIn{0};
+    std::atomic<uint64_t> nMessagesOut{0};
+    std::atomic<size_t> nQueuedOut{0};
+
+    static void bump(std::atomic<uint64_t>& value, uint64_t n)
+    {
+      value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+  };
+
+  // Plain copy of the metrics at one point in time
+  struct MetricsSnapshot
+  {
+    struct ConnectionEntry
+    {
+      uint32_t id;
+      uint64_t nBytesIn, nBytesOut, nMessagesIn, nMessagesOut;
+      size_t nQueuedOut;
+    };
+
+    uint64_t nBytesIn = 0, nBytesOut = 0;
+    uint64_t nMessagesIn = 0, nMessagesOut = 0;
+    uint64_t nHandshakeFailures = 0;
+    uint64_t nConnectionsAccepted = 0, nConnectionsDropped = 0;
+    uint64_t nRateLimited = 0;
+    uint64_t nMalformed = 0;
+    size_t nQueuedIn = 0;
+    std::vector<std::pair<size_t, uint64_t>> vMessagesInByType{};
+    std::vector<std::pair<size_t, uint64_t>> vMessagesOutByType{};
+    uint64_t nWriteLatencyP50Us = 0, nWriteLatencyP99Us = 0, nWriteLatencyMaxUs = 0;
+    std::vector<ConnectionEntry> vConnections{};
+
+    static MetricsSnapshot From(const MetricsRegistry& reg)
+    {
+      MetricsSnapshot snap;
+      snap.nBytesIn = reg.bytesIn.load();
+      snap.nBytesOut = reg.bytesOut.load();
+      snap.nMessagesIn = reg.messagesIn.load();
+      snap.nMessagesOut = reg.messagesOut.load();
+      snap.nHandshakeFailures = reg.handshakeFailures.load();
+      snap.nConnectionsAccepted = reg.connectionsAccepted.load();
+      snap.nConnectionsDropped = reg.connectionsDropped.load();
+      snap.nRateLimited = reg.rateLimited.load();
+      snap.nMalformed = reg.malformed.load();
+      for(size_t i = 0; i < MetricsRegistry::MAX_TYPES; ++i)
+      {
+        if(auto n = reg.messagesInByType[i].load(std::memory_order_relaxed))
+          snap.vMessagesInByType.emplace_back(i, n);
+        if(auto n = reg.messagesOutByType[i].load(std::memory_order_relaxed))
+          snap.vMessagesOutByType.emplace_back(i, n);
+      }
+      snap.nWriteLatencyP50Us = reg.writeLatencyUs.percentile(0.50);
+      snap.nWriteLatencyP99Us = reg.writeLatencyUs.percentile(0.99);
+      snap.nWriteLatencyMaxUs = reg.writeLatencyUs.max();
+      return snap;
+    }
+
+    void AddConnection(uint32_t id, const ConnectionMetrics& m)
+    {
+      vConnections.push_back({id,
+        m.nBytesIn.load(std::memory_order_relaxed), m.nBytesOut.load(std::memory_order_relaxed),
+        m.nMessagesIn.load(std::memory_order_relaxed), m.nMessagesOut.load(std::memory_order_relaxed),
+        m.nQueuedOut.load(std::memory_order_relaxed)});
+    }
+
+    std::string ToText() const
+    {
+      std::ostringstream os;
+      os << "bytes_in " << nBytesIn << "\n"
+         << "bytes_out " << nBytesOut << "\n"
+         << "messages_in " << nMessagesIn << "\n"
+         << "messages_out " << nMessagesOut << "\n"
+         << "handshake_failures " << nHandshakeFailures << "\n"
+         << "connections_accepted " << nConnectionsAccepted << "\n"
+         << "connections_dropped " << nConnectionsDropped << "\n"
+         << "rate_limited " << nRateLimited << "\n"
+         << "malformed " << nMalformed << "\n"
+         << "queued_in " << nQueuedIn << "\n"
+         << "write_latency_us p50=" << nWriteLatencyP50Us << " p99=" << nWriteLatencyP99Us << " max=" << nWriteLatencyMaxUs << "\n";
+      for(auto [type, n] : vMessagesInByType)
+        os << "messages_in{type=" << type << "} " << n << "\n";
+      for(auto [type, n] : vMessagesOutByType)
+        os << "messages_out{type=" << type << "} " << n << "\n";
+      for(const auto& c : vConnections)
+        os << "connection{id=" << c.id << "} bytes_in=" << c.nBytesIn << " bytes_out=" << c.nBytesOut
+           << " messages_in=" << c.nMessagesIn << " messages_out=" << c.nMessagesOut << " queued_out=" << c.nQueuedOut << "\n";
+      return os.str();
+    }
+
+    std::string ToJson() const
+    {
+      std::ostringstream os;
+      auto types = [&os](const std::vector<std::pair<size_t, uint64_t>>& v)
+      {
+        os << "{";
+        for(size_t i = 0; i < v.size(); ++i)
+          os << (i ? "," : "") << "\"" << v[i].first << "\":" << v[i].second;
+        os << "}";
+      };
+      os << "{\"bytes_in\":" << nBytesIn << ",\"bytes_out\":" << nBytesOut
+         << ",\"messages_in\":" << nMessagesIn << ",\"messages_out\":" << nMessagesOut
+         << ",\"handshake_failures\":" << nHandshakeFailures
+         << ",\"connections_accepted\":" << nConnectionsAccepted << ",\"connections_dropped\":" << nConnectionsDropped
+         << ",\"rate_limited\":" << nRateLimited << ",\"malformed\":" << nMalformed << ",\"queued_in\":" << nQueuedIn
+         << ",\"write_latency_us\":{\"p50\":" << nWriteLatencyP50Us << ",\"p99\":" << nWriteLatencyP99Us << ",\"max\":" << nWriteLatencyMaxUs << "}"
+         << ",\"messages_in_by_type\":";
+      types(vMessagesInByType);
+      os << ",\"messages_out_by_type\":";
+      types(vMessagesOutByType);
+      os << ",\"connections\":[";
+      for(size_t i = 0; i < vConnections.size(); ++i)
+      {
+        const auto& c = vConnections[i];
+        os << (i ? "," : "") << "{\"id\":" << c.id << ",\"bytes_in\":" << c.nBytesIn << ",\"bytes_out\":" << c.nBytesOut
+           << ",\"messages_in\":" << c.nMessagesIn << ",\"messages_out\":" << c.nMessagesOut << ",\"queued_out\":" << c.nQueuedOut << "}";
+      }
+      os << "]}\n";
+      return os.str();
+    }
+  };
+
+  // Periodically writes metrics to a file (rewritten every period)
+  // or to a unix socket when the target starts with "unix:"
+  class MetricsDumper
+  {
+  public:
+    enum class Format { Text, Json };
+
+  protected:
+    std::function<MetricsSnapshot()> m_source;
+    std::string m_target;
+    Format m_format;
+    std::chrono::milliseconds m_period;
+    std::thread m_thread;
+    std::mutex muxStop;
+    std::condition_variable cvStop;
+    bool m_bStop = false;
+
+  public:
+    MetricsDumper(std::function<MetricsSnapshot()> source, std::string target, std::chrono::milliseconds period, Format format)
+      : m_source(std::move(source)), m_target(std::move(target)), m_format(format), m_period(period)
+    {
+      m_thread = std::thread([this](){ Run(); });
+    }
+
+    ~MetricsDumper()
+    {
+      {
+        std::lock_guard<std::mutex> lock(muxStop);
+        m_bStop = true;
+      }
+      cvStop.notify_one();
+      if(m_thread.joinable()) m_thread.join();
+    }
+
+  protected:
+    void Run()
+    {
+      std::unique_lock<std::mutex> lock(muxStop);
+      while(!cvStop.wait_for(lock, m_period, [this](){ return m_bStop; }))
+      {
+        MetricsSnapshot snap = m_source();
+        Write(m_format == Format::Json ? snap.ToJson() : snap.ToText());
+      }
+    }
+
+    void Write(const std::string& data)
+    {
+      const std::string prefix = "unix:";
+      if(m_target.compare(0, prefix.size(), prefix) == 0)
+      {
+        // a collector that isn't listening is not an error worth reporting every period
+        asio::io_context context;
+        asio::local::stream_protocol::socket socket(context);
+        asio::error_code ec;
+        socket.connect(asio::local::stream_protocol::endpoint(m_target.substr(prefix.size())), ec);
+        if(!ec)
+          asio::write(socket, asio::buffer(data), ec);
+        return;
+      }
+
+      // write aside and rename so readers never see a half written file
+      std::string tmp = m_target + ".tmp";
+      {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << data;
+      }
+      std::rename(tmp.c_str(), m_target.c_str());
+    }
+  };
+
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <utility>
+
+
+namespace sonicpp
+{
+
+  // Sequence numbers wrap around, a is newer than b if it is less than half the range ahead
+  inline bool sequence_newer(uint32_t a, uint32_t b)
+  {
+    return int32_t(a - b) > 0;
+  }
+
+  // Payload of an input message, client -> server
+  template<typename Input>
+  struct sequenced_input
+  {
+    uint32_t nSequence;
+    Input input;
+  };
+
+  // Payload of an authoritative state message, server -> client
+  // nAck is the last input the server applied before taking the state
+  template<typename State>
+  struct acked_state
+  {
+    uint32_t nAck;
+    State state;
+  };
+
+  // Client side prediction with server reconciliation
+  // Every local input is applied right away by Step and kept with its sequence
+  // number until the server acknowledges it. An authoritative state replaces
+  // the predicted one and the inputs the server hasn't seen yet are replayed
+  // on top, so local controls respond immediately however slow the updates are.
+  // Step has to do exactly what the server does with an input.
+  template<typename Input, typename State, typename Step = void(*)(State&, const Input&)>
+  class predictor
+  {
+  protected:
+    struct entry
+    {
+      uint32_t nSequence;
+      Input input;
+    };
+
+    Step m_step;
+    State m_state{};
+    std::deque<entry> m_qInputs;
+    uint32_t m_nNextSequence = 1;
+    // inputs kept while no acknowledgement comes, older ones can't be replayed
+    size_t m_nCapacity;
+
+  public:
+    explicit predictor(Step step, State initial = {}, size_t nCapacity = 256)
+      : m_step(std::move(step)), m_state(std::move(initial)), m_nCapacity(nCapacity)
+    {}
+
+    // Apply a local input, returns the sequence number to send it with
+    sequenced_input<Input> apply(const Input& input)
+    {
+      m_step(m_state, input);
+      m_qInputs.push_back({m_nNextSequence, input});
+      if(m_qInputs.size() > m_nCapacity)
+        m_qInputs.pop_front();
+      return {m_nNextSequence++, input};
+    }
+
+    // Take the server's state and replay what it hasn't applied yet
+    void reconcile(const State& authoritative, uint32_t nAck)
+    {
+      while(!m_qInputs.empty() && !sequence_newer(m_qInputs.front().nSequence, nAck))
+        m_qInputs.pop_front();
+
+      m_state = authoritative;
+      for(const entry& e : m_qInputs)
+        m_step(m_state, e.input);
+    }
+
+    void reconcile(const acked_state<State>& update)
+    {
+      reconcile(update.state, update.nAck);
+    }
+
+    // Start over from a known state, e.g. when spawned
+    void reset(const State& state)
+    {
+      m_state = state;
+      m_qInputs.clear();
+    }
+
+    const State& state() const { return m_state; }
+    // inputs not acknowledged yet
+    size_t pending() const { return m_qInputs.size(); }
+  };
+
+  // Server side bookkeeping of one client's inputs
+  // Rejects inputs older than the last one applied and remembers what to acknowledge
+  class input_sequence
+  {
+  protected:
+    uint32_t m_nLast = 0;
+    bool m_bAny = false;
+
+  public:
+    bool accept(uint32_t nSequence)
+    {
+      if(m_bAny && !sequence_newer(nSequence, m_nLast))
+        return false;
+      m_nLast = nSequence;
+      m_bAny = true;
+      return true;
+    }
+
+    // last input applied, sent back with the state
+    uint32_t last() const { return m_nLast; }
+
+    template<typename State>
+    acked_state<State> ack(const State& state) const
+    {
+      return {m_nLast, state};
+    }
+  };
+
+}
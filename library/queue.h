@@ -41,6 +41,15 @@ namespace sonicpp
       std::unique_lock<std::mutex> ul(muxBlocking);
       cvBlocking.notify_one();
     }
+
+    void push_back(T&& item)
+    {
+      std::lock_guard<std::mutex> lock(muxQueue);
+      deqQueue.push_back(std::move(item));
+
+      std::unique_lock<std::mutex> ul(muxBlocking);
+      cvBlocking.notify_one();
+    }
     
     void push_front(const T& item)
     {
@@ -60,8 +69,9 @@ namespace sonicpp
     
     T pop_front()
     {
-      auto item = front();
+      // moved out, messages aren't copied on the way to the handlers
       std::lock_guard<std::mutex> lock(muxQueue);
+      T item = std::move(deqQueue.front());
       deqQueue.pop_front();
       return item;
     }
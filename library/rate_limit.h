@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+
+
+namespace sonicpp
+{
+
+  // Inbound limits of a single connection, zero rate means unlimited
+  struct RateLimitConfig
+  {
+    enum class Action
+    {
+      // stop reading until tokens refill, TCP backpressure or the full shared
+      // memory ring slows the sender
+      Pause,
+      // read the message and throw it away
+      Drop,
+      // disconnect the client
+      Kick
+    };
+
+    double fMessagesPerSecond = 0;
+    double fBytesPerSecond = 0;
+    // bucket capacities, zero means one second worth of the rate
+    double fMessageBurst = 0;
+    double fByteBurst = 0;
+    Action action = Action::Pause;
+  };
+
+  // Token bucket refilled continuously at a constant rate up to its capacity
+  class token_bucket
+  {
+  public:
+    using clock = std::chrono::steady_clock;
+
+  protected:
+    double m_fRate = 0;
+    double m_fCapacity = 0;
+    double m_fTokens = 0;
+    clock::time_point m_tpLast{};
+
+  public:
+    token_bucket() = default;
+    token_bucket(double fRate, double fCapacity)
+      : m_fRate(fRate),
+        m_fCapacity(fCapacity > 0 ? fCapacity : fRate),
+        m_fTokens(m_fCapacity),
+        m_tpLast(clock::now())
+    {}
+
+    bool unlimited() const { return m_fRate <= 0; }
+
+    // Take n tokens if available, a request larger than the capacity
+    // passes with a full bucket and leaves it in debt
+    bool consume(double n, clock::time_point now)
+    {
+      if(unlimited())
+        return true;
+      refill(now);
+      if(m_fTokens < std::min(n, m_fCapacity))
+        return false;
+      m_fTokens -= n;
+      return true;
+    }
+
+    // Time until consume(n) can succeed
+    clock::duration wait_for(double n, clock::time_point now)
+    {
+      if(unlimited())
+        return clock::duration::zero();
+      refill(now);
+      double fMissing = std::min(n, m_fCapacity) - m_fTokens;
+      if(fMissing <= 0)
+        return clock::duration::zero();
+      return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(fMissing / m_fRate));
+    }
+
+  protected:
+    void refill(clock::time_point now)
+    {
+      double fElapsed = std::chrono::duration<double>(now - m_tpLast).count();
+      m_tpLast = now;
+      m_fTokens = std::min(m_fCapacity, m_fTokens + fElapsed * m_fRate);
+    }
+  };
+
+}
@@ -0,0 +1,624 @@
+#pragma once
+
+#include "message.h"
+#include "prediction.h"
+#include "udp.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <optional>
+#include <vector>
+
+
+namespace sonicpp
+{
+
+  struct UdpStats
+  {
+    uint64_t nPacketsSent = 0;
+    uint64_t nPacketsReceived = 0;
+    // fragments sent again after their timeout
+    uint64_t nRetransmits = 0;
+    // fragments sent and not acknowledged yet
+    uint64_t nInFlight = 0;
+    std::chrono::nanoseconds rtt{0};
+    std::chrono::nanoseconds retransmitTimeout{0};
+  };
+
+  // Header of every datagram
+  struct packet_header
+  {
+    // zero is never used, an ack of zero means nothing was received yet
+    uint32_t nSequence = 0;
+    // newest packet received from the other side, bit i of nAckBits stands
+    // for the packet nAck - 1 - i
+    uint32_t nAck = 0;
+    uint32_t nAckBits = 0;
+  };
+
+  // Frames follow the packet header back to back, each starts with its kind
+  enum class frame_kind : uint8_t
+  {
+    // message header and body of an unreliable message
+    Message,
+    // fragment header and a slice of a reliable message
+    Fragment
+  };
+
+  // A reliable message is its header and body back to back, cut into slices
+  struct fragment_header
+  {
+    // per stream, the unordered channel counts on its own
+    uint32_t nMessage;
+    uint32_t nOffset;
+    uint32_t nTotal;
+    uint16_t nLength;
+    uint8_t nStream;
+    Delivery delivery;
+  };
+
+  // Reliability over one UDP peer, connection state free so any datagram transport can drive it
+  // Every packet carries its sequence number and acknowledges the last 33
+  // packets received, so acks ride on whatever goes the other way and a
+  // bare ack is only sent when nothing else does. Reliable messages are split
+  // into fragments that fit a packet, a fragment whose packet isn't
+  // acknowledged within the retransmission timeout goes again in a new packet,
+  // so each ack measures the round trip without ambiguity. The receiver
+  // reassembles and delivers ordered streams in order, each stream on its own,
+  // and unordered messages as soon as they are complete, both exactly once.
+  // What the receiver holds is bounded by UdpConfig::nMaxReassembly.
+  // Not thread safe, the connection's executor drives it
+  template<typename T>
+  class reliable_endpoint
+  {
+  public:
+    using clock = std::chrono::steady_clock;
+
+  protected:
+    struct outgoing
+    {
+      // message header and body
+      std::vector<uint8_t> vData;
+      uint32_t nMessage = 0;
+      uint8_t nStream = 0;
+      Delivery delivery = Delivery::Ordered;
+      size_t nFragmentSize = 0;
+      std::vector<bool> vSent;
+      std::vector<bool> vAcked;
+    };
+
+    struct fragment_ref
+    {
+      std::shared_ptr<outgoing> pMessage;
+      size_t nIndex;
+    };
+
+    struct in_flight
+    {
+      fragment_ref fragment;
+      clock::time_point tpSent;
+    };
+
+    struct sent_packet
+    {
+      uint32_t nSequence = 0;
+      bool bValid = false;
+      clock::time_point tpSent{};
+      std::vector<fragment_ref> vFragments;
+    };
+
+    struct incoming
+    {
+      std::vector<uint8_t> vData;
+      // offset to end of the fragments received
+      std::map<uint32_t, uint32_t> mapRanges;
+      size_t nReceived = 0;
+    };
+
+    struct stream_state
+    {
+      // every message before it was delivered
+      uint32_t nNext = 0;
+      // ordered: complete messages waiting for an earlier one,
+      // unordered: delivered messages past nNext, kept empty
+      std::map<uint32_t, std::optional<Message<T>>> mapDone;
+      std::map<uint32_t, incoming> mapPartial;
+    };
+
+    // packets remembered until acknowledged, older acks are ignored
+    static constexpr size_t nSentPackets = 1024;
+    // messages past the next one to deliver that are accepted
+    static constexpr uint32_t nReceiveWindow = 4096;
+    // index of the unordered channel among the streams
+    static constexpr size_t nUnordered = 256;
+    // packets with reliable frames received before an ack goes out right away
+    static constexpr size_t nAckEvery = 16;
+
+    UdpConfig m_config{};
+    // bytes the transport puts in front, and of frames in one packet
+    size_t m_nOverhead = 0;
+    size_t m_nPayload = 0;
+
+    // Sending
+    uint32_t m_nNextPacket = 1;
+    std::vector<uint32_t> m_vNextMessage;
+    std::deque<fragment_ref> m_qUnsent;
+    std::deque<fragment_ref> m_qResend;
+    // oldest first, acknowledged entries are skipped when they reach the front
+    std::deque<in_flight> m_qInFlight;
+    size_t m_nInFlight = 0;
+    std::vector<sent_packet> m_vSent;
+
+    // Round trip, smoothed like TCP's
+    int64_t m_nRtt = 0;
+    int64_t m_nRttVar = 0;
+    bool m_bRttValid = false;
+    clock::duration m_rto{};
+
+    // Receiving
+    bool m_bReceivedAny = false;
+    uint32_t m_nRemoteSequence = 0;
+    uint32_t m_nReceivedBits = 0;
+    bool m_bAckPending = false;
+    size_t m_nUnacked = 0;
+    std::map<size_t, stream_state> m_mapStreams;
+    // bytes of incomplete and undelivered messages
+    size_t m_nHeld = 0;
+
+    // readable from any thread
+    std::atomic<uint64_t> m_nPacketsSent{0};
+    std::atomic<uint64_t> m_nPacketsReceived{0};
+    std::atomic<uint64_t> m_nRetransmits{0};
+    std::atomic<uint64_t> m_nInFlightShared{0};
+    std::atomic<int64_t> m_nRttShared{0};
+    std::atomic<int64_t> m_nRtoShared{0};
+
+  public:
+    // Nothing is allocated before, connections that never use UDP pay nothing.
+    // nOverhead is what the transport puts in front of every packet
+    void configure(const UdpConfig& config, size_t nOverhead)
+    {
+      m_config = config;
+      m_nOverhead = nOverhead;
+      const size_t nFixed = nOverhead + sizeof(packet_header) + sizeof(frame_kind) + sizeof(fragment_header);
+      m_nPayload = config.nMaxDatagram > nFixed ? config.nMaxDatagram - nOverhead - sizeof(packet_header) : 0;
+      reset();
+    }
+
+    // Forget everything, the other side starts over too
+    void reset()
+    {
+      m_nNextPacket = 1;
+      m_vNextMessage.assign(nUnordered + 1, 0);
+      m_qUnsent.clear();
+      m_qResend.clear();
+      m_qInFlight.clear();
+      m_nInFlight = 0;
+      m_vSent.assign(nSentPackets, {});
+      m_bRttValid = false;
+      m_rto = std::clamp<clock::duration>(std::chrono::milliseconds(200), m_config.minRetransmit, m_config.maxRetransmit);
+      m_nRtoShared.store(m_rto.count(), std::memory_order_relaxed);
+      m_bReceivedAny = false;
+      m_nRemoteSequence = 0;
+      m_nReceivedBits = 0;
+      m_bAckPending = false;
+      m_nUnacked = 0;
+      m_mapStreams.clear();
+      m_nHeld = 0;
+    }
+
+    // An unreliable message has to fit in a single packet
+    bool fits(const Message<T>& msg) const
+    {
+      return sizeof(frame_kind) + sizeof(message_header<T>) + msg.body.size() <= m_nPayload;
+    }
+
+    // One packet with the message and the latest acks
+    void send_unreliable(const Message<T>& msg, packet_batch& out, clock::time_point now = clock::now())
+    {
+      auto& packet = begin_packet(out, now);
+      append(packet, frame_kind::Message);
+      append(packet, msg.header);
+      packet.insert(packet.end(), msg.body.begin(), msg.body.end());
+    }
+
+    // Queue a message until flush(), false if it is too large to send
+    bool send_reliable(const Message<T>& msg, UdpChannel channel)
+    {
+      const size_t nTotal = sizeof(message_header<T>) + msg.body.size();
+      if(nTotal > m_config.nMaxMessage || m_nPayload == 0)
+        return false;
+
+      auto pMessage = std::make_shared<outgoing>();
+      pMessage->vData.resize(sizeof(message_header<T>));
+      std::memcpy(pMessage->vData.data(), &msg.header, sizeof(message_header<T>));
+      pMessage->vData.insert(pMessage->vData.end(), msg.body.begin(), msg.body.end());
+      pMessage->delivery = channel.delivery == Delivery::Unordered ? Delivery::Unordered : Delivery::Ordered;
+      pMessage->nStream = pMessage->delivery == Delivery::Ordered ? channel.nStream : 0;
+      pMessage->nMessage = m_vNextMessage[stream_index(pMessage->delivery, pMessage->nStream)]++;
+      pMessage->nFragmentSize = m_nPayload - sizeof(frame_kind) - sizeof(fragment_header);
+
+      const size_t nFragments = (nTotal + pMessage->nFragmentSize - 1) / pMessage->nFragmentSize;
+      pMessage->vSent.assign(nFragments, false);
+      pMessage->vAcked.assign(nFragments, false);
+      for(size_t i = 0; i < nFragments; ++i)
+        m_qUnsent.push_back({pMessage, i});
+      return true;
+    }
+
+    // Packets to send now: fragments whose timeout expired, queued fragments
+    // the send window allows and a bare ack when one is due, bAckDue once the
+    // acks have waited a tick
+    void flush(packet_batch& out, bool bAckDue, clock::time_point now = clock::now())
+    {
+      bool bTimedOut = false;
+      while(!m_qInFlight.empty())
+      {
+        auto& front = m_qInFlight.front();
+        if(acked(front.fragment))
+        {
+          m_qInFlight.pop_front();
+          continue;
+        }
+        if(now - front.tpSent < m_rto)
+          break;
+        m_qResend.push_back(std::move(front.fragment));
+        m_qInFlight.pop_front();
+        m_nRetransmits.fetch_add(1, std::memory_order_relaxed);
+        bTimedOut = true;
+      }
+      // back off until the next sample, the path may be congested
+      if(bTimedOut)
+      {
+        m_rto = std::min<clock::duration>(m_rto * 2, m_config.maxRetransmit);
+        m_nRtoShared.store(m_rto.count(), std::memory_order_relaxed);
+      }
+
+      const size_t nFirstPacket = out.size();
+      std::vector<uint8_t>* pPacket = nullptr;
+      auto pack = [&](const fragment_ref& fragment)
+      {
+        outgoing& message = *fragment.pMessage;
+        const size_t nOffset = fragment.nIndex * message.nFragmentSize;
+        const size_t nLength = std::min(message.nFragmentSize, message.vData.size() - nOffset);
+        const size_t nFrame = sizeof(frame_kind) + sizeof(fragment_header) + nLength;
+        if(!pPacket || pPacket->size() + nFrame > sizeof(packet_header) + m_nPayload)
+          pPacket = &begin_packet(out, now);
+
+        fragment_header header{message.nMessage, uint32_t(nOffset), uint32_t(message.vData.size()),
+          uint16_t(nLength), message.nStream, message.delivery};
+        append(*pPacket, frame_kind::Fragment);
+        append(*pPacket, header);
+        pPacket->insert(pPacket->end(), message.vData.begin() + nOffset, message.vData.begin() + nOffset + nLength);
+
+        m_vSent[(m_nNextPacket - 1) % nSentPackets].vFragments.push_back(fragment);
+        m_qInFlight.push_back({fragment, now});
+        if(!message.vSent[fragment.nIndex])
+        {
+          message.vSent[fragment.nIndex] = true;
+          m_nInFlight++;
+        }
+      };
+
+      while(!m_qResend.empty())
+      {
+        if(!acked(m_qResend.front()))
+          pack(m_qResend.front());
+        m_qResend.pop_front();
+      }
+      while(!m_qUnsent.empty() && m_nInFlight < m_config.nSendWindow)
+      {
+        pack(m_qUnsent.front());
+        m_qUnsent.pop_front();
+      }
+
+      if(out.size() == nFirstPacket && m_bAckPending && (bAckDue || m_nUnacked >= nAckEvery))
+        begin_packet(out, now);
+
+      m_nInFlightShared.store(m_nInFlight, std::memory_order_relaxed);
+    }
+
+    // Take the acks of a packet and deliver the messages it completes,
+    // deliver(Message<T>&&) gets unreliable and reliable messages alike.
+    // Returns false if it isn't a packet at all
+    template<typename F>
+    bool receive(const uint8_t* pData, size_t nLength, F&& deliver, clock::time_point now = clock::now())
+    {
+      if(nLength < sizeof(packet_header))
+        return false;
+      packet_header header;
+      std::memcpy(&header, pData, sizeof(header));
+      read_acks(header, now);
+      if(received(header.nSequence))
+        return true;
+      m_nPacketsReceived.fetch_add(1, std::memory_order_relaxed);
+
+      bool bReliable = false;
+      bool bRefused = false;
+      size_t nPos = sizeof(packet_header);
+      while(nPos < nLength)
+      {
+        frame_kind kind = static_cast<frame_kind>(pData[nPos++]);
+        if(kind == frame_kind::Message)
+        {
+          Message<T> msg;
+          if(nLength - nPos < sizeof(message_header<T>))
+            break;
+          std::memcpy(&msg.header, pData + nPos, sizeof(message_header<T>));
+          nPos += sizeof(message_header<T>);
+          if(msg.header.size > nLength - nPos)
+            break;
+          msg.body.assign(pData + nPos, pData + nPos + msg.header.size);
+          nPos += msg.header.size;
+          deliver(std::move(msg));
+        }
+        else if(kind == frame_kind::Fragment)
+        {
+          fragment_header fragment;
+          if(nLength - nPos < sizeof(fragment_header))
+            break;
+          std::memcpy(&fragment, pData + nPos, sizeof(fragment_header));
+          nPos += sizeof(fragment_header);
+          if(fragment.nLength > nLength - nPos)
+            break;
+          bReliable = true;
+          bRefused |= !reassemble(fragment, pData + nPos, deliver);
+          nPos += fragment.nLength;
+        }
+        else
+          break;
+      }
+
+      // a packet with a fragment that found no room stays unacknowledged,
+      // its fragments come again and the rest of them are deduplicated
+      if(!bRefused)
+        mark_received(header.nSequence);
+
+      // only reliable data needs acks, acks of bare acks would never end
+      if(bReliable)
+      {
+        m_bAckPending = true;
+        m_nUnacked++;
+      }
+      return true;
+    }
+
+    // Something waits for a timeout or an ack
+    bool busy() const
+    {
+      return !m_qInFlight.empty() || !m_qResend.empty() || !m_qUnsent.empty() || m_bAckPending;
+    }
+
+    // Safe to call from any thread
+    UdpStats stats() const
+    {
+      UdpStats s;
+      s.nPacketsSent = m_nPacketsSent.load(std::memory_order_relaxed);
+      s.nPacketsReceived = m_nPacketsReceived.load(std::memory_order_relaxed);
+      s.nRetransmits = m_nRetransmits.load(std::memory_order_relaxed);
+      s.nInFlight = m_nInFlightShared.load(std::memory_order_relaxed);
+      s.rtt = std::chrono::nanoseconds(m_nRttShared.load(std::memory_order_relaxed));
+      s.retransmitTimeout = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::duration(m_nRtoShared.load(std::memory_order_relaxed)));
+      return s;
+    }
+
+  protected:
+    static size_t stream_index(Delivery delivery, uint8_t nStream)
+    {
+      return delivery == Delivery::Ordered ? nStream : nUnordered;
+    }
+
+    template<typename Data>
+    static void append(std::vector<uint8_t>& packet, const Data& data)
+    {
+      const size_t nPos = packet.size();
+      packet.resize(nPos + sizeof(Data));
+      std::memcpy(packet.data() + nPos, &data, sizeof(Data));
+    }
+
+    static bool acked(const fragment_ref& fragment)
+    {
+      return fragment.pMessage->vAcked[fragment.nIndex];
+    }
+
+    // New packet carrying the current acks, it acknowledges everything pending
+    std::vector<uint8_t>& begin_packet(packet_batch& out, clock::time_point now)
+    {
+      const uint32_t nSequence = m_nNextPacket++;
+      if(m_nNextPacket == 0)
+        m_nNextPacket = 1;
+
+      auto& record = m_vSent[nSequence % nSentPackets];
+      record.nSequence = nSequence;
+      record.bValid = true;
+      record.tpSent = now;
+      record.vFragments.clear();
+
+      auto& packet = out.add();
+      append(packet, packet_header{nSequence, m_bReceivedAny ? m_nRemoteSequence : 0, m_nReceivedBits});
+      m_bAckPending = false;
+      m_nUnacked = 0;
+      m_nPacketsSent.fetch_add(1, std::memory_order_relaxed);
+      return packet;
+    }
+
+    void read_acks(const packet_header& header, clock::time_point now)
+    {
+      if(header.nAck == 0)
+        return;
+
+      auto ack = [&](uint32_t nSequence, bool bNewest)
+      {
+        auto& record = m_vSent[nSequence % nSentPackets];
+        if(!record.bValid || record.nSequence != nSequence)
+          return;
+        record.bValid = false;
+        if(bNewest)
+          sample_rtt(now - record.tpSent);
+        for(const auto& fragment : record.vFragments)
+        {
+          auto& message = *fragment.pMessage;
+          if(message.vAcked[fragment.nIndex])
+            continue;
+          message.vAcked[fragment.nIndex] = true;
+          m_nInFlight--;
+        }
+        record.vFragments.clear();
+      };
+
+      ack(header.nAck, true);
+      for(uint32_t i = 0; i < 32; ++i)
+        if(header.nAckBits & (1u << i))
+          ack(header.nAck - 1 - i, false);
+    }
+
+    void sample_rtt(clock::duration sample)
+    {
+      const int64_t nSample = std::chrono::duration_cast<std::chrono::nanoseconds>(sample).count();
+      if(!m_bRttValid)
+      {
+        m_nRtt = nSample;
+        m_nRttVar = nSample / 2;
+        m_bRttValid = true;
+      }
+      else
+      {
+        // RFC 6298 gains, 1/4 for the deviation and 1/8 for the mean
+        m_nRttVar += (std::abs(m_nRtt - nSample) - m_nRttVar) / 4;
+        m_nRtt += (nSample - m_nRtt) / 8;
+      }
+
+      // acks are held back up to a tick, that is part of the round trip as seen here
+      const auto variance = std::max<clock::duration>(std::chrono::nanoseconds(4 * m_nRttVar), m_config.tick);
+      m_rto = std::clamp<clock::duration>(std::chrono::nanoseconds(m_nRtt) + variance, m_config.minRetransmit, m_config.maxRetransmit);
+      m_nRttShared.store(m_nRtt, std::memory_order_relaxed);
+      m_nRtoShared.store(m_rto.count(), std::memory_order_relaxed);
+    }
+
+    // True for a packet received before
+    bool received(uint32_t nSequence) const
+    {
+      if(!m_bReceivedAny || sequence_newer(nSequence, m_nRemoteSequence))
+        return false;
+      if(nSequence == m_nRemoteSequence)
+        return true;
+
+      // too old to tell, fragments are deduplicated by their message anyway
+      const uint32_t nBack = m_nRemoteSequence - nSequence - 1;
+      return nBack < 32 && (m_nReceivedBits & (1u << nBack));
+    }
+
+    // Acknowledged by the next packets sent
+    void mark_received(uint32_t nSequence)
+    {
+      if(!m_bReceivedAny)
+      {
+        m_bReceivedAny = true;
+        m_nRemoteSequence = nSequence;
+        m_nReceivedBits = 0;
+        return;
+      }
+      if(sequence_newer(nSequence, m_nRemoteSequence))
+      {
+        const uint32_t nShift = nSequence - m_nRemoteSequence;
+        m_nReceivedBits = nShift > 32 ? 0 : uint32_t(((uint64_t(m_nReceivedBits) << 1) | 1) << (nShift - 1));
+        m_nRemoteSequence = nSequence;
+        return;
+      }
+      const uint32_t nBack = m_nRemoteSequence - nSequence - 1;
+      if(nBack < 32)
+        m_nReceivedBits |= 1u << nBack;
+    }
+
+    // False if the fragment has to come again later, it was too far ahead
+    // or its message would take more than the reassembly budget
+    template<typename F>
+    bool reassemble(const fragment_header& fragment, const uint8_t* pData, F& deliver)
+    {
+      if(fragment.delivery != Delivery::Ordered && fragment.delivery != Delivery::Unordered)
+        return true;
+      if(fragment.nTotal < sizeof(message_header<T>) || fragment.nTotal > m_config.nMaxMessage || fragment.nLength == 0 ||
+         fragment.nOffset > fragment.nTotal || fragment.nLength > fragment.nTotal - fragment.nOffset)
+        return true;
+
+      stream_state& stream = m_mapStreams[stream_index(fragment.delivery, fragment.nStream)];
+      const int32_t nAhead = int32_t(fragment.nMessage - stream.nNext);
+      if(nAhead < 0 || stream.mapDone.count(fragment.nMessage))
+        return true;
+      if(uint32_t(nAhead) >= nReceiveWindow)
+        return false;
+
+      auto itPartial = stream.mapPartial.find(fragment.nMessage);
+      if(itPartial == stream.mapPartial.end())
+      {
+        // the next message of a stream gets extra room so a full budget of
+        // later messages can't hold it back forever
+        const size_t nBudget = m_config.nMaxReassembly + (nAhead == 0 ? m_config.nMaxMessage : 0);
+        if(m_nHeld + fragment.nTotal > nBudget)
+          return false;
+        itPartial = stream.mapPartial.try_emplace(fragment.nMessage).first;
+        itPartial->second.vData.resize(fragment.nTotal);
+        m_nHeld += fragment.nTotal;
+      }
+
+      incoming& partial = itPartial->second;
+      if(partial.vData.size() != fragment.nTotal || overlaps(partial, fragment))
+        return true;
+      partial.mapRanges.emplace(fragment.nOffset, fragment.nOffset + fragment.nLength);
+      std::memcpy(partial.vData.data() + fragment.nOffset, pData, fragment.nLength);
+      partial.nReceived += fragment.nLength;
+      if(partial.nReceived < fragment.nTotal)
+        return true;
+
+      std::optional<Message<T>> msg(std::in_place);
+      std::memcpy(&msg->header, partial.vData.data(), sizeof(message_header<T>));
+      if(msg->header.size == partial.vData.size() - sizeof(message_header<T>))
+        msg->body.assign(partial.vData.begin() + sizeof(message_header<T>), partial.vData.end());
+      else
+        msg.reset();
+      stream.mapPartial.erase(itPartial);
+      m_nHeld -= fragment.nTotal;
+
+      // a broken message is skipped so it doesn't hold its stream back forever
+      if(fragment.delivery == Delivery::Unordered && msg)
+      {
+        deliver(std::move(*msg));
+        msg.reset();
+      }
+      if(msg)
+        m_nHeld += fragment.nTotal;
+      stream.mapDone[fragment.nMessage] = std::move(msg);
+
+      for(auto it = stream.mapDone.find(stream.nNext); it != stream.mapDone.end(); it = stream.mapDone.find(stream.nNext))
+      {
+        if(it->second)
+        {
+          m_nHeld -= sizeof(message_header<T>) + it->second->body.size();
+          deliver(std::move(*it->second));
+        }
+        stream.mapDone.erase(it);
+        stream.nNext++;
+      }
+      return true;
+    }
+
+    // Duplicates overlap too, only the bytes of each fragment count towards its message
+    static bool overlaps(const incoming& partial, const fragment_header& fragment)
+    {
+      const uint32_t nEnd = fragment.nOffset + fragment.nLength;
+      auto itNext = partial.mapRanges.lower_bound(fragment.nOffset);
+      if(itNext != partial.mapRanges.end() && itNext->first < nEnd)
+        return true;
+      return itNext != partial.mapRanges.begin() && std::prev(itNext)->second > fragment.nOffset;
+    }
+  };
+
+}
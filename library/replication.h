@@ -0,0 +1,334 @@
+#pragma once
+
+#include "message.h"
+#include "server.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+
+namespace sonicpp
+{
+
+  // Snapshot replication
+  // The server captures the world (entities of a flat State type keyed by id)
+  // into a ring of snapshots, every client acknowledges the last snapshot it
+  // applied and receives only the fields that changed since that baseline.
+  // Fields are compared as 32-bit words of State, so a State of up to
+  // 64 words (256 bytes) is supported.
+  //
+  // Wire format of a snapshot message, in extraction order:
+  //   seq, baseline seq (0 - none), entity count,
+  //   per entity: id, changed words mask, changed words (lowest first)
+  //   removed count, removed ids
+  namespace replication
+  {
+    template<typename State>
+    struct words
+    {
+      static_assert(std::is_trivially_copyable<State>::value, "State has to be a flat structure");
+      static constexpr size_t count = (sizeof(State) + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+      static_assert(count <= 64, "State is too big for a 64 bit change mask");
+
+      std::array<uint32_t, count> data{};
+
+      words() = default;
+      explicit words(const State& state)
+      {
+        std::memcpy(data.data(), &state, sizeof(State));
+      }
+
+      State get() const
+      {
+        State state;
+        std::memcpy(&state, data.data(), sizeof(State));
+        return state;
+      }
+    };
+
+    template<typename State>
+    struct snapshot
+    {
+      uint32_t seq = 0;
+      // sorted by id, so two snapshots can be diffed with a single merge pass
+      std::vector<std::pair<uint32_t, words<State>>> entities{};
+    };
+
+    // Extraction that fails instead of reading past the end of the body
+    template<typename T, typename V>
+    bool read(Message<T>& msg, V& value)
+    {
+      if(msg.body.size() < sizeof(V))
+        return false;
+      msg >> value;
+      return true;
+    }
+  }
+
+  template<typename T, typename State, size_t HISTORY = 32>
+  class ReplicationServer
+  {
+  protected:
+    using Words = replication::words<State>;
+    using Snapshot = replication::snapshot<State>;
+
+    ServerInterface<T>& m_server;
+    const T m_snapshotMsg;
+
+    // current state, captured into the ring by Capture()
+    std::unordered_map<uint32_t, State> m_world{};
+    std::array<Snapshot, HISTORY> m_ring{};
+    uint32_t m_nSeq = 0;
+
+    // client id -> last acknowledged snapshot
+    std::unordered_map<uint32_t, uint32_t> m_mapAcked{};
+
+  public:
+    ReplicationServer(ServerInterface<T>& server, T snapshotMsg)
+      : m_server(server), m_snapshotMsg(snapshotMsg)
+    {}
+
+    void SetEntity(uint32_t id, const State& state)
+    {
+      m_world[id] = state;
+    }
+
+    void RemoveEntity(uint32_t id)
+    {
+      m_world.erase(id);
+    }
+
+    // Store the current world as a new snapshot, returns its sequence number
+    uint32_t Capture()
+    {
+      // a baseline out of history is worth nothing, clients that went quiet
+      // that long are forgotten even if nobody called RemoveClient
+      std::erase_if(m_mapAcked, [this](const auto& acked){ return acked.second + HISTORY <= m_nSeq + 1; });
+
+      Snapshot& snap = m_ring[++m_nSeq % HISTORY];
+      snap.seq = m_nSeq;
+      snap.entities.clear();
+      snap.entities.reserve(m_world.size());
+      for(const auto& [id, state] : m_world)
+        snap.entities.emplace_back(id, Words(state));
+      std::sort(snap.entities.begin(), snap.entities.end(),
+        [](const auto& a, const auto& b){ return a.first < b.first; });
+      return m_nSeq;
+    }
+
+    // Feed the acknowledgement message sent by ReplicationClient::AckMessage,
+    // false if it's malformed
+    bool OnAck(uint32_t client_id, Message<T>& msg)
+    {
+      uint32_t seq;
+      if(msg.body.size() != sizeof(seq))
+        return false;
+      msg >> seq;
+      // acks can't go backwards, and can't acknowledge the future
+      if(seq == 0 || seq > m_nSeq)
+        return true;
+      uint32_t& acked = m_mapAcked[client_id];
+      if(seq > acked)
+        acked = seq;
+      return true;
+    }
+
+    // Call from OnClientDisconnect
+    void RemoveClient(uint32_t client_id)
+    {
+      m_mapAcked.erase(client_id);
+    }
+
+    // Clients with a baseline to diff against
+    size_t TrackedClients() const
+    {
+      return m_mapAcked.size();
+    }
+
+    // Send the latest snapshot as a delta against the client's baseline
+    void SendTo(std::shared_ptr<Connection<T>> client)
+    {
+      if(!client || m_nSeq == 0)
+        return;
+      m_server.MessageClient(client, DeltaFor(client->GetID()));
+    }
+
+    // The message SendTo sends, the latest snapshot has to be captured
+    Message<T> DeltaFor(uint32_t client_id) const
+    {
+      auto it = m_mapAcked.find(client_id);
+      Message<T> msg{m_snapshotMsg};
+      EncodeDelta(msg, FindBaseline(it != m_mapAcked.end() ? it->second : 0), m_ring[m_nSeq % HISTORY]);
+      return msg;
+    }
+
+  protected:
+    const Snapshot* FindBaseline(uint32_t seq) const
+    {
+      // baseline fell out of history, client gets the full state
+      if(seq == 0 || seq + HISTORY <= m_nSeq)
+        return nullptr;
+      const Snapshot& snap = m_ring[seq % HISTORY];
+      return snap.seq == seq ? &snap : nullptr;
+    }
+
+    void EncodeDelta(Message<T>& msg, const Snapshot* baseline, const Snapshot& current) const
+    {
+      static const std::vector<std::pair<uint32_t, Words>> none{};
+      const auto& base = baseline ? baseline->entities : none;
+
+      // message is extracted from the back, push in reverse order of reading
+      std::vector<uint32_t> vRemoved;
+      size_t b = 0;
+      for(const auto& entity : current.entities)
+      {
+        for(; b < base.size() && base[b].first < entity.first; ++b)
+          vRemoved.push_back(base[b].first);
+        if(b < base.size() && base[b].first == entity.first)
+          ++b;
+      }
+      for(; b < base.size(); ++b)
+        vRemoved.push_back(base[b].first);
+
+      for(auto it = vRemoved.rbegin(); it != vRemoved.rend(); ++it)
+        msg << *it;
+      msg << uint32_t(vRemoved.size());
+
+      uint32_t nEntities = 0;
+      // walk backwards so the merge with the baseline also goes backwards
+      auto bit = base.rbegin();
+      for(auto it = current.entities.rbegin(); it != current.entities.rend(); ++it)
+      {
+        while(bit != base.rend() && bit->first > it->first)
+          ++bit;
+        static const Words zero{};
+        const Words& from = (bit != base.rend() && bit->first == it->first) ? bit->second : zero;
+
+        uint64_t nMask = 0;
+        for(size_t w = Words::count; w-- > 0;)
+          if(it->second.data[w] != from.data[w])
+          {
+            nMask |= uint64_t(1) << w;
+            msg << it->second.data[w];
+          }
+
+        if(nMask == 0 && &from != &zero)
+          continue;
+
+        msg << nMask << it->first;
+        nEntities++;
+      }
+      msg << nEntities;
+      msg << (baseline ? baseline->seq : uint32_t(0)) << current.seq;
+    }
+  };
+
+  template<typename T, typename State, size_t HISTORY = 32>
+  class ReplicationClient
+  {
+  protected:
+    using Words = replication::words<State>;
+    using Snapshot = replication::snapshot<State>;
+
+    // received snapshots, possible baselines of the next ones
+    std::array<Snapshot, HISTORY> m_ring{};
+    uint32_t m_nLatest = 0;
+    std::unordered_map<uint32_t, State> m_world{};
+
+  public:
+    // Decode a snapshot message, returns false if its baseline is unknown or
+    // it's malformed, the world is left untouched then
+    bool Apply(Message<T>& msg)
+    {
+      using replication::read;
+      uint32_t seq, baselineSeq, nEntities;
+      if(!read(msg, seq) || !read(msg, baselineSeq) || !read(msg, nEntities))
+        return false;
+
+      if(seq <= m_nLatest)
+        return false;
+
+      const Snapshot* baseline = nullptr;
+      if(baselineSeq != 0)
+      {
+        baseline = &m_ring[baselineSeq % HISTORY];
+        if(baseline->seq != baselineSeq)
+          return false;
+      }
+
+      // start from the baseline, unchanged entities are not sent at all
+      Snapshot next;
+      next.seq = seq;
+      if(baseline)
+        next.entities = baseline->entities;
+
+      for(uint32_t i = 0; i < nEntities; ++i)
+      {
+        uint32_t id;
+        uint64_t nMask;
+        if(!read(msg, id) || !read(msg, nMask))
+          return false;
+        // words past the end of State are never sent
+        if constexpr(Words::count < 64)
+          if(nMask >> Words::count)
+            return false;
+
+        auto it = std::lower_bound(next.entities.begin(), next.entities.end(), id,
+          [](const auto& e, uint32_t key){ return e.first < key; });
+        if(it == next.entities.end() || it->first != id)
+          it = next.entities.insert(it, {id, Words{}});
+
+        for(size_t w = 0; w < Words::count; ++w)
+          if(nMask & (uint64_t(1) << w))
+            if(!read(msg, it->second.data[w]))
+              return false;
+      }
+
+      uint32_t nRemoved;
+      if(!read(msg, nRemoved))
+        return false;
+      for(uint32_t i = 0; i < nRemoved; ++i)
+      {
+        uint32_t id;
+        if(!read(msg, id))
+          return false;
+        std::erase_if(next.entities, [id](const auto& e){ return e.first == id; });
+      }
+      if(!msg.body.empty())
+        return false;
+
+      m_world.clear();
+      for(const auto& [id, words] : next.entities)
+        m_world[id] = words.get();
+
+      m_ring[seq % HISTORY] = std::move(next);
+      m_nLatest = seq;
+      return true;
+    }
+
+    // Message to send back to the server after Apply succeeded
+    Message<T> AckMessage(T ackMsg) const
+    {
+      Message<T> msg{ackMsg};
+      msg << m_nLatest;
+      return msg;
+    }
+
+    const std::unordered_map<uint32_t, State>& World() const
+    {
+      return m_world;
+    }
+
+    uint32_t LatestSequence() const
+    {
+      return m_nLatest;
+    }
+  };
+
+}
@@ -2,121 +2,435 @@
 
 #include "message.h"
 #include "queue.h"
+#include "cowlist.h"
+#include "group.h"
+#include "socket_options.h"
+#include "timing_wheel.h"
+#include "heartbeat.h"
+#include "rate_limit.h"
+#include "session.h"
+#include "clock_sync.h"
+#include "udp.h"
+#include "reliability.h"
+#include "shm.h"
+#include "metrics.h"
+#include "log.h"
+#include "dispatcher.h"
 #include "connection.h"
 
+#include <atomic>
+#include <chrono>
 #include <fcntl.h>
 #include <limits>
 #include <memory>
+#include <random>
 #include <system_error>
+#include <unistd.h>
+#include <unordered_map>
 
 namespace sonicpp{
 
+  template<typename T>
+  class ClientIntefrace;
+
+  struct TickStats
+  {
+    uint64_t nTicks = 0;
+    // ticks that ended after the next one should have started
+    uint64_t nOverruns = 0;
+    std::chrono::microseconds lastTickTime{0};
+    std::chrono::microseconds maxTickTime{0};
+  };
+
   template<typename T>
   class ServerInterface
   {
+    friend sonicpp::Connection<T>;
+    friend sonicpp::ClientIntefrace<T>;
+
   protected:
     using Message = sonicpp::Message<T>;
     using Connection = sonicpp::Connection<T>;
   
   public:    
-    ServerInterface(uint16_t port)
-      : m_asioAcceptor(m_asioContext, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))
+    // nThreads - number of io threads serving connections, with more than one
+    // thread the On* callbacks can be called concurrently from different threads
+    ServerInterface(uint16_t port, size_t nThreads = 1)
+      : m_endpoint(asio::ip::tcp::v4(), port),
+        m_asioAcceptor(m_asioContext)
     {
-      
+      // with a single thread everything runs on the acceptor context
+      if(nThreads > 1)
+        for(size_t i = 0; i < nThreads; ++i)
+        {
+          m_vWorkerContexts.push_back(std::make_unique<asio::io_context>());
+          m_vWorkGuards.push_back(asio::make_work_guard(*m_vWorkerContexts.back()));
+        }
+
+      // one timing wheel per io thread drives the idle checks of all its connections
+      for(size_t i = 0; i < WorkerCount(); ++i)
+        m_vWheels.push_back(std::make_unique<timing_wheel>(WorkerContext(i)));
     }
 
     virtual ~ServerInterface()
     {
+      // the dumper reads connections, stop it first
+      m_metricsDumper.reset();
       Stop();
+      // in process clients notice on their own
+      for(auto& client : *m_connections.snapshot())
+        client->CloseLocal();
+      // drop connections while their contexts are still alive
+      m_connections.clear();
+      m_groups = {};
+      m_qMessagesIn.clear();
     }
 
     bool Start()
     {
       try{
-        // give work of waiting for connection
-        waitForClientConnection();
+        // listen now so the backlog setting can be applied
+        m_asioAcceptor.open(m_endpoint.protocol());
+        m_asioAcceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+        m_asioAcceptor.bind(m_endpoint);
+        m_asioAcceptor.listen(m_nListenBacklog);
+
+        // one datagram socket for all clients, served by the acceptor's thread
+        if(m_udp.bEnabled)
+        {
+          m_udpSocket.open(asio::ip::udp::v4());
+          m_udpSocket.bind({asio::ip::udp::v4(), m_udp.nPort ? m_udp.nPort : m_endpoint.port()});
+          m_nUdpPort = m_udpSocket.local_endpoint().port();
+          m_datagramsIn.resize(m_udp.nReceiveBatch);
+          ReceiveDatagrams();
+        }
+
+        // processes on this host can connect through shared memory
+        if(m_shm.bEnabled)
+        {
+          ::unlink(m_shm.sPath.c_str());
+          m_shmAcceptor.open();
+          m_shmAcceptor.bind(asio::local::stream_protocol::endpoint(m_shm.sPath));
+          m_shmAcceptor.listen();
+          WaitForSharedConnection();
+        }
+
+        // give work of waiting for connection, several accepts in flight
+        // drain accept storms without a round trip through the queue per socket
+        for(size_t i = 0; i < m_nPendingAccepts; ++i)
+          waitForClientConnection();
 
         m_threadContext = std::thread([this](){ m_asioContext.run();});
+
+        for(auto& context : m_vWorkerContexts)
+          m_vWorkerThreads.emplace_back([&context](){ context->run();});
       }
       catch(std::exception& e)
       {
-        std::cerr << "[SERVER] Exception: " << e.what() << std::endl;
+        SONICPP_LOG_ERROR("[SERVER] Exception: " << e.what());
         return false;
       }
 
-      std::cout << "[SERVER] Started!" << std::endl;
+      SONICPP_LOG_INFO("[SERVER] Started!");
       return true;
     }
 
+    // Accept path tuning, has to be set before Start()
+    void SetPendingAccepts(size_t nPending)
+    {
+      m_nPendingAccepts = std::max<size_t>(nPending, 1);
+    }
+
+    void SetListenBacklog(int nBacklog)
+    {
+      m_nListenBacklog = nBacklog;
+    }
+
+    // Heartbeats and idle timeouts of every connection, has to be set before Start()
+    void SetHeartbeat(const HeartbeatConfig& config)
+    {
+      m_heartbeat = config;
+    }
+
+    // Estimate round trip and clock offset of every client, has to be set before Start()
+    // Results are on each connection, Connection::GetClock()
+    void SetClockSync(const ClockSyncConfig& config)
+    {
+      m_clockSync = config;
+    }
+
+    // UDP channel of every client that enables it too, has to be set before Start()
+    void SetUdp(const UdpConfig& config)
+    {
+      m_udp = config;
+    }
+
+    // Always send messages of this type unreliably, has to be set before Start()
+    void SetUnreliable(T id)
+    {
+      m_udpRoutes.set(id, {Delivery::Unreliable});
+    }
+
+    // Send messages of this type over UDP the given way, has to be set before Start()
+    void SetChannel(T id, UdpChannel channel)
+    {
+      m_udpRoutes.set(id, channel);
+    }
+
+    // Every message type not set otherwise goes over UDP the given way, TCP
+    // is left to the handshake, sessions and the library's own messages.
+    // Has to be set before Start()
+    void SetDefaultChannel(UdpChannel channel)
+    {
+      m_udpRoutes.set_default(channel);
+    }
+
+    // Accept clients of this host over shared memory on the unix socket
+    // config.sPath, next to TCP, has to be set before Start()
+    void SetSharedMemory(const SharedMemoryConfig& config)
+    {
+      m_shm = config;
+    }
+
+    // Inbound rate limits of every connection, has to be set before Start()
+    void SetRateLimit(const RateLimitConfig& config)
+    {
+      m_rateLimit = config;
+    }
+
+    // Let dropped clients resume their sessions, has to be set before Start()
+    void SetSessionResume(const SessionConfig& config)
+    {
+      m_session = config;
+    }
+
+    // Applied to every accepted socket
+    void SetSocketOptions(const SocketOptions& options)
+    {
+      m_socketOptions = options;
+    }
+
+    // Handle messages with id ID by fn instead of OnMessage, see Dispatcher
+    // Register before Start() or from the thread calling Update()
+    template<T ID, typename F>
+    void On(F&& fn)
+    {
+      m_dispatcher.template On<ID>(std::forward<F>(fn));
+    }
+
+    // Safe to call from any thread
+    MetricsSnapshot GetMetrics()
+    {
+      MetricsSnapshot snap = MetricsSnapshot::From(m_metrics);
+      snap.nQueuedIn = m_qMessagesIn.count();
+      auto connections = m_connections.snapshot();
+      for(auto& client : *connections)
+        snap.AddConnection(client->GetID(), client->GetMetrics());
+      return snap;
+    }
+
+#ifdef SONICPP_TRACE
+    // Per stage and per message type latency percentiles, needs SONICPP_TRACE
+    std::string GetTraceReport() const
+    {
+      return m_metrics.tracer.Report();
+    }
+#endif
+
+    // Write GetMetrics() to target every period, a file path or "unix:/path/to/socket"
+    void StartMetricsDump(const std::string& target, std::chrono::milliseconds period,
+      MetricsDumper::Format format = MetricsDumper::Format::Text)
+    {
+      m_metricsDumper.reset();
+      m_metricsDumper = std::make_unique<MetricsDumper>([this](){ return GetMetrics(); }, target, period, format);
+    }
+
+    void StopMetricsDump()
+    {
+      m_metricsDumper.reset();
+    }
+
     void Stop()
     {
       // Request context to close
       m_asioContext.stop();
+      for(auto& context : m_vWorkerContexts)
+        context->stop();
 
-      // Tidy up the context thread
+      // Tidy up the context threads
       if(m_threadContext.joinable()) m_threadContext.join();
+      for(auto& thread : m_vWorkerThreads)
+        if(thread.joinable()) thread.join();
+      m_vWorkerThreads.clear();
+
+      if(m_shmAcceptor.is_open())
+      {
+        asio::error_code ec;
+        m_shmAcceptor.close(ec);
+        ::unlink(m_shm.sPath.c_str());
+      }
       
-      std::cout << "[SERVER] Stopped!" << std::endl;
+      SONICPP_LOG_INFO("[SERVER] Stopped!");
     }
     
     //@ASYNC - wait for connection
     void waitForClientConnection()
     {
-      m_asioAcceptor.async_accept(
-      [this](std::error_code ec, asio::ip::tcp::socket socket)
+      // spread connections over io threads in round robin
+      size_t nWorker = m_nNextWorker;
+      m_nNextWorker = (m_nNextWorker + 1) % WorkerCount();
+
+      m_asioAcceptor.async_accept(WorkerContext(nWorker),
+      [this, nWorker](std::error_code ec, asio::ip::tcp::socket socket)
       {
           if(!ec)
           {
-            std::cerr << "[SERVER] New Connection: " << socket.remote_endpoint() << std::endl;
+            // peer could have reset already, don't throw from the accept handler
+            asio::error_code ecEndpoint;
+            auto endpoint = socket.remote_endpoint(ecEndpoint);
+            if(!ecEndpoint)
+              SONICPP_LOG_INFO("[SERVER] New Connection: " << endpoint);
+
+            if(auto ecOptions = m_socketOptions.Apply(socket))
+              SONICPP_LOG_WARNING("[SERVER] Socket Options Error: " << ecOptions.message());
 
             std::shared_ptr<Connection> newconn = 
               std::make_shared<Connection>(
                 Connection::Owner::Server, 
-                m_asioContext, 
                 std::move(socket), 
                 m_qMessagesIn
             );
+            newconn->m_nWorker = nWorker;
+            newconn->m_pWheel = m_vWheels[nWorker].get();
+            newconn->m_heartbeat = m_heartbeat;
+            newconn->m_clockSync = m_clockSync;
+            newconn->m_udp = m_udp;
+            newconn->m_pUdpServer = &m_udpSocket;
+            newconn->m_pRoutes = &m_udpRoutes;
+            newconn->m_rateLimit = m_rateLimit;
+            newconn->m_msgBucket = token_bucket(m_rateLimit.fMessagesPerSecond, m_rateLimit.fMessageBurst);
+            newconn->m_byteBucket = token_bucket(m_rateLimit.fBytesPerSecond, m_rateLimit.fByteBurst);
+            newconn->m_pMetrics = &m_metrics;
+            newconn->m_session = m_session;
 
             // Give the user server a chance to deny connection
             if(OnClientConnect(newconn))
             {
-              // Add connection to active connections
-              m_deqConnections.push_back(std::move(newconn));
+              // Publish connection to active connections
+              m_connections.push_back(newconn);
+              m_metrics.connectionsAccepted.add();
 
-              // allocate id for the connection
-              m_deqConnections.back()->ConnectToClient(this, nIDCounter++);
+              // allocate id for the connection, the handshake starts on the
+              // connection's own io thread
+              asio::post(WorkerContext(nWorker),
+                [this, newconn, uid = nIDCounter++]()
+                {
+                  newconn->ConnectToClient(this, uid);
+                });
               
             }
             else
             {
-              std::cout << "[------] Connection Denied" << std::endl;
+              SONICPP_LOG_INFO("[------] Connection Denied");
             }
           }
           else
           {
-            std::cerr << "[SERVER] New Connection Error: " << ec.message() << std::endl; 
+            SONICPP_LOG_ERROR("[SERVER] New Connection Error: " << ec.message());
           }
 
           waitForClientConnection();
       });
     }
 
+    //@ASYNC - wait for a process on this host to connect through shared memory
+    void WaitForSharedConnection()
+    {
+      size_t nWorker = m_nNextWorker;
+      m_nNextWorker = (m_nNextWorker + 1) % WorkerCount();
+
+      m_shmAcceptor.async_accept(WorkerContext(nWorker),
+      [this, nWorker](std::error_code ec, asio::local::stream_protocol::socket socket)
+      {
+          if(!ec)
+          {
+            // the client sends its region right after connecting, one that
+            // doesn't in time only loses its socket
+            auto pSocket = std::make_shared<asio::local::stream_protocol::socket>(std::move(socket));
+            if(m_shm.handshakeTimeout.count())
+              m_vWheels[nWorker]->schedule(m_shm.handshakeTimeout, [pSocket]()
+              {
+                asio::error_code ecClose;
+                pSocket->close(ecClose);
+              });
+            WaitForSharedRegion(nWorker, pSocket);
+          }
+          else
+          {
+            SONICPP_LOG_ERROR("[SERVER] New Shared Memory Connection Error: " << ec.message());
+          }
+
+          if(m_shmAcceptor.is_open())
+            WaitForSharedConnection();
+      });
+    }
+
+    //@ASYNC - the region arrives on the unix socket, read without blocking once it's readable
+    void WaitForSharedRegion(size_t nWorker, std::shared_ptr<asio::local::stream_protocol::socket> pSocket)
+    {
+      pSocket->async_wait(asio::local::stream_protocol::socket::wait_read,
+        [this, nWorker, pSocket](std::error_code ec)
+        {
+          if(!ec)
+            AcceptShared(nWorker, pSocket);
+        });
+    }
+
+    // Safe to call from any thread, OnClientDisconnect is called only once per client
     void KickClient(std::shared_ptr<Connection> client)
     {
-        std::cout << "[" << client->GetID() << "] Disconnected" << std::endl;
+        if(!client)
+          return;
+
+        // whoever removes the client from the set is the one to report it
+        if(!m_connections.erase(client))
+          return;
+
+        // a suspended session ends here, it can't be resumed anymore
+        client->m_bSuspended = false;
+        client->CloseLocal();
+        // the other process notices the unix socket closing
+        if(client->m_pShm)
+          client->Disconnect();
+        if(client->m_nSessionToken)
+        {
+          std::lock_guard<std::mutex> lock(m_muxSessions);
+          m_mapSessions.erase(client->m_nSessionToken);
+        }
+        if(client->m_nUdpToken)
+        {
+          std::lock_guard<std::mutex> lock(m_muxUdp);
+          m_mapUdpTokens.erase(client->m_nUdpToken);
+        }
+
+        {
+          std::lock_guard<std::mutex> lock(m_muxGroups);
+          m_groups.leave_all(client->GetID());
+        }
+
+        m_metrics.connectionsDropped.add();
+        SONICPP_LOG_INFO("[" << client->GetID() << "] Disconnected");
         OnClientDisconnect(client);
-        client.reset();
-        
-        m_deqConnections.erase(
-          std::remove(m_deqConnections.begin(), m_deqConnections.end(), nullptr), m_deqConnections.end());
     }
       
     void MessageClient(uint32_t client_id, const Message& msg){
-      for(auto& client : m_deqConnections)
+      // iterate stable snapshot, kicks publish a new version
+      auto connections = m_connections.snapshot();
+      for(auto& client : *connections)
       {
-        if(!client || !client->IsConnected())
+        if(!client->IsConnected())
           KickClient(client);
-        else if(client->GetId()==client_id)
+        else if(client->GetID()==client_id)
           MessageClient(client, msg);
       }
     }
@@ -125,34 +439,150 @@ namespace sonicpp{
     {
       if(client && client->IsConnected())
       {
-        client->Send(msg);
+        if(IsTickThread() && !client->m_bLocal)
+          AddToOutbox(client, std::make_shared<const Message>(msg));
+        else
+          client->Send(msg);
       }
       else
         KickClient(client);
     }
     
+    // Over UDP once the client's channel is bound, may be lost or reordered
+    void MessageClientUnreliable(std::shared_ptr<Connection> client, const Message& msg)
+    {
+      MessageClientUdp(client, msg, {Delivery::Unreliable});
+    }
+
+    // Over UDP the given way once the client's channel is bound, over TCP until then
+    void MessageClientUdp(std::shared_ptr<Connection> client, const Message& msg, UdpChannel channel)
+    {
+      if(client && client->IsConnected())
+        client->SendUdp(msg, channel);
+      else
+        KickClient(client);
+    }
+    
     void MessageAllClients(const Message& msg, std::shared_ptr<Connection> pIgnoreClient = nullptr)
     {
-      // Flag to indicate that some clients died, to remove them all at once from the collection
-      bool bInvalidClientExits = false;
-      for(auto& client : m_deqConnections)
+      // Lock-free snapshot, accepts and disconnects happening meanwhile
+      // publish new versions and don't invalidate this one
+      auto connections = m_connections.snapshot();
+      FanOut(connections->begin(), connections->end(), msg, pIgnoreClient);
+    }
+
+    // Rooms, a client can be a member of any number of groups
+    // Safe to call from any thread
+    GroupID CreateGroup()
+    {
+      std::lock_guard<std::mutex> lock(m_muxGroups);
+      return m_groups.create();
+    }
+
+    void DestroyGroup(GroupID group)
+    {
+      std::lock_guard<std::mutex> lock(m_muxGroups);
+      m_groups.destroy(group);
+    }
+
+    bool JoinGroup(GroupID group, std::shared_ptr<Connection> client)
+    {
+      if(!client)
+        return false;
+      std::lock_guard<std::mutex> lock(m_muxGroups);
+      return m_groups.join(group, client->GetID(), client);
+    }
+
+    bool LeaveGroup(GroupID group, std::shared_ptr<Connection> client)
+    {
+      if(!client)
+        return false;
+      std::lock_guard<std::mutex> lock(m_muxGroups);
+      return m_groups.leave(group, client->GetID());
+    }
+
+    size_t GroupSize(GroupID group)
+    {
+      std::lock_guard<std::mutex> lock(m_muxGroups);
+      return m_groups.members(group).size();
+    }
+
+    // Serialize msg once and send it to the members of the group only
+    void MessageGroup(GroupID group, const Message& msg, std::shared_ptr<Connection> pIgnoreClient = nullptr)
+    {
+      std::vector<std::shared_ptr<Connection>> vDead;
       {
-        if(client && client->IsConnected())
-        {
-          if(client == pIgnoreClient)
-            continue;
+        std::lock_guard<std::mutex> lock(m_muxGroups);
+        const auto& members = m_groups.members(group);
+        PostFanOut(members.begin(), members.end(), std::make_shared<const Message>(msg), pIgnoreClient, vDead);
+      }
+      // kicking modifies the groups, do it outside of the iteration
+      for(auto& client : vDead)
+        KickClient(client);
+    }
 
-          client->Send(msg);
-        }
-        else
+    // Maximal number of recipients handed to an io thread in a single post
+    void SetFanOutBatchSize(size_t nBatchSize)
+    {
+      m_nFanOutBatch = std::max<size_t>(nBatchSize, 1);
+    }
+
+    // Optional fixed rate driver, blocks until StopTicks()
+    // Every tick drains incoming messages, calls OnTick and then flushes everything
+    // sent from this thread during the tick with a single write per connection
+    void RunTicks(double fTicksPerSecond)
+    {
+      using clock = std::chrono::steady_clock;
+      const auto period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / fTicksPerSecond));
+
+      m_vOutbox.resize(WorkerCount());
+      m_tickThread = std::this_thread::get_id();
+      m_bTicking = true;
+
+      auto tpNext = clock::now();
+      auto tpLast = tpNext;
+      while(m_bTicking)
+      {
+        const auto tpStart = clock::now();
+        const float fDeltaTime = std::chrono::duration<float>(tpStart - tpLast).count();
+        tpLast = tpStart;
+
+        Update();
+        OnTick(fDeltaTime);
+        FlushOutbox();
+
+        const auto tpEnd = clock::now();
+        m_tickStats.nTicks++;
+        m_tickStats.lastTickTime = std::chrono::duration_cast<std::chrono::microseconds>(tpEnd - tpStart);
+        m_tickStats.maxTickTime = std::max(m_tickStats.maxTickTime, m_tickStats.lastTickTime);
+
+        // schedule against the ideal timeline so sleep inaccuracies don't accumulate
+        tpNext += period;
+        if(tpEnd > tpNext)
         {
-          KickClient(client);
+          m_tickStats.nOverruns++;
+          OnTickOverrun(std::chrono::duration_cast<std::chrono::microseconds>(tpEnd - tpNext));
+          // too far behind to catch up, drop the missed ticks
+          if(tpEnd - tpNext > period)
+            tpNext = tpEnd;
         }
+        else
+          std::this_thread::sleep_until(tpNext);
       }
 
-      if(bInvalidClientExits)
-        m_deqConnections.erase(
-          std::remove(m_deqConnections.begin(), m_deqConnections.end(), nullptr), m_deqConnections.end());
+      m_tickThread = std::thread::id{};
+    }
+
+    // Safe to call from any thread, RunTicks returns after the current tick
+    void StopTicks()
+    {
+      m_bTicking = false;
+    }
+
+    // Only meant to be read from the ticking thread
+    const TickStats& GetTickStats() const
+    {
+      return m_tickStats;
     }
 
     void Update(const size_t nMaxMessages = std::numeric_limits<size_t>::max(), bool bWait = false)
@@ -165,9 +595,27 @@ namespace sonicpp{
         // Grab the front message
         owned_message<T> msg = m_qMessagesIn.pop_front();
 
+        // connection reported its own death
+        if(is_system_id(msg.msg.GetType()))
+        {
+          KickClient(msg.remote);
+          continue;
+        }
+
           
-        // Pass to message handler
-        OnMessage(msg.remote, msg.msg);
+#ifdef SONICPP_TRACE
+        const size_t nTypeSlot = MetricsRegistry::type_slot(msg.msg.GetType());
+        const auto tpDispatch = std::chrono::steady_clock::now();
+        m_metrics.tracer.record(TraceStage::Queue, nTypeSlot, tpDispatch - msg.trace.tpQueued);
+#endif
+
+        // Pass to the registered handler, or the generic one
+        if(!m_dispatcher.Dispatch(msg.remote, msg.msg))
+          OnMessage(msg.remote, msg.msg);
+
+#ifdef SONICPP_TRACE
+        m_metrics.tracer.record(TraceStage::Handler, nTypeSlot, std::chrono::steady_clock::now() - tpDispatch);
+#endif
 
         if(!msg.remote || !msg.remote->IsConnected()){
           KickClient(msg.remote);
@@ -178,6 +626,118 @@ namespace sonicpp{
       }
     }
     
+  protected:
+    // Serialize msg once and hand it to every connection in [first, last),
+    // recipients are split per io thread and posted in batches
+    template<typename It>
+    void FanOut(It first, It last, const Message& msg, const std::shared_ptr<Connection>& pIgnoreClient = nullptr)
+    {
+      std::vector<std::shared_ptr<Connection>> vDead;
+      PostFanOut(first, last, std::make_shared<const Message>(msg), pIgnoreClient, vDead);
+      for(auto& client : vDead)
+        KickClient(client);
+    }
+
+    // Post payload to every connected client in [first, last),
+    // disconnected ones are collected in vDead for the caller to kick
+    template<typename It>
+    void PostFanOut(It first, It last, const std::shared_ptr<const Message>& payload, 
+      const std::shared_ptr<Connection>& pIgnoreClient, std::vector<std::shared_ptr<Connection>>& vDead)
+    {
+      // during a tick everything waits for the end of tick flush
+      const bool bBatching = IsTickThread();
+      std::vector<std::vector<std::shared_ptr<Connection>>> vBatches(bBatching ? 0 : WorkerCount());
+
+      auto postBatch = [&](size_t nWorker)
+      {
+        asio::post(WorkerContext(nWorker),
+          [payload, batch = std::move(vBatches[nWorker])]()
+          {
+            for(auto& client : batch)
+              client->QueueOutgoing(payload);
+          });
+        vBatches[nWorker] = {};
+      };
+
+      for(; first != last; ++first)
+      {
+        const std::shared_ptr<Connection>& client = *first;
+        if(!client || !client->IsConnected())
+        {
+          vDead.push_back(client);
+          continue;
+        }
+        if(client == pIgnoreClient)
+          continue;
+
+        // nothing to batch, handed over right here
+        if(client->m_bLocal)
+        {
+          client->QueueOutgoing(payload);
+          continue;
+        }
+
+        if(bBatching)
+        {
+          AddToOutbox(client, payload);
+          continue;
+        }
+
+        auto& batch = vBatches[client->m_nWorker];
+        batch.push_back(client);
+        if(batch.size() >= m_nFanOutBatch)
+          postBatch(client->m_nWorker);
+      }
+
+      for(size_t i = 0; i < vBatches.size(); ++i)
+        if(!vBatches[i].empty())
+          postBatch(i);
+    }
+
+    bool IsTickThread() const
+    {
+      return m_tickThread.load(std::memory_order_relaxed) == std::this_thread::get_id();
+    }
+
+    // Gather messages per connection until the end of the tick
+    void AddToOutbox(const std::shared_ptr<Connection>& client, std::shared_ptr<const Message> payload)
+    {
+      auto& outbox = m_vOutbox[client->m_nWorker];
+      auto [it, bNew] = m_mapOutboxIndex.emplace(client.get(), outbox.size());
+      if(bNew)
+        outbox.push_back({client, {}});
+      outbox[it->second].vPayloads.push_back(std::move(payload));
+    }
+
+    // One post per io thread, one write per connection
+    void FlushOutbox()
+    {
+      for(size_t i = 0; i < m_vOutbox.size(); ++i)
+      {
+        if(m_vOutbox[i].empty())
+          continue;
+
+        asio::post(WorkerContext(i),
+          [outbox = std::move(m_vOutbox[i])]()
+          {
+            for(auto& entry : outbox)
+              entry.client->QueueOutgoing(entry.vPayloads);
+          });
+        m_vOutbox[i] = {};
+      }
+      m_mapOutboxIndex.clear();
+    }
+
+    size_t WorkerCount() const
+    {
+      return m_vWorkerContexts.empty() ? 1 : m_vWorkerContexts.size();
+    }
+
+    asio::io_context& WorkerContext(size_t nWorker)
+    {
+      return m_vWorkerContexts.empty() ? m_asioContext : *m_vWorkerContexts[nWorker];
+    }
+
   // Functions that could be obertitten by the derrived class
   protected:
     // Called when a new client connects 
@@ -189,24 +749,342 @@ namespace sonicpp{
     // Called when a message arrives
     virtual void OnMessage(std::shared_ptr<Connection> client, Message& msg)
     {}
+    // Called every tick when driven by RunTicks, dt in seconds since the previous tick
+    virtual void OnTick(float)
+    {}
+    // Called when a tick took longer than the tick period, lateness past the deadline
+    virtual void OnTickOverrun(std::chrono::microseconds)
+    {}
+    // Called when a dropped client came back and got its session back,
+    // it keeps its id and receives the messages it missed, the connection
+    // it came back on is reported to OnClientDisconnect
+    virtual void OnClientResumed(std::shared_ptr<Connection> client)
+    {}
   public: 
     // 
     virtual void OnClientValidated(std::shared_ptr<Connection> client)
     {}
 
   protected:
+    // Called on the client's io thread once it's validated
+    void BeginSession(std::shared_ptr<Connection> client)
+    {
+      if(m_session.resumeTimeout.count() == 0)
+        return;
+
+      uint64_t nToken;
+      {
+        std::lock_guard<std::mutex> lock(m_muxSessions);
+        do
+          nToken = m_rngSessions();
+        while(nToken == 0 || m_mapSessions.count(nToken));
+        m_mapSessions[nToken] = client;
+      }
+      client->m_nSessionToken = nToken;
+      client->SendSession(false, client->m_nSequence);
+    }
+
+    // Other end of ClientIntefrace::ConnectLocal, runs on the caller's thread,
+    // OnClientConnect and OnClientValidated are called from it. Works without Start()
+    bool AcceptLocal(std::shared_ptr<Connection> peer)
+    {
+      std::shared_ptr<Connection> newconn =
+        std::make_shared<Connection>(
+          Connection::Owner::Server,
+          asio::ip::tcp::socket(WorkerContext(0)),
+          m_qMessagesIn
+      );
+      newconn->m_bLocal = true;
+      newconn->m_pMetrics = &m_metrics;
+
+      if(!OnClientConnect(newconn))
+      {
+        SONICPP_LOG_INFO("[------] Connection Denied");
+        return false;
+      }
+
+      newconn->id = nIDCounter++;
+      Connection::PairLocal(peer, newconn);
+      m_connections.push_back(newconn);
+      m_metrics.connectionsAccepted.add();
+      SONICPP_LOG_INFO("[" << newconn->GetID() << "] Local Connection");
+      OnClientValidated(newconn);
+      return true;
+    }
+
+    // Runs on the io thread of the new connection
+    void AcceptShared(size_t nWorker, std::shared_ptr<asio::local::stream_protocol::socket> pSocket)
+    {
+      std::unique_ptr<shm_region> pRegion;
+      try
+      {
+        pRegion = shm_region::receive(pSocket->native_handle());
+      }
+      catch(std::exception& e)
+      {
+        m_metrics.handshakeFailures.add();
+        SONICPP_LOG_WARNING("[SERVER] Shared Memory Handshake Failed: " << e.what());
+        return;
+      }
+      // readable without the region in it yet
+      if(!pRegion)
+      {
+        WaitForSharedRegion(nWorker, pSocket);
+        return;
+      }
+
+      std::shared_ptr<Connection> newconn =
+        std::make_shared<Connection>(
+          Connection::Owner::Server,
+          asio::ip::tcp::socket(WorkerContext(nWorker)),
+          m_qMessagesIn
+      );
+      newconn->m_nWorker = nWorker;
+      newconn->m_pWheel = m_vWheels[nWorker].get();
+      newconn->m_rateLimit = m_rateLimit;
+      newconn->m_msgBucket = token_bucket(m_rateLimit.fMessagesPerSecond, m_rateLimit.fMessageBurst);
+      newconn->m_byteBucket = token_bucket(m_rateLimit.fBytesPerSecond, m_rateLimit.fByteBurst);
+      newconn->m_pMetrics = &m_metrics;
+
+      // denied clients see the socket close instead of their id
+      if(!OnClientConnect(newconn))
+      {
+        SONICPP_LOG_INFO("[------] Connection Denied");
+        return;
+      }
+
+      newconn->id = nIDCounter++;
+      asio::async_write(*pSocket, asio::buffer(&newconn->id, sizeof(newconn->id)),
+        [this, newconn, pSocket, pRegion = std::move(pRegion)](std::error_code ec, std::size_t) mutable
+        {
+          if(ec)
+            return;
+          newconn->OpenShared(std::move(pRegion), std::move(*pSocket), m_shm.spin);
+
+          m_connections.push_back(newconn);
+          m_metrics.connectionsAccepted.add();
+          SONICPP_LOG_INFO("[" << newconn->GetID() << "] Shared Memory Connection");
+          OnClientValidated(newconn);
+        });
+    }
+
+    // Called on the client's io thread once it's validated or resumed,
+    // offers the datagram channel, the token stays for the whole session
+    void BindDatagrams(std::shared_ptr<Connection> client)
+    {
+      if(!m_udp.bEnabled)
+        return;
+
+      if(client->m_nUdpToken == 0)
+      {
+        std::lock_guard<std::mutex> lock(m_muxUdp);
+        uint64_t nToken;
+        do
+          nToken = m_rngUdp();
+        while(nToken == 0 || m_mapUdpTokens.count(nToken));
+        m_mapUdpTokens[nToken] = client;
+        client->m_nUdpToken = nToken;
+        client->m_reliable.configure(m_udp, 0);
+      }
+
+      auto msg = std::make_shared<Message>(system_id<T>(SystemMessage::UdpBind));
+      *msg << client->m_nUdpToken << m_nUdpPort;
+      client->QueueOutgoing(msg);
+    }
+
+    //@ASYNC - datagrams of all clients, handed to their connections by token
+    void ReceiveDatagrams()
+    {
+      m_udpSocket.async_wait(asio::ip::udp::socket::wait_read,
+        [this](std::error_code ec)
+        {
+          if(ec || !m_udpSocket.is_open())
+            return;
+
+          // a few batches per wakeup, a flood mustn't starve the acceptor
+          for(size_t nRound = 0; nRound < 4; ++nRound)
+          {
+            size_t nReceived = m_datagramsIn.receive(m_udpSocket.native_handle());
+            DispatchDatagrams(nReceived);
+            if(nReceived < m_datagramsIn.capacity())
+              break;
+          }
+          ReceiveDatagrams();
+        });
+    }
+
+    void DispatchDatagrams(size_t nReceived)
+    {
+      if(nReceived == 0)
+        return;
+
+      std::vector<std::shared_ptr<Connection>> vClients(nReceived);
+      {
+        std::lock_guard<std::mutex> lock(m_muxUdp);
+        for(size_t i = 0; i < nReceived; ++i)
+        {
+          uint64_t nToken;
+          if(m_datagramsIn.size(i) < sizeof(nToken))
+            continue;
+          std::memcpy(&nToken, m_datagramsIn.data(i), sizeof(nToken));
+          auto it = m_mapUdpTokens.find(nToken);
+          if(it != m_mapUdpTokens.end())
+            vClients[i] = it->second.lock();
+        }
+      }
+
+      // unknown senders are ignored, the connection's state is only touched on its own io thread
+      for(size_t i = 0; i < nReceived; ++i)
+      {
+        if(!vClients[i])
+          continue;
+        const uint8_t* pData = m_datagramsIn.data(i) + sizeof(uint64_t);
+        asio::post(vClients[i]->m_executor,
+          [client = vClients[i], sender = m_datagramsIn.from(i),
+           vPacket = std::vector<uint8_t>(pData, pData + m_datagramsIn.size(i) - sizeof(uint64_t))]()
+          {
+            client->ReadDatagram(sender, vPacket);
+          });
+      }
+    }
+
+    // Called on the io thread of a freshly validated connection asking for
+    // session nToken, returns false if it should start a new session instead
+    bool ResumeSession(std::shared_ptr<Connection> incoming, uint64_t nToken, uint64_t nReceived)
+    {
+      std::shared_ptr<Connection> session;
+      {
+        std::lock_guard<std::mutex> lock(m_muxSessions);
+        auto it = m_mapSessions.find(nToken);
+        if(it != m_mapSessions.end())
+          session = it->second.lock();
+      }
+      if(!session || !session->m_bSuspended)
+        return false;
+
+      // the socket is released here, on the incoming connection's io thread,
+      // nothing of it is touched by the session's
+      asio::error_code ec;
+      const auto protocol = incoming->m_socket.local_endpoint(ec).protocol();
+      if(ec)
+        return false;
+      const auto handle = incoming->m_socket.release(ec);
+      if(ec)
+        return false;
+
+      // the session's state is only touched on its own io thread
+      asio::post(WorkerContext(session->m_nWorker), [this, session, incoming, protocol, handle, nReceived]()
+      {
+        const bool bResumed = session->Resume(protocol, handle, nReceived);
+
+        // and the incoming connection's on its own
+        asio::post(incoming->m_executor, [this, incoming, protocol, handle, bResumed]()
+        {
+          // the socket lives on in the session, the incoming connection goes away
+          if(bResumed)
+          {
+            incoming->Drop();
+            return;
+          }
+          // expired meanwhile or missed too much, start over on the same socket
+          asio::error_code ecAssign;
+          incoming->m_socket.assign(protocol, handle, ecAssign);
+          // nobody owns the handle then
+          if(ecAssign)
+            ::close(handle);
+          if(ecAssign || incoming->m_bDropped)
+            incoming->Drop();
+          else
+            incoming->Validated(this);
+        });
+
+        if(bResumed)
+        {
+          BindDatagrams(session);
+          OnClientResumed(session);
+        }
+      });
+      return true;
+    }
+
+  protected:
+    // Counters of all connections, outlives them
+    MetricsRegistry m_metrics{};
+
     // Thread safe Queue of incoming message packets
     tsqueue<owned_message<T>> m_qMessagesIn;
+    // Typed handlers registered with On(), used by Update
+    Dispatcher<T> m_dispatcher{&m_metrics.malformed};
 
-    // Container of active validated connections
-    std::deque<std::shared_ptr<Connection>> m_deqConnections;
+    // Container of active connections, written by the accept handler
+    // and kicks, iterated by broadcasts through snapshots
+    cowlist<std::shared_ptr<Connection>> m_connections;
+
+    // Rooms of connections, guarded as join/leave can come from io threads
+    groupset<std::shared_ptr<Connection>> m_groups;
+    std::mutex m_muxGroups;
     
+    // Additional io threads, each runs its own context with its own connections,
+    // declared first so they outlive pending accepts on the acceptor context
+    std::vector<std::unique_ptr<asio::io_context>> m_vWorkerContexts;
+    std::vector<asio::executor_work_guard<asio::io_context::executor_type>> m_vWorkGuards;
+    std::vector<std::thread> m_vWorkerThreads;
+    size_t m_nNextWorker = 0;
+    size_t m_nFanOutBatch = 256;
+
+    // Context of the acceptor, also serves connections when running single threaded
     asio::io_context m_asioContext;
     std::thread m_threadContext;
 
+    // Timing wheel of every io thread, destroyed before the contexts
+    std::vector<std::unique_ptr<timing_wheel>> m_vWheels;
+    HeartbeatConfig m_heartbeat{};
+    ClockSyncConfig m_clockSync{};
+    RateLimitConfig m_rateLimit{};
+
+    asio::ip::tcp::endpoint m_endpoint;
     asio::ip::tcp::acceptor m_asioAcceptor;
+    size_t m_nPendingAccepts = 1;
+    int m_nListenBacklog = asio::socket_base::max_listen_connections;
+    SocketOptions m_socketOptions{};
+
+    // Datagram channel, the connections write to the socket directly
+    UdpConfig m_udp{};
+    udp_routes<T> m_udpRoutes;
+    asio::ip::udp::socket m_udpSocket{m_asioContext};
+    datagram_batch m_datagramsIn;
+    uint16_t m_nUdpPort = 0;
+    std::mutex m_muxUdp;
+    std::unordered_map<uint64_t, std::weak_ptr<Connection>> m_mapUdpTokens;
+    std::mt19937_64 m_rngUdp{std::random_device{}()};
+
+    // Shared memory connections, accepted on the acceptor's thread
+    SharedMemoryConfig m_shm{};
+    asio::local::stream_protocol::acceptor m_shmAcceptor{m_asioContext};
+
+    // Resumable sessions by token
+    SessionConfig m_session{};
+    std::mutex m_muxSessions;
+    std::unordered_map<uint64_t, std::weak_ptr<Connection>> m_mapSessions;
+    std::mt19937_64 m_rngSessions{std::random_device{}()};
+
+    // also taken by local connections on the client's thread
+    std::atomic<uint32_t> nIDCounter = 10000;
+
+    // Tick driver
+    struct OutboxEntry
+    {
+      std::shared_ptr<Connection> client;
+      std::vector<std::shared_ptr<const Message>> vPayloads;
+    };
+    std::atomic<bool> m_bTicking = false;
+    std::atomic<std::thread::id> m_tickThread{};
+    // messages sent during the current tick, per io thread
+    std::vector<std::vector<OutboxEntry>> m_vOutbox;
+    std::unordered_map<Connection*, size_t> m_mapOutboxIndex;
+    TickStats m_tickStats{};
 
-    uint32_t nIDCounter = 10000;
+    std::unique_ptr<MetricsDumper> m_metricsDumper;
   };
   
 }
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+
+namespace sonicpp
+{
+
+  // Server side session resume
+  // A client that lost its connection can come back within resumeTimeout,
+  // it gets its old connection object (id, groups) back and the messages it
+  // didn't receive are replayed. Meanwhile the connection counts as connected
+  // and messages sent to it are kept. Zero timeout disables sessions.
+  struct SessionConfig
+  {
+    std::chrono::milliseconds resumeTimeout{0};
+    // messages kept for replay, a client that missed more starts over
+    size_t nReplayMessages = 256;
+  };
+
+  // Client side reconnection, delays double after every failed attempt
+  struct ReconnectConfig
+  {
+    bool bEnabled = false;
+    std::chrono::milliseconds initialDelay{250};
+    std::chrono::milliseconds maxDelay{10'000};
+    // zero tries forever
+    size_t nMaxAttempts = 0;
+  };
+
+  // Client's answer to the server's handshake
+  struct handshake_reply
+  {
+    uint64_t nAnswer = 0;
+    // session to resume, zero for a new one
+    uint64_t nToken = 0;
+    // messages received in that session, the server replays the rest
+    uint64_t nReceived = 0;
+  };
+
+}
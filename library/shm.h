@@ -0,0 +1,333 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <system_error>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+namespace sonicpp
+{
+
+  // Shared memory connections for processes on the same host
+  // The client creates a memory region with a ring for each direction and
+  // hands it, along with an eventfd per side, to the server over a unix
+  // socket. Messages are then copied into the rings with no system call,
+  // the eventfds only wake a side that went to sleep. The unix socket stays
+  // open so either side notices when the other process goes away.
+  struct SharedMemoryConfig
+  {
+    bool bEnabled = false;
+    // server: path of the unix socket the clients connect to
+    std::string sPath;
+    // client: bytes of each ring, messages larger than that stream through it
+    size_t nRingSize = 1 << 20;
+    // keep polling the ring for this long before going to sleep, trades a busy
+    // io thread for latency below the cost of a wakeup
+    std::chrono::microseconds spin{0};
+    // server: a client that hasn't sent its region by then is dropped, zero waits forever
+    std::chrono::milliseconds handshakeTimeout{1000};
+  };
+
+  // Positions of one ring, shared by both processes
+  struct shm_ring_control
+  {
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "atomics in shared memory have to be lock free");
+
+    // bytes ever written and read, written only by the producer and the consumer
+    alignas(64) std::atomic<uint64_t> nWrite{0};
+    alignas(64) std::atomic<uint64_t> nRead{0};
+    // the consumer waits on its eventfd
+    alignas(64) std::atomic<uint32_t> bSleeping{0};
+    // the producer has data waiting for room
+    std::atomic<uint32_t> bBlocked{0};
+  };
+
+  // Single producer single consumer byte stream in shared memory
+  class shm_ring
+  {
+  protected:
+    shm_ring_control* m_pControl = nullptr;
+    uint8_t* m_pData = nullptr;
+    size_t m_nCapacity = 0;
+
+  public:
+    shm_ring() = default;
+    shm_ring(void* pMemory, size_t nCapacity)
+      : m_pControl(static_cast<shm_ring_control*>(pMemory)),
+        m_pData(static_cast<uint8_t*>(pMemory) + sizeof(shm_ring_control)),
+        m_nCapacity(nCapacity)
+    {}
+
+    static constexpr size_t footprint(size_t nCapacity)
+    {
+      return sizeof(shm_ring_control) + nCapacity;
+    }
+
+    // Producer: copies as much as fits, returns the bytes written
+    size_t write(const void* pData, size_t nLength)
+    {
+      const uint64_t nWrite = m_pControl->nWrite.load(std::memory_order_relaxed);
+      nLength = std::min(nLength, free_space());
+      copy_in(nWrite, static_cast<const uint8_t*>(pData), nLength);
+      m_pControl->nWrite.store(nWrite + nLength, std::memory_order_release);
+      return nLength;
+    }
+
+    // Producer: continues writing two buffers back to back from nOffset into
+    // them, e.g. a message's header and body, returns the new offset
+    size_t write(size_t nOffset, const void* pFirst, size_t nFirst, const void* pSecond, size_t nSecond)
+    {
+      if(nOffset < nFirst)
+        nOffset += write(static_cast<const uint8_t*>(pFirst) + nOffset, nFirst - nOffset);
+      if(nOffset >= nFirst)
+        nOffset += write(static_cast<const uint8_t*>(pSecond) + (nOffset - nFirst), nSecond - (nOffset - nFirst));
+      return nOffset;
+    }
+
+    // Producer: whether the consumer sleeps and needs a wakeup for what was written,
+    // only one caller gets true
+    bool wake_consumer()
+    {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      return m_pControl->bSleeping.load(std::memory_order_relaxed) &&
+             m_pControl->bSleeping.exchange(0);
+    }
+
+    // Producer: ask for a wakeup once there's room, false when there is room already
+    bool block()
+    {
+      m_pControl->bBlocked.store(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if(free_space())
+      {
+        m_pControl->bBlocked.store(0);
+        return false;
+      }
+      return true;
+    }
+
+    // Consumer: copies out up to nLength bytes, returns the bytes read
+    size_t read(void* pData, size_t nLength)
+    {
+      const uint64_t nRead = m_pControl->nRead.load(std::memory_order_relaxed);
+      nLength = std::min(nLength, readable());
+      copy_out(nRead, static_cast<uint8_t*>(pData), nLength);
+      m_pControl->nRead.store(nRead + nLength, std::memory_order_release);
+      return nLength;
+    }
+
+    // Consumer: whether the producer waits for the room just made, only one caller gets true
+    bool wake_producer()
+    {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      return m_pControl->bBlocked.load(std::memory_order_relaxed) &&
+             m_pControl->bBlocked.exchange(0);
+    }
+
+    // Consumer: announce going to sleep, false when data arrived meanwhile
+    bool sleep()
+    {
+      m_pControl->bSleeping.store(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if(readable())
+      {
+        m_pControl->bSleeping.store(0);
+        return false;
+      }
+      return true;
+    }
+
+    // both clamped, the other process could write anything into the positions
+    size_t readable() const
+    {
+      const uint64_t nUsed = m_pControl->nWrite.load(std::memory_order_acquire) - m_pControl->nRead.load(std::memory_order_relaxed);
+      return std::min<uint64_t>(nUsed, m_nCapacity);
+    }
+
+    size_t free_space() const
+    {
+      const uint64_t nUsed = m_pControl->nWrite.load(std::memory_order_relaxed) - m_pControl->nRead.load(std::memory_order_acquire);
+      return m_nCapacity - std::min<uint64_t>(nUsed, m_nCapacity);
+    }
+
+  protected:
+    void copy_in(uint64_t nPosition, const uint8_t* pData, size_t nLength)
+    {
+      if(nLength == 0)
+        return;
+      const size_t nOffset = nPosition % m_nCapacity;
+      const size_t nFirst = std::min(nLength, m_nCapacity - nOffset);
+      std::memcpy(m_pData + nOffset, pData, nFirst);
+      std::memcpy(m_pData, pData + nFirst, nLength - nFirst);
+    }
+
+    void copy_out(uint64_t nPosition, uint8_t* pData, size_t nLength) const
+    {
+      if(nLength == 0)
+        return;
+      const size_t nOffset = nPosition % m_nCapacity;
+      const size_t nFirst = std::min(nLength, m_nCapacity - nOffset);
+      std::memcpy(pData, m_pData + nOffset, nFirst);
+      std::memcpy(pData + nFirst, m_pData, nLength - nFirst);
+    }
+  };
+
+  // The mapped region and the eventfds of one connection
+  // Ring 0 carries client to server, ring 1 server to client,
+  // eventfd 0 wakes the server and eventfd 1 the client
+  class shm_region
+  {
+  protected:
+    int m_nMemory = -1;
+    int m_vEvents[2] = {-1, -1};
+    void* m_pMemory = MAP_FAILED;
+    size_t m_nLength = 0;
+    size_t m_nRingSize = 0;
+    bool m_bServer = false;
+
+  public:
+    shm_region() = default;
+    shm_region(const shm_region&) = delete;
+    shm_region& operator=(const shm_region&) = delete;
+
+    ~shm_region()
+    {
+      if(m_pMemory != MAP_FAILED)
+        ::munmap(m_pMemory, m_nLength);
+      for(int nFd : {m_nMemory, m_vEvents[0], m_vEvents[1]})
+        if(nFd >= 0)
+          ::close(nFd);
+    }
+
+    // Client: a fresh region, throws std::system_error
+    static std::unique_ptr<shm_region> create(size_t nRingSize)
+    {
+      auto region = std::make_unique<shm_region>();
+      // whole pages keep the second ring's positions on their own cache lines
+      region->m_nRingSize = std::max<size_t>((nRingSize + 4095) / 4096 * 4096, 4096);
+      region->m_nLength = 2 * shm_ring::footprint(region->m_nRingSize);
+      region->m_nMemory = ::memfd_create("sonicpp", MFD_CLOEXEC);
+      if(region->m_nMemory < 0 || ::ftruncate(region->m_nMemory, region->m_nLength) < 0)
+        throw_errno("memfd");
+      for(int& nFd : region->m_vEvents)
+        if((nFd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+          throw_errno("eventfd");
+      region->map();
+      new (region->m_pMemory) shm_ring_control();
+      new (static_cast<uint8_t*>(region->m_pMemory) + shm_ring::footprint(region->m_nRingSize)) shm_ring_control();
+      return region;
+    }
+
+    // Client: pass the descriptors to the server
+    void send(int nSocket) const
+    {
+      uint64_t nRingSize = m_nRingSize;
+      iovec buffer{&nRingSize, sizeof(nRingSize)};
+      alignas(cmsghdr) char vControl[CMSG_SPACE(3 * sizeof(int))]{};
+      msghdr packet{};
+      packet.msg_iov = &buffer;
+      packet.msg_iovlen = 1;
+      packet.msg_control = vControl;
+      packet.msg_controllen = sizeof(vControl);
+      cmsghdr* pControl = CMSG_FIRSTHDR(&packet);
+      pControl->cmsg_level = SOL_SOCKET;
+      pControl->cmsg_type = SCM_RIGHTS;
+      pControl->cmsg_len = CMSG_LEN(3 * sizeof(int));
+      int vFds[3] = {m_nMemory, m_vEvents[0], m_vEvents[1]};
+      std::memcpy(CMSG_DATA(pControl), vFds, sizeof(vFds));
+      if(::sendmsg(nSocket, &packet, MSG_NOSIGNAL) != sizeof(nRingSize))
+        throw_errno("sendmsg");
+    }
+
+    // Server: take over the region a client sent, throws std::system_error
+    // Never blocks, null if nothing arrived yet
+    static std::unique_ptr<shm_region> receive(int nSocket)
+    {
+      auto region = std::make_unique<shm_region>();
+      region->m_bServer = true;
+      uint64_t nRingSize = 0;
+      iovec buffer{&nRingSize, sizeof(nRingSize)};
+      alignas(cmsghdr) char vControl[CMSG_SPACE(3 * sizeof(int))]{};
+      msghdr packet{};
+      packet.msg_iov = &buffer;
+      packet.msg_iovlen = 1;
+      packet.msg_control = vControl;
+      packet.msg_controllen = sizeof(vControl);
+      // the client sends it in one go, anything shorter is not a client
+      const ssize_t nRead = ::recvmsg(nSocket, &packet, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+      if(nRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return nullptr;
+      if(nRead < 0)
+        throw_errno("recvmsg");
+      if(nRead != sizeof(nRingSize))
+        throw std::system_error(std::make_error_code(std::errc::protocol_error), "shared memory handshake");
+      cmsghdr* pControl = CMSG_FIRSTHDR(&packet);
+      if(!pControl || pControl->cmsg_type != SCM_RIGHTS || pControl->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+        throw std::system_error(std::make_error_code(std::errc::protocol_error), "shared memory handshake");
+      int vFds[3];
+      std::memcpy(vFds, CMSG_DATA(pControl), sizeof(vFds));
+      region->m_nMemory = vFds[0];
+      region->m_vEvents[0] = vFds[1];
+      region->m_vEvents[1] = vFds[2];
+
+      // the client decides the size, but it has to match what it mapped
+      region->m_nRingSize = nRingSize;
+      region->m_nLength = 2 * shm_ring::footprint(nRingSize);
+      if(nRingSize < 4096 || nRingSize % 4096 || ::lseek(region->m_nMemory, 0, SEEK_END) != off_t(region->m_nLength))
+        throw std::system_error(std::make_error_code(std::errc::protocol_error), "shared memory size");
+      region->map();
+      return region;
+    }
+
+    shm_ring in() const { return ring(m_bServer ? 0 : 1); }
+    shm_ring out() const { return ring(m_bServer ? 1 : 0); }
+
+    // eventfd this side sleeps on
+    int wake_fd() const { return m_vEvents[m_bServer ? 0 : 1]; }
+
+    void wake_peer() const
+    {
+      uint64_t nOne = 1;
+      // a full counter already means a pending wakeup
+      [[maybe_unused]] auto n = ::write(m_vEvents[m_bServer ? 1 : 0], &nOne, sizeof(nOne));
+    }
+
+    // clear this side's wakeups
+    void reset_wake() const
+    {
+      uint64_t nCount;
+      [[maybe_unused]] auto n = ::read(wake_fd(), &nCount, sizeof(nCount));
+    }
+
+  protected:
+    void map()
+    {
+      m_pMemory = ::mmap(nullptr, m_nLength, PROT_READ | PROT_WRITE, MAP_SHARED, m_nMemory, 0);
+      if(m_pMemory == MAP_FAILED)
+        throw_errno("mmap");
+    }
+
+    shm_ring ring(size_t i) const
+    {
+      return shm_ring(static_cast<uint8_t*>(m_pMemory) + i * shm_ring::footprint(m_nRingSize), m_nRingSize);
+    }
+
+    [[noreturn]] static void throw_errno(const char* sWhat)
+    {
+      throw std::system_error(errno, std::system_category(), sWhat);
+    }
+  };
+
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <asio.hpp>
+#include <cerrno>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
+
+namespace sonicpp
+{
+
+  // Options applied to every accepted and every client socket
+  // Zero means leave the system default
+  struct SocketOptions
+  {
+    // Disable Nagle's algorithm, small game messages shouldn't wait for ACKs
+    bool bNoDelay = true;
+    int nSendBufferSize = 0;
+    int nReceiveBufferSize = 0;
+    // Linux only, limit of unsent bytes kept in the kernel send buffer
+    int nNotSentLowat = 0;
+    bool bKeepAlive = false;
+    // Linux only, in seconds
+    int nKeepAliveIdle = 0;
+    int nKeepAliveInterval = 0;
+    int nKeepAliveCount = 0;
+
+    // Returns the first error, the remaining options are still applied
+    asio::error_code Apply(asio::ip::tcp::socket& socket) const
+    {
+      asio::error_code first{};
+      auto check = [&first](const asio::error_code& ec){ if(ec && !first) first = ec; };
+      asio::error_code ec;
+
+      socket.set_option(asio::ip::tcp::no_delay(bNoDelay), ec); check(ec);
+      if(nSendBufferSize > 0)
+      {
+        socket.set_option(asio::socket_base::send_buffer_size(nSendBufferSize), ec); check(ec);
+      }
+      if(nReceiveBufferSize > 0)
+      {
+        socket.set_option(asio::socket_base::receive_buffer_size(nReceiveBufferSize), ec); check(ec);
+      }
+      if(bKeepAlive)
+      {
+        socket.set_option(asio::socket_base::keep_alive(true), ec); check(ec);
+      }
+
+#ifdef __linux__
+      auto setInt = [&](int level, int name, int value)
+      {
+        if(value > 0 && ::setsockopt(socket.native_handle(), level, name, &value, sizeof(value)) != 0)
+          check(asio::error_code(errno, asio::error::get_system_category()));
+      };
+#ifdef TCP_NOTSENT_LOWAT
+      setInt(IPPROTO_TCP, TCP_NOTSENT_LOWAT, nNotSentLowat);
+#endif
+      if(bKeepAlive)
+      {
+        setInt(IPPROTO_TCP, TCP_KEEPIDLE, nKeepAliveIdle);
+        setInt(IPPROTO_TCP, TCP_KEEPINTVL, nKeepAliveInterval);
+        setInt(IPPROTO_TCP, TCP_KEEPCNT, nKeepAliveCount);
+      }
+#endif
+      return first;
+    }
+  };
+
+}
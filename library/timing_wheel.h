@@ -0,0 +1,168 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <asio.hpp>
+
+
+namespace sonicpp
+{
+
+  // Hashed timing wheel
+  // Any number of timeouts share a single asio::steady_timer ticking at a fixed
+  // resolution, scheduling is O(1) and a tick only touches the current slot.
+  // Timeouts longer than one revolution wait the remaining number of rounds.
+  // Callbacks run on the wheel's context, schedule() is safe from any thread.
+  class timing_wheel
+  {
+  public:
+    using clock = std::chrono::steady_clock;
+
+  protected:
+    struct entry
+    {
+      // full revolutions left before the entry expires
+      size_t nRounds;
+      std::function<void()> fn;
+    };
+
+    asio::steady_timer m_timer;
+    const clock::duration m_resolution;
+    std::vector<std::vector<entry>> m_vSlots;
+    size_t m_nCurrent = 0;
+    size_t m_nEntries = 0;
+    bool m_bRunning = false;
+    clock::time_point m_tpNextTick{};
+    std::mutex muxWheel{};
+
+  public:
+    timing_wheel(asio::io_context& context, clock::duration resolution = std::chrono::milliseconds(50), size_t nSlots = 512)
+      : m_timer(context), m_resolution(resolution), m_vSlots(nSlots)
+    {}
+
+    timing_wheel(const timing_wheel&) = delete;
+
+    // fn is called once, no earlier than delay and at most one resolution later
+    void schedule(clock::duration delay, std::function<void()> fn)
+    {
+      std::lock_guard<std::mutex> lock(muxWheel);
+      size_t nTicks = std::max<size_t>(1, (delay + m_resolution - clock::duration(1)) / m_resolution);
+      size_t nSlot = (m_nCurrent + nTicks) % m_vSlots.size();
+      m_vSlots[nSlot].push_back({(nTicks - 1) / m_vSlots.size(), std::move(fn)});
+      m_nEntries++;
+
+      // the timer only runs while there is something to wait for
+      if(!m_bRunning)
+      {
+        m_bRunning = true;
+        m_tpNextTick = clock::now() + m_resolution;
+        asio::post(m_timer.get_executor(), [this](){ Arm(); });
+      }
+    }
+
+    size_t count()
+    {
+      std::lock_guard<std::mutex> lock(muxWheel);
+      return m_nEntries;
+    }
+
+    // Drop every pending timeout, callbacks already running still finish
+    void clear()
+    {
+      std::lock_guard<std::mutex> lock(muxWheel);
+      for(auto& slot : m_vSlots)
+        slot.clear();
+      m_nEntries = 0;
+    }
+
+    // Nothing is scheduled and the timer isn't armed, the wheel can be
+    // destroyed while its context keeps running
+    bool idle()
+    {
+      std::lock_guard<std::mutex> lock(muxWheel);
+      return !m_bRunning;
+    }
+
+  protected:
+    void Arm()
+    {
+      m_timer.expires_at(m_tpNextTick);
+      m_timer.async_wait([this](std::error_code ec)
+      {
+        if(!ec)
+          Tick();
+      });
+    }
+
+    void Tick()
+    {
+      std::vector<std::function<void()>> vExpired;
+      {
+        std::lock_guard<std::mutex> lock(muxWheel);
+        m_nCurrent = (m_nCurrent + 1) % m_vSlots.size();
+
+        auto& slot = m_vSlots[m_nCurrent];
+        for(size_t i = 0; i < slot.size();)
+        {
+          if(slot[i].nRounds == 0)
+          {
+            vExpired.push_back(std::move(slot[i].fn));
+            if(i != slot.size() - 1)
+              slot[i] = std::move(slot.back());
+            slot.pop_back();
+          }
+          else
+            slot[i++].nRounds--;
+        }
+        m_nEntries -= vExpired.size();
+
+        // keep the ideal timeline so the wheel doesn't drift
+        m_tpNextTick += m_resolution;
+      }
+
+      // callbacks can schedule again, don't hold the lock,
+      // the wheel counts as running meanwhile so nobody else arms the timer
+      for(auto& fn : vExpired)
+        fn();
+
+      std::lock_guard<std::mutex> lock(muxWheel);
+      if(m_nEntries > 0)
+        Arm();
+      else
+        m_bRunning = false;
+    }
+  };
+
+  // The timing wheel of an io_context, one per context however many clients
+  // share it, asio::use_service<timing_wheel_service>(context).wheel()
+  // It lives as long as the context, so pending timeouts never outlive it
+  class timing_wheel_service : public asio::execution_context::service
+  {
+  public:
+    static inline asio::execution_context::id id;
+
+    explicit timing_wheel_service(asio::io_context& context)
+      : asio::execution_context::service(context),
+        m_pWheel(std::make_unique<timing_wheel>(context))
+    {}
+
+    timing_wheel& wheel()
+    {
+      return *m_pWheel;
+    }
+
+  private:
+    // the wheel's timer has to go while the context's services are still there
+    void shutdown() override
+    {
+      m_pWheel.reset();
+    }
+
+    std::unique_ptr<timing_wheel> m_pWheel;
+  };
+
+}
@@ -0,0 +1,305 @@
+#pragma once
+
+#include "message.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <asio.hpp>
+
+
+namespace sonicpp
+{
+
+  // UDP channel next to the TCP connection
+  // After the handshake the server hands the client a token over TCP, the
+  // client sends it in every datagram and the server learns the client's
+  // address from them. Messages keep their framing and arrive through the
+  // same queue and handlers as the stream ones. Until the channel is bound,
+  // or when a message doesn't fit, it goes over TCP instead.
+  struct UdpConfig
+  {
+    bool bEnabled = false;
+    // server: port of the datagram socket, zero uses the TCP port
+    uint16_t nPort = 0;
+    // largest datagram sent, below the path MTU nothing gets fragmented by IP,
+    // larger reliable messages are split into fragments
+    size_t nMaxDatagram = 1200;
+    // client: the binding request is repeated until the server confirms it
+    std::chrono::milliseconds bindRetry{200};
+    size_t nBindAttempts = 10;
+
+    // Reliable channels
+    // retransmissions and delayed acks are checked this often while anything is in flight
+    std::chrono::milliseconds tick{10};
+    // bounds of the retransmission timeout, which follows the measured round trip
+    std::chrono::milliseconds minRetransmit{20};
+    std::chrono::milliseconds maxRetransmit{1000};
+    // fragments sent and not acknowledged yet, the rest waits
+    size_t nSendWindow = 256;
+    // larger reliable messages go over TCP
+    size_t nMaxMessage = 256 * 1024;
+    // bytes a peer can make the receiver hold for reassembly, incomplete and
+    // out of order messages, past it new messages aren't acknowledged and wait
+    // for a retransmission. The next message of a stream may go nMaxMessage over.
+    size_t nMaxReassembly = 512 * 1024;
+    // datagrams read per system call
+    size_t nReceiveBatch = 16;
+  };
+
+  // How a message travels over UDP
+  enum class Delivery : uint8_t
+  {
+    // may be lost, duplicated or reordered
+    Unreliable,
+    // retransmitted until acknowledged, delivered in order within its stream
+    Ordered,
+    // retransmitted until acknowledged, delivered as soon as it is complete
+    Unordered
+  };
+
+  struct UdpChannel
+  {
+    Delivery delivery = Delivery::Unreliable;
+    // independent ordered streams, a lost message only holds back its own stream
+    uint8_t nStream = 0;
+  };
+
+  // Which message types go over UDP and how, the rest takes TCP
+  template<typename T>
+  class udp_routes
+  {
+  protected:
+    std::unordered_map<std::underlying_type_t<T>, UdpChannel> m_mapChannels;
+    std::optional<UdpChannel> m_default;
+
+  public:
+    void set(T id, UdpChannel channel)
+    {
+      m_mapChannels[static_cast<std::underlying_type_t<T>>(id)] = channel;
+    }
+
+    // every type not set explicitly, e.g. to move all traffic off TCP
+    void set_default(UdpChannel channel)
+    {
+      m_default = channel;
+    }
+
+    // library messages always stay on TCP
+    std::optional<UdpChannel> find(T id) const
+    {
+      if(is_system_id(id))
+        return std::nullopt;
+      auto it = m_mapChannels.find(static_cast<std::underlying_type_t<T>>(id));
+      if(it != m_mapChannels.end())
+        return it->second;
+      return m_default;
+    }
+  };
+
+  // Largest payload of a UDP datagram
+  constexpr size_t max_datagram_size = 65507;
+
+  // Datagrams waiting to be sent, the buffers are reused between batches
+  class packet_batch
+  {
+  protected:
+    std::vector<std::vector<uint8_t>> m_vPackets;
+    size_t m_nCount = 0;
+
+  public:
+    // a new empty packet at the end of the batch
+    std::vector<uint8_t>& add()
+    {
+      if(m_nCount == m_vPackets.size())
+        m_vPackets.emplace_back();
+      auto& packet = m_vPackets[m_nCount++];
+      packet.clear();
+      return packet;
+    }
+
+    const std::vector<uint8_t>& operator[](size_t i) const { return m_vPackets[i]; }
+    size_t size() const { return m_nCount; }
+    bool empty() const { return m_nCount == 0; }
+    void clear() { m_nCount = 0; }
+  };
+
+  // Sends the whole batch, with a single sendmmsg per 64 datagrams on Linux.
+  // The client puts its token in front of each datagram. Never blocks, a full
+  // socket buffer loses the rest. Sending on the descriptor is safe next to the
+  // socket's pending operations, so connections on different threads can share
+  // the server's socket. Returns the bytes sent
+  inline size_t send_datagrams(int nSocket, const asio::ip::udp::endpoint* pTo, const uint64_t* pToken,
+    const packet_batch& packets, std::error_code& ec)
+  {
+    constexpr size_t nChunk = 64;
+    iovec vBuffers[nChunk][2];
+    size_t nBytes = 0;
+
+    for(size_t nFirst = 0; nFirst < packets.size(); nFirst += nChunk)
+    {
+      const size_t nCount = std::min(nChunk, packets.size() - nFirst);
+#if defined(__linux__)
+      mmsghdr vHeaders[nChunk]{};
+#else
+      msghdr vHeaders[nChunk]{};
+#endif
+      for(size_t i = 0; i < nCount; ++i)
+      {
+        const auto& packet = packets[nFirst + i];
+        size_t nBuffers = 0;
+        if(pToken)
+          vBuffers[i][nBuffers++] = {const_cast<uint64_t*>(pToken), sizeof(uint64_t)};
+        vBuffers[i][nBuffers++] = {const_cast<uint8_t*>(packet.data()), packet.size()};
+#if defined(__linux__)
+        msghdr& header = vHeaders[i].msg_hdr;
+#else
+        msghdr& header = vHeaders[i];
+#endif
+        if(pTo)
+        {
+          header.msg_name = const_cast<sockaddr*>(reinterpret_cast<const sockaddr*>(pTo->data()));
+          header.msg_namelen = pTo->size();
+        }
+        header.msg_iov = vBuffers[i];
+        header.msg_iovlen = nBuffers;
+      }
+
+#if defined(__linux__)
+      int nSent = ::sendmmsg(nSocket, vHeaders, nCount, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if(nSent < 0)
+      {
+        ec = std::error_code(errno, std::system_category());
+        return nBytes;
+      }
+      for(int i = 0; i < nSent; ++i)
+        nBytes += vHeaders[i].msg_len;
+      if(size_t(nSent) < nCount)
+        return nBytes;
+#else
+      for(size_t i = 0; i < nCount; ++i)
+      {
+        auto nSent = ::sendmsg(nSocket, &vHeaders[i], MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(nSent < 0)
+        {
+          ec = std::error_code(errno, std::system_category());
+          return nBytes;
+        }
+        nBytes += nSent;
+      }
+#endif
+    }
+    return nBytes;
+  }
+
+  // Receive buffers drained with a single recvmmsg on Linux
+  class datagram_batch
+  {
+  protected:
+    std::vector<uint8_t> m_vStorage;
+    std::vector<iovec> m_vBuffers;
+    std::vector<sockaddr_storage> m_vFrom;
+#if defined(__linux__)
+    std::vector<mmsghdr> m_vHeaders;
+#else
+    std::vector<msghdr> m_vHeaders;
+    std::vector<size_t> m_vLengths;
+#endif
+
+  public:
+    void resize(size_t nCount, size_t nSize = max_datagram_size)
+    {
+      nCount = std::max<size_t>(1, nCount);
+      m_vStorage.resize(nCount * nSize);
+      m_vBuffers.resize(nCount);
+      m_vFrom.resize(nCount);
+      m_vHeaders.assign(nCount, {});
+#if !defined(__linux__)
+      m_vLengths.resize(nCount);
+#endif
+      for(size_t i = 0; i < nCount; ++i)
+        m_vBuffers[i] = {m_vStorage.data() + i * nSize, nSize};
+    }
+
+    // Reads what is queued without blocking, returns the number of datagrams,
+    // zero when there are none or on errors
+    size_t receive(int nSocket)
+    {
+      for(size_t i = 0; i < m_vHeaders.size(); ++i)
+      {
+        msghdr& header = get(i);
+        header = {};
+        header.msg_name = &m_vFrom[i];
+        header.msg_namelen = sizeof(sockaddr_storage);
+        header.msg_iov = &m_vBuffers[i];
+        header.msg_iovlen = 1;
+      }
+#if defined(__linux__)
+      int nReceived = ::recvmmsg(nSocket, m_vHeaders.data(), m_vHeaders.size(), MSG_DONTWAIT, nullptr);
+      return nReceived > 0 ? size_t(nReceived) : 0;
+#else
+      size_t nReceived = 0;
+      for(; nReceived < m_vHeaders.size(); ++nReceived)
+      {
+        auto nLength = ::recvmsg(nSocket, &m_vHeaders[nReceived], MSG_DONTWAIT);
+        if(nLength < 0)
+          break;
+        m_vLengths[nReceived] = nLength;
+      }
+      return nReceived;
+#endif
+    }
+
+    size_t capacity() const { return m_vHeaders.size(); }
+    const uint8_t* data(size_t i) const { return static_cast<const uint8_t*>(m_vBuffers[i].iov_base); }
+
+    size_t size(size_t i) const
+    {
+#if defined(__linux__)
+      return m_vHeaders[i].msg_len;
+#else
+      return m_vLengths[i];
+#endif
+    }
+
+    asio::ip::udp::endpoint from(size_t i) const
+    {
+      asio::ip::udp::endpoint endpoint;
+      const size_t nLength = std::min<size_t>(get(i).msg_namelen, endpoint.capacity());
+      std::memcpy(endpoint.data(), &m_vFrom[i], nLength);
+      endpoint.resize(nLength);
+      return endpoint;
+    }
+
+  protected:
+    msghdr& get(size_t i)
+    {
+#if defined(__linux__)
+      return m_vHeaders[i].msg_hdr;
+#else
+      return m_vHeaders[i];
+#endif
+    }
+
+    const msghdr& get(size_t i) const
+    {
+#if defined(__linux__)
+      return m_vHeaders[i].msg_hdr;
+#else
+      return m_vHeaders[i];
+#endif
+    }
+  };
+
+}
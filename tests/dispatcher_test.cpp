@@ -0,0 +1,111 @@
+// Malformed messages have to be dropped by the dispatcher instead of being
+// extracted past the end of their body, see library/dispatcher.h
+#include "../library/dispatcher.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+enum class TestMsg : uint32_t
+{
+  Pair,
+  Text,
+  Items
+};
+
+struct Vec2
+{
+  int32_t x, y;
+};
+
+static int nFailures = 0;
+
+#define CHECK(expr) do { if(!(expr)) { std::printf("FAILED %s:%d %s\n", __FILE__, __LINE__, #expr); ++nFailures; } } while(0)
+
+static sonicpp::Message<TestMsg> make(TestMsg id)
+{
+  sonicpp::Message<TestMsg> msg;
+  msg.header.id = id;
+  return msg;
+}
+
+int main()
+{
+  sonicpp::counter malformed;
+  sonicpp::Dispatcher<TestMsg> dispatcher(&malformed);
+  using ClientPtr = sonicpp::Dispatcher<TestMsg>::ClientPtr;
+
+  int nPairs = 0, nTexts = 0, nItems = 0;
+  dispatcher.On<TestMsg::Pair>([&](const ClientPtr&, uint32_t nId, Vec2 pos)
+  {
+    CHECK(nId == 7);
+    CHECK(pos.x == 1 && pos.y == 2);
+    nPairs++;
+  });
+  dispatcher.On<TestMsg::Text>([&](std::string sText)
+  {
+    CHECK(sText == "hello");
+    nTexts++;
+  });
+  dispatcher.On<TestMsg::Items>([&](std::vector<uint16_t> vItems)
+  {
+    CHECK(vItems.size() == 3);
+    nItems++;
+  });
+
+  // well formed, payloads are pushed in reverse parameter order
+  {
+    auto msg = make(TestMsg::Pair);
+    msg << Vec2{1, 2} << uint32_t(7);
+    CHECK(dispatcher.Dispatch(nullptr, msg));
+    auto text = make(TestMsg::Text);
+    text << std::string("hello");
+    CHECK(dispatcher.Dispatch(nullptr, text));
+    auto items = make(TestMsg::Items);
+    items << std::vector<uint16_t>{1, 2, 3};
+    CHECK(dispatcher.Dispatch(nullptr, items));
+  }
+  CHECK(nPairs == 1 && nTexts == 1 && nItems == 1);
+  CHECK(malformed.load() == 0);
+
+  // empty, short and long bodies never reach the handler
+  {
+    auto empty = make(TestMsg::Pair);
+    CHECK(dispatcher.Dispatch(nullptr, empty));
+
+    auto shorter = make(TestMsg::Pair);
+    shorter << uint32_t(7);
+    CHECK(dispatcher.Dispatch(nullptr, shorter));
+
+    auto longer = make(TestMsg::Pair);
+    longer << uint8_t(0) << Vec2{1, 2} << uint32_t(7);
+    CHECK(dispatcher.Dispatch(nullptr, longer));
+  }
+  CHECK(nPairs == 1);
+  CHECK(dispatcher.Malformed(TestMsg::Pair) == 3);
+
+  // element counts larger than the body
+  {
+    auto text = make(TestMsg::Text);
+    text << std::string::size_type(1000);
+    CHECK(dispatcher.Dispatch(nullptr, text));
+
+    auto items = make(TestMsg::Items);
+    items << uint16_t(1) << std::vector<uint16_t>::size_type(-1);
+    CHECK(dispatcher.Dispatch(nullptr, items));
+
+    auto tiny = make(TestMsg::Items);
+    tiny << uint8_t(3);
+    CHECK(dispatcher.Dispatch(nullptr, tiny));
+  }
+  CHECK(nTexts == 1 && nItems == 1);
+  CHECK(dispatcher.Malformed(TestMsg::Text) == 1);
+  CHECK(dispatcher.Malformed(TestMsg::Items) == 2);
+  CHECK(malformed.load() == 6);
+
+  if(nFailures)
+    return 1;
+  std::printf("dispatcher: ok\n");
+  return 0;
+}
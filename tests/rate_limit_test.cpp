@@ -0,0 +1,113 @@
+// Inbound rate limits have to hold on every transport a remote process can
+// use, TCP and shared memory, see Connection::ChargeRateLimit in library/connection.h
+#include "../library/server.h"
+#include "../library/client.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+enum class TestMsg : uint32_t
+{
+  Hello
+};
+
+static int nFailures = 0;
+
+#define CHECK(expr) do { if(!(expr)) { std::printf("FAILED %s:%d %s\n", __FILE__, __LINE__, #expr); ++nFailures; } } while(0)
+
+using Action = sonicpp::RateLimitConfig::Action;
+
+class TestServer : public sonicpp::ServerInterface<TestMsg>
+{
+public:
+  TestServer(uint16_t nPort, Action action, const std::string& sPath)
+    : sonicpp::ServerInterface<TestMsg>(nPort)
+  {
+    SetRateLimit({.fMessagesPerSecond = 100, .fMessageBurst = 100, .action = action});
+    SetSharedMemory({.bEnabled = true, .sPath = sPath});
+  }
+
+  int nMessages = 0;
+  int nDisconnects = 0;
+
+protected:
+  bool OnClientConnect(std::shared_ptr<sonicpp::Connection<TestMsg>>) override
+  {
+    return true;
+  }
+
+  void OnClientDisconnect(std::shared_ptr<sonicpp::Connection<TestMsg>>) override
+  {
+    nDisconnects++;
+  }
+
+  void OnMessage(std::shared_ptr<sonicpp::Connection<TestMsg>>, sonicpp::Message<TestMsg>&) override
+  {
+    nMessages++;
+  }
+};
+
+class TestClient : public sonicpp::ClientIntefrace<TestMsg>
+{
+public:
+  TestClient() : sonicpp::ClientIntefrace<TestMsg>(sonicpp::ClientMode::Threaded) {}
+};
+
+// 1000 messages against a burst of 100 refilled at 100/s, for half a second
+static void flood(Action action, bool bShared, uint16_t nPort)
+{
+  const std::string sPath = "/tmp/sonicpp_rate_limit_test_" + std::to_string(nPort);
+  TestServer server(nPort, action, sPath);
+  CHECK(server.Start());
+
+  // a small ring fills up while the server pauses
+  sonicpp::SharedMemoryConfig shm;
+  shm.nRingSize = 4096;
+  TestClient client;
+  client.SetSharedMemory(shm);
+  CHECK(bShared ? client.ConnectShared(sPath) : client.Connect("127.0.0.1", nPort));
+
+  sonicpp::Message<TestMsg> msg{TestMsg::Hello};
+  msg << uint32_t(1);
+  for(int i = 0; i < 1000; ++i)
+    client.Send(msg);
+
+  auto tpStop = std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+  while(std::chrono::steady_clock::now() < tpStop)
+  {
+    server.Update();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  switch(action)
+  {
+    case Action::Pause:
+      CHECK(server.nMessages > 100 && server.nMessages < 1000);
+      CHECK(server.nDisconnects == 0);
+      break;
+    case Action::Drop:
+      CHECK(server.nMessages >= 100 && server.nMessages < 1000);
+      CHECK(server.nDisconnects == 0);
+      break;
+    case Action::Kick:
+      CHECK(server.nMessages < 1000);
+      CHECK(server.nDisconnects == 1);
+      break;
+  }
+  client.Disconnect();
+}
+
+int main()
+{
+  uint16_t nPort = 60751;
+  for(bool bShared : {false, true})
+    for(Action action : {Action::Pause, Action::Drop, Action::Kick})
+      flood(action, bShared, nPort++);
+
+  if(nFailures)
+    return 1;
+  std::printf("rate limit: ok\n");
+  return 0;
+}
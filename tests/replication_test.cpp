@@ -0,0 +1,142 @@
+// Snapshot deltas have to round trip against acknowledged baselines, and
+// malformed snapshots or acks have to be refused, see library/replication.h
+#include "../library/replication.h"
+
+#include <cstdint>
+#include <cstdio>
+
+enum class TestMsg : uint32_t
+{
+  Snapshot,
+  Ack
+};
+
+struct Entity
+{
+  int32_t x, y;
+  uint32_t nHealth;
+};
+
+static int nFailures = 0;
+
+#define CHECK(expr) do { if(!(expr)) { std::printf("FAILED %s:%d %s\n", __FILE__, __LINE__, #expr); ++nFailures; } } while(0)
+
+using Server = sonicpp::ReplicationServer<TestMsg, Entity, 4>;
+using Client = sonicpp::ReplicationClient<TestMsg, Entity, 4>;
+
+static bool same(const Entity& a, const Entity& b)
+{
+  return a.x == b.x && a.y == b.y && a.nHealth == b.nHealth;
+}
+
+static sonicpp::Message<TestMsg> ack(uint32_t seq)
+{
+  sonicpp::Message<TestMsg> msg{TestMsg::Ack};
+  msg << seq;
+  return msg;
+}
+
+int main()
+{
+  // never started, only the message building is used
+  sonicpp::ServerInterface<TestMsg> network(60761);
+  Server server(network, TestMsg::Snapshot);
+  Client client;
+  const uint32_t nClient = 7;
+
+  // nothing acknowledged yet, the whole world goes out
+  server.SetEntity(1, {1, 2, 100});
+  server.SetEntity(2, {3, 4, 100});
+  server.Capture();
+  auto full = server.DeltaFor(nClient);
+  const size_t nFullSize = full.body.size();
+  CHECK(client.Apply(full));
+  CHECK(client.World().size() == 2);
+  CHECK(same(client.World().at(1), {1, 2, 100}));
+  CHECK(same(client.World().at(2), {3, 4, 100}));
+
+  auto reply = client.AckMessage(TestMsg::Ack);
+  CHECK(server.OnAck(nClient, reply));
+  CHECK(server.TrackedClients() == 1);
+
+  // one changed word, one removed and one new entity against that baseline
+  server.SetEntity(1, {5, 2, 100});
+  server.RemoveEntity(2);
+  server.SetEntity(3, {6, 7, 50});
+  server.Capture();
+  auto delta = server.DeltaFor(nClient);
+  CHECK(delta.body.size() < nFullSize);
+  CHECK(client.Apply(delta));
+  CHECK(client.World().size() == 2);
+  CHECK(same(client.World().at(1), {5, 2, 100}));
+  CHECK(same(client.World().at(3), {6, 7, 50}));
+
+  // unchanged world, only the header and the counts
+  reply = client.AckMessage(TestMsg::Ack);
+  CHECK(server.OnAck(nClient, reply));
+  server.Capture();
+  auto empty = server.DeltaFor(nClient);
+  CHECK(empty.body.size() == 4 * sizeof(uint32_t));
+  CHECK(client.Apply(empty));
+  CHECK(client.World().size() == 2);
+
+  // malformed acks are refused, acks of the future are ignored
+  {
+    sonicpp::Message<TestMsg> none{TestMsg::Ack};
+    CHECK(!server.OnAck(nClient, none));
+    auto longer = ack(1);
+    longer << uint8_t(0);
+    CHECK(!server.OnAck(nClient, longer));
+    auto future = ack(1000);
+    CHECK(server.OnAck(nClient, future));
+    auto stranger = ack(0);
+    CHECK(server.OnAck(nClient + 1, stranger));
+    CHECK(server.TrackedClients() == 1);
+  }
+
+  // truncated, garbled and padded snapshots leave the world untouched
+  {
+    server.SetEntity(1, {8, 8, 8});
+    server.Capture();
+    const auto next = server.DeltaFor(nClient);
+
+    for(size_t nCut = 1; nCut < next.body.size(); ++nCut)
+    {
+      auto truncated = next;
+      truncated.body.erase(truncated.body.begin(), truncated.body.begin() + nCut);
+      CHECK(!client.Apply(truncated));
+    }
+
+    auto padded = next;
+    padded.body.insert(padded.body.begin(), 4, 0);
+    CHECK(!client.Apply(padded));
+
+    sonicpp::Message<TestMsg> garbled{TestMsg::Snapshot};
+    garbled << uint32_t(0) << uint64_t(-1) << uint32_t(9) << uint32_t(1) << uint32_t(0) << uint32_t(100);
+    CHECK(!client.Apply(garbled));
+
+    sonicpp::Message<TestMsg> tiny{TestMsg::Snapshot};
+    tiny << uint8_t(1);
+    CHECK(!client.Apply(tiny));
+
+    CHECK(same(client.World().at(1), {5, 2, 100}));
+    auto intact = next;
+    CHECK(client.Apply(intact));
+    CHECK(same(client.World().at(1), {8, 8, 8}));
+  }
+
+  // a client that stops acknowledging is forgotten once its baseline is out of history
+  for(int i = 0; i < 4; ++i)
+    server.Capture();
+  CHECK(server.TrackedClients() == 0);
+  reply = client.AckMessage(TestMsg::Ack);
+  CHECK(server.OnAck(nClient, reply));
+  CHECK(server.TrackedClients() == 1);
+  server.RemoveClient(nClient);
+  CHECK(server.TrackedClients() == 0);
+
+  if(nFailures)
+    return 1;
+  std::printf("replication: ok\n");
+  return 0;
+}
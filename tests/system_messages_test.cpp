@@ -0,0 +1,156 @@
+// Library messages come from the remote side, a malformed one has to get the
+// connection kicked instead of being extracted past the end of its body,
+// see Connection::CheckSystemBody in library/connection.h
+#include "../library/server.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <vector>
+
+enum class TestMsg : uint32_t
+{
+  Echo
+};
+
+using Header = sonicpp::message_header<TestMsg>;
+
+static int nFailures = 0;
+
+#define CHECK(expr) do { if(!(expr)) { std::printf("FAILED %s:%d %s\n", __FILE__, __LINE__, #expr); ++nFailures; } } while(0)
+
+class TestServer : public sonicpp::ServerInterface<TestMsg>
+{
+public:
+  using sonicpp::ServerInterface<TestMsg>::ServerInterface;
+
+  int nDisconnects = 0;
+  int nEchoes = 0;
+
+protected:
+  bool OnClientConnect(std::shared_ptr<sonicpp::Connection<TestMsg>>) override
+  {
+    return true;
+  }
+
+  void OnClientDisconnect(std::shared_ptr<sonicpp::Connection<TestMsg>>) override
+  {
+    nDisconnects++;
+  }
+
+  void OnMessage(std::shared_ptr<sonicpp::Connection<TestMsg>>, sonicpp::Message<TestMsg>&) override
+  {
+    nEchoes++;
+  }
+};
+
+// same as Connection::scramble, a raw socket has to answer the challenge itself
+static uint64_t scramble(uint64_t nInput)
+{
+  uint64_t out = nInput ^ 0x8084A1AEB05774E3;
+  out = (out & 0xAFD6C6A5A4DA07B7) >> 4 | (out & 0xB2C0E02AA82ECB8F) << 4;
+  return out ^ 0xDC91D19D4907AFE9;
+}
+
+static asio::ip::tcp::socket handshake(asio::io_context& context, uint16_t nPort)
+{
+  asio::ip::tcp::socket socket(context);
+  socket.connect({asio::ip::address_v4::loopback(), nPort});
+  uint64_t nChallenge = 0;
+  asio::read(socket, asio::buffer(&nChallenge, sizeof(nChallenge)));
+  sonicpp::handshake_reply reply{};
+  reply.nAnswer = scramble(nChallenge);
+  asio::write(socket, asio::buffer(&reply, sizeof(reply)));
+  return socket;
+}
+
+static void send(asio::ip::tcp::socket& socket, TestMsg id, size_t nBytes)
+{
+  std::vector<uint8_t> vFrame(sizeof(Header) + nBytes);
+  Header header{id, uint32_t(nBytes)};
+  std::memcpy(vFrame.data(), &header, sizeof(header));
+  asio::write(socket, asio::buffer(vFrame));
+}
+
+// reads messages until one of the given type arrives, false once the server hung up
+static bool receive(asio::ip::tcp::socket& socket, TestMsg id, Header& header)
+{
+  asio::error_code ec;
+  std::vector<uint8_t> vBody;
+  do
+  {
+    asio::read(socket, asio::buffer(&header, sizeof(header)), ec);
+    if(ec)
+      return false;
+    vBody.resize(header.size);
+    asio::read(socket, asio::buffer(vBody), ec);
+    if(ec)
+      return false;
+  } while(header.id != id);
+  return true;
+}
+
+static bool wait_for(const std::function<bool()>& done)
+{
+  for(int i = 0; i < 200 && !done(); ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  return done();
+}
+
+int main()
+{
+  using sonicpp::SystemMessage;
+  using sonicpp::system_id;
+  asio::io_context context;
+  Header header{};
+
+  // clock exchanges are answered, malformed ones get the connection kicked
+  {
+    TestServer server(60741);
+    server.SetClockSync({.bEnabled = true});
+    CHECK(server.Start());
+
+    auto socket = handshake(context, 60741);
+    send(socket, system_id<TestMsg>(SystemMessage::ClockRequest), sizeof(int64_t));
+    CHECK(receive(socket, system_id<TestMsg>(SystemMessage::ClockResponse), header));
+    CHECK(header.size == 3 * sizeof(int64_t));
+
+    send(socket, system_id<TestMsg>(SystemMessage::ClockRequest), 0);
+    CHECK(!receive(socket, TestMsg::Echo, header));
+    CHECK(wait_for([&](){ server.Update(); return server.nDisconnects == 1; }));
+
+    auto shorter = handshake(context, 60741);
+    send(shorter, system_id<TestMsg>(SystemMessage::ClockResponse), sizeof(int64_t));
+    CHECK(!receive(shorter, TestMsg::Echo, header));
+
+    auto longer = handshake(context, 60741);
+    send(longer, system_id<TestMsg>(SystemMessage::ClockRequest), 64);
+    CHECK(!receive(longer, TestMsg::Echo, header));
+    CHECK(wait_for([&](){ server.Update(); return server.nDisconnects == 3; }));
+
+    // the server survived and still serves new clients
+    auto next = handshake(context, 60741);
+    send(next, system_id<TestMsg>(SystemMessage::ClockRequest), sizeof(int64_t));
+    CHECK(receive(next, system_id<TestMsg>(SystemMessage::ClockResponse), header));
+  }
+
+  // without clock sync the messages are ignored whatever their size
+  {
+    TestServer server(60742);
+    CHECK(server.Start());
+
+    auto socket = handshake(context, 60742);
+    send(socket, system_id<TestMsg>(SystemMessage::ClockRequest), 0);
+    send(socket, system_id<TestMsg>(SystemMessage::ClockResponse), 5);
+    send(socket, TestMsg::Echo, 0);
+    CHECK(wait_for([&](){ server.Update(); return server.nEchoes == 1; }));
+    CHECK(server.nDisconnects == 0);
+  }
+
+  if(nFailures)
+    return 1;
+  std::printf("system messages: ok\n");
+  return 0;
+}
@@ -0,0 +1,629 @@
+// Load generator for the example servers
+// Spawns simulated clients (bots) on one shared io_context, speaks the protocol
+// of one of the examples and steps the number of bots up at a fixed interval.
+// After every step it reports message throughput, round trip and connect
+// latency percentiles and errors, so the load a server sustains can be read
+// off where the latencies take off.
+// Kernel time per message and context switches of the generator itself are
+// reported too, they compare builds with and without make IO_URING=1.
+//
+// usage: loadgen <ping|raylib|tictactoe> [--host 127.0.0.1] [--port 60000]
+//          [--clients 100] [--step 10] [--interval 5] [--rate msgs/s per bot]
+//          [--threads 2] [--area 3000]
+
+#include "../../library/client.h"
+#include "../../library/metrics.h"
+#include "../../library/log.h"
+#include "../../library/prediction.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+
+using clock_type = std::chrono::steady_clock;
+using namespace std::chrono_literals;
+
+
+// Protocols, mirrored from the examples without their dependencies
+// ---------------------------------------------------------------
+
+// examples/ping_server
+enum class PingMsg : uint32_t
+{
+  ServerAccept,
+  ServerDeny,
+  ServerPing,
+  MessageAll,
+  ServerMessage
+};
+
+// examples/raylib_2d_example/multiplayer_common.hpp
+enum class GameMsg : uint32_t
+{
+  Server_GetStatus,
+  Server_GetPing,
+
+  Client_Accepted,
+  Client_AssignID,
+  Client_RegisterWithServer,
+  Client_UnregisterWithServer,
+
+  Game_AddPlayer,
+  Game_RemovePlayer,
+  Game_UpdatePlayer,
+  Game_UpdatePlayerLook,
+
+  Game_PlayerInput,
+  Game_PlayerState,
+  Game_PlayerLeftView
+};
+
+struct Vec2 { float x, y; };
+
+// PlayerDescription::PlayerPhysDesc
+struct PlayerPhys
+{
+  Vec2 pos{0, 0};
+  Vec2 vel{0, 0};
+  Vec2 handsDir{0, 1};
+};
+
+// PlayerDescription, raylib colors are 4 bytes each
+struct PlayerDesc
+{
+  uint32_t uUniqueID = 0;
+  uint32_t lvl = 0;
+  uint8_t look[12]{255, 255, 255, 255, 0, 121, 241, 255, 230, 41, 55, 255};
+  PlayerPhys phys;
+};
+static_assert(sizeof(PlayerPhys) == 24 && sizeof(PlayerDesc) == 44, "Layout has to match the raylib example");
+
+// PlayerInput
+struct PlayerInput
+{
+  Vec2 direction{0, 0};
+  Vec2 handsDir{0, 1};
+  float deltaTime = 0;
+};
+
+// examples/tic_tac_toe/common.h
+enum class TicTacToeMsg : uint32_t
+{
+  ServerAccept,
+  Move,
+  GameEnd,
+};
+
+struct Move{
+  uint8_t x;
+  uint8_t y;
+};
+
+
+// Measurements of one step, shared by all bots
+// ---------------------------------------------------------------
+
+struct Stats
+{
+  // microseconds
+  sonicpp::histogram rtt;
+  // Connect() until the first message from the server
+  sonicpp::histogram connect;
+  sonicpp::counter nSent;
+  sonicpp::counter nReceived;
+  sonicpp::counter nConnectFailures;
+  sonicpp::counter nDrops;
+  // finished tic-tac-toe games
+  sonicpp::counter nGames;
+};
+
+static uint64_t micros(clock_type::duration d)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+
+// Bots
+// ---------------------------------------------------------------
+
+struct Options
+{
+  std::string protocol;
+  std::string host = "127.0.0.1";
+  uint16_t port = 60'000;
+  size_t nClients = 100;
+  size_t nStep = 10;
+  size_t nIntervalSeconds = 5;
+  // messages per second per bot, 0 picks the protocol's default
+  double fRate = 0;
+  size_t nThreads = 2;
+  float fArea = 3000;
+};
+
+template<typename T>
+class Bot : public sonicpp::ClientIntefrace<T>
+{
+public:
+  using Message = sonicpp::Message<T>;
+
+  Stats* pStats = nullptr;
+  clock_type::time_point tpConnect{};
+  bool bReceived = false;
+  bool bDead = false;
+  clock_type::time_point tpDied{};
+  // the bot is done and should be replaced by a new one
+  bool bFinished = false;
+
+protected:
+  const Options& m_options;
+  clock_type::duration m_period;
+  clock_type::time_point m_tpNextSend;
+  std::minstd_rand m_rng;
+
+public:
+  Bot(asio::io_context& context, const Options& options, uint32_t nSeed)
+    : sonicpp::ClientIntefrace<T>(context), m_options(options),
+      m_period(std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(1.0 / options.fRate))),
+      m_rng(nSeed)
+  {
+    // spread the bots over the period so they don't send in lockstep
+    m_tpNextSend = clock_type::now() + m_period * (m_rng() % 1000) / 1000;
+  }
+
+  void Start()
+  {
+    tpConnect = clock_type::now();
+    if(!this->Connect(m_options.host, m_options.port))
+      Fail();
+    else
+      OnStart();
+  }
+
+  // Called by the driver thread in a loop
+  void Drive(clock_type::time_point now, Stats& stats)
+  {
+    pStats = &stats;
+    this->HandleMessages();
+    if(!this->IsConnected())
+    {
+      Fail();
+      return;
+    }
+    if(bReceived && now >= m_tpNextSend)
+    {
+      m_tpNextSend += m_period;
+      // fell behind, don't burst to catch up
+      if(m_tpNextSend < now)
+        m_tpNextSend = now + m_period;
+      OnSend(now);
+    }
+  }
+
+protected:
+  virtual void OnStart() {}
+  virtual void OnSend(clock_type::time_point now) = 0;
+  virtual void OnServerMessage(Message& msg) = 0;
+
+  void SendCounted(Message& msg)
+  {
+    this->Send(msg);
+    pStats->nSent.add();
+  }
+
+  void OnMessage(Message& msg) override
+  {
+    if(!bReceived)
+    {
+      bReceived = true;
+      pStats->connect.record(micros(clock_type::now() - tpConnect));
+    }
+    pStats->nReceived.add();
+    OnServerMessage(msg);
+  }
+
+private:
+  void Fail()
+  {
+    if(bDead)
+      return;
+    bDead = true;
+    tpDied = clock_type::now();
+    if(pStats)
+      (bReceived ? pStats->nDrops : pStats->nConnectFailures).add();
+  }
+};
+
+// Sends pings, the server echoes them back
+class PingBot : public Bot<PingMsg>
+{
+public:
+  using Bot::Bot;
+
+protected:
+  void OnStart() override
+  {
+    // held until the handshake is done, its echo tells when we are connected
+    Message msg{PingMsg::ServerPing};
+    msg << clock_type::now();
+    this->Send(msg);
+  }
+
+  void OnSend(clock_type::time_point now) override
+  {
+    Message msg{PingMsg::ServerPing};
+    msg << now;
+    SendCounted(msg);
+  }
+
+  void OnServerMessage(Message& msg) override
+  {
+    if(msg.GetType() != PingMsg::ServerPing)
+      return;
+    clock_type::time_point tpSent;
+    msg >> tpSent;
+    pStats->rtt.record(micros(clock_type::now() - tpSent));
+  }
+};
+
+// Joins the game and sends movement inputs at a frame rate, the server applies
+// them, answers with its state and forwards the result to the players in view.
+// The round trip is from an input to the state acknowledging it.
+class GameBot : public Bot<GameMsg>
+{
+  PlayerDesc m_desc{};
+  bool bJoined = false;
+  uint32_t m_nSequence = 1;
+  // send time of the recent inputs by their sequence number
+  std::array<clock_type::time_point, 256> m_vInputSent{};
+
+public:
+  using Bot::Bot;
+
+protected:
+  void OnSend(clock_type::time_point now) override
+  {
+    if(!bJoined)
+      return;
+
+    // random walk around the spawn
+    std::uniform_real_distribution<float> step(-1.f, 1.f);
+    sonicpp::sequenced_input<PlayerInput> input{m_nSequence++, {}};
+    input.input.direction = {step(m_rng), step(m_rng)};
+    input.input.deltaTime = float(1.0 / m_options.fRate);
+
+    m_vInputSent[input.nSequence % m_vInputSent.size()] = now;
+    Message msg{GameMsg::Game_PlayerInput};
+    msg << input;
+    SendCounted(msg);
+  }
+
+  void OnServerMessage(Message& msg) override
+  {
+    switch(msg.GetType())
+    {
+      case GameMsg::Client_Accepted:
+      {
+        std::uniform_real_distribution<float> spawn(0.f, m_options.fArea);
+        m_desc.phys.pos = {spawn(m_rng), spawn(m_rng)};
+        Message msgSend{GameMsg::Client_RegisterWithServer};
+        msgSend << m_desc;
+        SendCounted(msgSend);
+      }
+      break;
+      case GameMsg::Client_AssignID:
+        msg >> m_desc.uUniqueID;
+      break;
+      case GameMsg::Game_AddPlayer:
+      {
+        PlayerDesc desc;
+        msg >> desc;
+        if(desc.uUniqueID == m_desc.uUniqueID)
+          bJoined = true;
+      }
+      break;
+      case GameMsg::Game_PlayerState:
+      {
+        sonicpp::acked_state<PlayerPhys> state;
+        msg >> state;
+        const uint32_t nBehind = m_nSequence - 1 - state.nAck;
+        if(state.nAck != 0 && nBehind < m_vInputSent.size())
+          pStats->rtt.record(micros(clock_type::now() - m_vInputSent[state.nAck % m_vInputSent.size()]));
+      }
+      break;
+      default:
+      break;
+    }
+  }
+};
+
+// Plays random valid moves, the round trip is from a move to its broadcast.
+// The example server hosts a single game of two players, bots beyond that
+// are refused. Finished games are left and replaced by new bots.
+class TicTacToeBot : public Bot<TicTacToeMsg>
+{
+  char m_board[3][3]{};
+  char m_symbol = 0;
+  bool m_bMyRound = false;
+  clock_type::time_point m_tpMove{};
+
+public:
+  using Bot::Bot;
+
+protected:
+  void OnSend(clock_type::time_point now) override
+  {
+    if(!m_bMyRound)
+      return;
+
+    std::vector<Move> vFree;
+    for(uint8_t y = 0; y < 3; ++y)
+      for(uint8_t x = 0; x < 3; ++x)
+        if(m_board[y][x] == 0)
+          vFree.push_back(Move{x, y});
+    if(vFree.empty())
+    {
+      Finish();
+      return;
+    }
+
+    Message msg{TicTacToeMsg::Move};
+    msg << vFree[m_rng() % vFree.size()];
+    SendCounted(msg);
+    m_tpMove = now;
+    m_bMyRound = false;
+  }
+
+  void OnServerMessage(Message& msg) override
+  {
+    switch(msg.GetType())
+    {
+      case TicTacToeMsg::ServerAccept:
+        msg >> m_symbol;
+        std::memset(m_board, 0, sizeof(m_board));
+        m_bMyRound = (m_symbol == 'o');
+      break;
+      case TicTacToeMsg::Move:
+      {
+        Move move;
+        char symbol, next;
+        msg >> next >> symbol >> move;
+        m_board[move.y][move.x] = symbol;
+        if(symbol == m_symbol)
+          pStats->rtt.record(micros(clock_type::now() - m_tpMove));
+        m_bMyRound = (next == m_symbol);
+
+        // a draw doesn't end the game on the server
+        bool bFull = true;
+        for(auto& row : m_board)
+          for(char c : row)
+            bFull &= (c != 0);
+        if(bFull)
+          Finish();
+      }
+      break;
+      case TicTacToeMsg::GameEnd:
+        Finish();
+      break;
+    }
+  }
+
+private:
+  void Finish()
+  {
+    if(bFinished)
+      return;
+    bFinished = true;
+    // both players count the game, halve it in the report
+    pStats->nGames.add();
+  }
+};
+
+
+// Swarm
+// ---------------------------------------------------------------
+
+template<typename B>
+class Swarm
+{
+  const Options& m_options;
+  asio::io_context m_context;
+  std::vector<std::thread> m_vIoThreads;
+  std::vector<std::thread> m_vDrivers;
+  std::atomic<size_t> m_nTarget{0};
+  std::atomic<size_t> m_nAlive{0};
+  std::atomic<Stats*> m_pStats{nullptr};
+  std::atomic<bool> m_bStop{false};
+  // every step's stats, late writes of the drivers still land somewhere valid
+  std::vector<std::unique_ptr<Stats>> m_vStats;
+
+public:
+  explicit Swarm(const Options& options) : m_options(options) {}
+
+  void Run()
+  {
+    m_vStats.push_back(std::make_unique<Stats>());
+    m_pStats = m_vStats.back().get();
+
+    auto work = asio::make_work_guard(m_context);
+    for(size_t i = 0; i < m_options.nThreads; ++i)
+      m_vIoThreads.emplace_back([this](){ m_context.run(); });
+    // bot logic runs on its own threads so handlers never wait on it
+    for(size_t i = 0; i < m_options.nThreads; ++i)
+      m_vDrivers.emplace_back([this, i](){ Drive(i); });
+
+    std::printf("%8s %8s %10s %10s %9s %9s %9s %9s %11s %11s %7s %7s %9s %9s%s\n",
+      "clients", "alive", "sent/s", "recv/s", "rtt p50", "rtt p90", "rtt p99", "rtt max",
+      "conn p50", "conn p99", "cfail", "drops", "sys/msg", "csw/s", std::is_same_v<B, TicTacToeBot> ? "  games/s" : "");
+
+    size_t nTarget = 0;
+    while(true)
+    {
+      bool bLast = nTarget >= m_options.nClients;
+      nTarget = std::min(m_options.nClients, nTarget + m_options.nStep);
+      m_nTarget = nTarget;
+
+      auto tpStart = clock_type::now();
+      rusage usageStart{};
+      getrusage(RUSAGE_SELF, &usageStart);
+      std::this_thread::sleep_for(std::chrono::seconds(m_options.nIntervalSeconds));
+
+      m_vStats.push_back(std::make_unique<Stats>());
+      Stats* pStep = m_pStats.exchange(m_vStats.back().get());
+      rusage usageEnd{};
+      getrusage(RUSAGE_SELF, &usageEnd);
+      Report(nTarget, *pStep, std::chrono::duration<double>(clock_type::now() - tpStart).count(), usageStart, usageEnd);
+
+      if(bLast)
+        break;
+    }
+
+    m_bStop = true;
+    for(auto& t : m_vDrivers)
+      t.join();
+    work.reset();
+    for(auto& t : m_vIoThreads)
+      t.join();
+  }
+
+private:
+  void Drive(size_t nDriver)
+  {
+    // this driver owns every bot with index nDriver + k * nThreads
+    std::vector<std::unique_ptr<B>> vBots;
+    std::minstd_rand rng(uint32_t(nDriver) + 1);
+
+    while(!m_bStop)
+    {
+      Stats& stats = *m_pStats.load();
+      auto now = clock_type::now();
+
+      size_t nTarget = m_nTarget;
+      while(nDriver + vBots.size() * m_options.nThreads < nTarget)
+      {
+        vBots.emplace_back();
+        Replace(vBots.back(), stats, rng);
+        m_nAlive++;
+      }
+
+      for(auto& bot : vBots)
+      {
+        if(bot->bDead)
+        {
+          // keep the number of bots up, after a pause so a refusing server isn't hammered
+          if(now - bot->tpDied < 1s)
+            continue;
+          Replace(bot, stats, rng);
+          m_nAlive++;
+          continue;
+        }
+        bot->Drive(now, stats);
+        if(bot->bDead)
+          m_nAlive--;
+        else if(bot->bFinished)
+          Replace(bot, stats, rng);
+      }
+
+      // keeps the round trip resolution well below a millisecond
+      std::this_thread::sleep_for(100us);
+    }
+
+    vBots.clear();
+  }
+
+  void Replace(std::unique_ptr<B>& bot, Stats& stats, std::minstd_rand& rng)
+  {
+    // waits for the old bot's pending handlers, doesn't block the io threads
+    bot = std::make_unique<B>(m_context, m_options, rng());
+    bot->pStats = &stats;
+    bot->Start();
+  }
+
+  void Report(size_t nTarget, const Stats& s, double fSeconds, const rusage& usageStart, const rusage& usageEnd)
+  {
+    auto ms = [](uint64_t us){ return us / 1000.0; };
+    auto us = [](const timeval& tv){ return tv.tv_sec * 1e6 + tv.tv_usec; };
+    // kernel time spent per message sent or received, mostly system calls
+    const double fMessages = std::max<double>(1, s.nSent.load() + s.nReceived.load());
+    const double fSysPerMsg = (us(usageEnd.ru_stime) - us(usageStart.ru_stime)) / fMessages;
+    const double fSwitches = (usageEnd.ru_nvcsw + usageEnd.ru_nivcsw) - (usageStart.ru_nvcsw + usageStart.ru_nivcsw);
+    std::printf("%8zu %8zu %10.0f %10.0f %7.2fms %7.2fms %7.2fms %7.2fms %9.2fms %9.2fms %7llu %7llu %7.2fus %9.0f",
+      nTarget, m_nAlive.load(),
+      s.nSent.load() / fSeconds, s.nReceived.load() / fSeconds,
+      ms(s.rtt.percentile(0.5)), ms(s.rtt.percentile(0.9)), ms(s.rtt.percentile(0.99)), ms(s.rtt.max()),
+      ms(s.connect.percentile(0.5)), ms(s.connect.percentile(0.99)),
+      (unsigned long long)s.nConnectFailures.load(), (unsigned long long)s.nDrops.load(),
+      fSysPerMsg, fSwitches / fSeconds);
+    if constexpr(std::is_same_v<B, TicTacToeBot>)
+      std::printf(" %9.2f", s.nGames.load() / 2.0 / fSeconds);
+    std::printf("\n");
+    std::fflush(stdout);
+  }
+};
+
+
+static void usage()
+{
+  std::fprintf(stderr,
+    "usage: loadgen <ping|raylib|tictactoe> [--host 127.0.0.1] [--port 60000]\n"
+    "         [--clients 100] [--step 10] [--interval 5] [--rate msgs/s per bot]\n"
+    "         [--threads 2] [--area 3000]\n");
+  std::exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc < 2)
+    usage();
+
+  Options options;
+  options.protocol = argv[1];
+  for(int i = 2; i + 1 < argc; i += 2)
+  {
+    std::string name = argv[i];
+    const char* value = argv[i + 1];
+    if(name == "--host") options.host = value;
+    else if(name == "--port") options.port = std::stoi(value);
+    else if(name == "--clients") options.nClients = std::stoul(value);
+    else if(name == "--step") options.nStep = std::max<size_t>(1, std::stoul(value));
+    else if(name == "--interval") options.nIntervalSeconds = std::stoul(value);
+    else if(name == "--rate") options.fRate = std::stod(value);
+    else if(name == "--threads") options.nThreads = std::max<size_t>(1, std::stoul(value));
+    else if(name == "--area") options.fArea = std::stof(value);
+    else usage();
+  }
+
+  // connects and disconnects of hundreds of bots would drown the report
+  sonicpp::logger::instance().set_level(sonicpp::LogLevel::Error);
+
+  if(options.protocol == "ping")
+  {
+    if(options.fRate <= 0) options.fRate = 10;
+    Swarm<PingBot>(options).Run();
+  }
+  else if(options.protocol == "raylib")
+  {
+    // the game client sends its state every frame
+    if(options.fRate <= 0) options.fRate = 60;
+    Swarm<GameBot>(options).Run();
+  }
+  else if(options.protocol == "tictactoe")
+  {
+    if(options.fRate <= 0) options.fRate = 5;
+    Swarm<TicTacToeBot>(options).Run();
+  }
+  else
+    usage();
+
+  return 0;
+}